@@ -57,20 +57,26 @@ L.Socket = L.Class.extend({
 		if (this._map._docLayer) {
 			// we are reconnecting after a lost connection
 			msg += ' part=' + this._map.getCurrentPartNumber();
+			// the new session has to be told about the viewport again
+			this._map._docLayer._lastViewportMsg = null;
 			this.fire('statusindicator', {statusType : 'reconnected'});
 		}
 		if (this._map.options.timestamp) {
 			msg += ' timestamp=' + this._map.options.timestamp;
 		}
+		if (this._map.options.permission === 'readonly') {
+			// 'view' is not, as it switches to editing without reloading
+			msg += ' workload=viewonly';
+		}
 		if (this._map.options.renderingOptions) {
 			var options = {
 				'rendering': this._map.options.renderingOptions
 			};
 			msg += ' options=' + JSON.stringify(options);
 		}
+		// the server pushes the status, page rectangles and toolbar
+		// values with the load, so there is no need to ask for them
 		this.socket.send(msg);
-		this.socket.send('status');
-		this.socket.send('partpagerectangles');
 		for (var i = 0; i < this._msgQueue.length; i++) {
 			this.socket.send(this._msgQueue[i].msg);
 			L.Log.log(this._msgQueue[i].msg, this._msgQueue[i].coords);
@@ -141,6 +147,8 @@ L.Socket = L.Class.extend({
 					permission: this._map.options.permission,
 					tileWidthTwips: tileWidthTwips,
 					tileHeightTwips: tileHeightTwips,
+					tileSize: this._map.options.tileSize,
+					tilePixelRatio: this._map.options.tilePixelRatio,
 					docType: command.type
 				});
 			}
@@ -149,6 +157,8 @@ L.Socket = L.Class.extend({
 					permission: this._map.options.permission,
 					tileWidthTwips: tileWidthTwips,
 					tileHeightTwips: tileHeightTwips,
+					tileSize: this._map.options.tileSize,
+					tilePixelRatio: this._map.options.tilePixelRatio,
 					docType: command.type
 				});
 			}
@@ -157,7 +167,7 @@ L.Socket = L.Class.extend({
 						this._map.options.defaultZoom === this._map.options.zoom) {
 					// If we have a presentation document and the zoom level has not been set
 					// in the options, resize the document so that it fits the viewing area
-					var verticalTiles = this._map.getSize().y / 256;
+					var verticalTiles = this._map.getSize().y / this._map.options.tileSize;
 					tileWidthTwips = Math.round(command.height / verticalTiles);
 					tileHeightTwips = Math.round(command.height / verticalTiles);
 				}
@@ -165,6 +175,8 @@ L.Socket = L.Class.extend({
 					permission: this._map.options.permission,
 					tileWidthTwips: tileWidthTwips,
 					tileHeightTwips: tileHeightTwips,
+					tileSize: this._map.options.tileSize,
+					tilePixelRatio: this._map.options.tilePixelRatio,
 					docType: command.type
 				});
 			}
@@ -230,6 +242,9 @@ L.Socket = L.Class.extend({
 				// remove newline characters
 				command.type = tokens[i].substring(5).replace(/(\r\n|\n|\r)/gm, '');
 			}
+			else if (tokens[i].substring(0, 4) === 'ver=') {
+				command.version = parseInt(tokens[i].substring(4));
+			}
 			else if (tokens[i].substring(0, 9) === 'prefetch=') {
 				command.preFetch = tokens[i].substring(9);
 			}
@@ -8,6 +8,8 @@ L.GridLayer = L.Layer.extend({
 		pane: 'tilePane',
 
 		tileSize: 256,
+		// device pixels per CSS pixel the tiles are rendered with
+		tilePixelRatio: 1,
 		opacity: 1,
 
 		updateWhenIdle: L.Browser.mobile,
@@ -470,6 +472,12 @@ L.GridLayer = L.Layer.extend({
 		return this.options.tileSize;
 	},
 
+	// the size the server renders the tiles at, sharper than the
+	// layout size on HiDPI screens
+	_getTilePixelSize: function () {
+		return Math.round(this._tileSize * this.options.tilePixelRatio);
+	},
+
 	_moveStart: function () {
 		this._resetPreFetching();
 	},
@@ -533,6 +541,7 @@ L.GridLayer = L.Layer.extend({
 				// we know that a new set of tiles that cover the whole view has been requested
 				// so we're able to cancel the previous requests that are being processed
 				this._map._socket.sendMessage('canceltiles');
+				this._lastViewportMsg = null;
 				for (key in this._tiles) {
 					if (!this._tiles[key].loaded) {
 						L.DomUtil.remove(this._tiles[key].el);
@@ -551,11 +560,74 @@ L.GridLayer = L.Layer.extend({
 			var fragment = document.createDocumentFragment();
 
 			for (i = 0; i < queue.length; i++) {
-				this._addTile(queue[i], fragment);
+				this._addTile(queue[i], fragment, true);
 			}
 
 			this._level.el.appendChild(fragment);
 		}
+
+		this._sendClientViewport(tileRange, zoom);
+	},
+
+	// subscribes to the tiles of the visible area, the server works out
+	// which of them we are missing and re-sends them when invalidated
+	_sendClientViewport: function (tileRange, zoom) {
+		if (!this._map || this._docWidthTwips === undefined) {
+			return;
+		}
+
+		var maxX = Math.ceil(this._docWidthTwips / this._tileWidthTwips) - 1;
+		var maxY = Math.ceil(this._docHeightTwips / this._tileHeightTwips) - 1;
+		var min = new L.Point(Math.max(tileRange.min.x, 0), Math.max(tileRange.min.y, 0));
+		var max = new L.Point(Math.min(tileRange.max.x, maxX), Math.min(tileRange.max.y, maxY));
+		if (min.x > max.x || min.y > max.y) {
+			return;
+		}
+
+		this._viewportTwips = new L.Bounds(
+			new L.Point(min.x * this._tileWidthTwips, min.y * this._tileHeightTwips),
+			new L.Point((max.x + 1) * this._tileWidthTwips, (max.y + 1) * this._tileHeightTwips));
+
+		var message = 'viewport ' +
+			'part=' + this._selectedPart + ' ' +
+			'width=' + this._getTilePixelSize() + ' ' +
+			'height=' + this._getTilePixelSize() + ' ' +
+			'tilewidth=' + this._tileWidthTwips + ' ' +
+			'tileheight=' + this._tileHeightTwips + ' ' +
+			'x=' + this._viewportTwips.min.x + ' ' +
+			'y=' + this._viewportTwips.min.y + ' ' +
+			'viewwidth=' + (this._viewportTwips.max.x - this._viewportTwips.min.x) + ' ' +
+			'viewheight=' + (this._viewportTwips.max.y - this._viewportTwips.min.y);
+
+		// the tile range only changes when scrolling past a tile boundary
+		if (message === this._lastViewportMsg) {
+			return;
+		}
+		this._lastViewportMsg = message;
+
+		// tell the server which tiles we have already, eg. after reconnecting
+		var versions = [];
+		var haveVersions = false;
+		for (var j = min.y; j <= max.y; j++) {
+			for (var i = min.x; i <= max.x; i++) {
+				var coords = new L.Point(i, j);
+				coords.z = zoom;
+				coords.part = this._selectedPart;
+				var key = this._tileCoordsToKey(coords);
+				var tile = this._tiles[key];
+				var version = 0;
+				if (this._tileVersions[key] && ((tile && tile.loaded) || this._tileCache[key])) {
+					version = this._tileVersions[key];
+					haveVersions = true;
+				}
+				versions.push(version);
+			}
+		}
+		if (haveVersions) {
+			message += ' ver=' + versions.join(',');
+		}
+
+		this._map._socket.sendMessage(message);
 	},
 
 	_updateOnChangePart: function () {
@@ -605,6 +677,7 @@ L.GridLayer = L.Layer.extend({
 				// we know that a new set of tiles that cover the whole view has been requested
 				// so we're able to cancel the previous requests that are being processed
 				this._map._socket.sendMessage('canceltiles');
+				this._lastViewportMsg = null;
 				for (key in this._tiles) {
 					var tile = this._tiles[key];
 					if (!tile.loaded) {
@@ -622,73 +695,15 @@ L.GridLayer = L.Layer.extend({
 
 			// create DOM fragment to append tiles in one batch
 			var fragment = document.createDocumentFragment();
-			var tilePositionsX = '';
-			var tilePositionsY = '';
 
 			for (i = 0; i < queue.length; i++) {
-				var coords = queue[i];
-				var tilePos = this._getTilePos(coords),
-				key = this._tileCoordsToKey(coords);
-
-				if (coords.part === this._selectedPart) {
-					var tile = this.createTile(this._wrapCoords(coords), L.bind(this._tileReady, this, coords));
-
-					this._initTile(tile);
-
-					// if createTile is defined with a second argument ("done" callback),
-					// we know that tile is async and will be ready later; otherwise
-					if (this.createTile.length < 2) {
-						// mark tile as ready, but delay one frame for opacity animation to happen
-						setTimeout(L.bind(this._tileReady, this, coords, null, tile), 0);
-					}
-
-					// we prefer top/left over translate3d so that we don't create a HW-accelerated layer from each tile
-					// which is slow, and it also fixes gaps between tiles in Safari
-					L.DomUtil.setPosition(tile, tilePos, true);
-
-					// save tile in cache
-					this._tiles[key] = {
-						el: tile,
-						coords: coords,
-						current: true
-					};
-
-					fragment.appendChild(tile);
-
-					this.fire('tileloadstart', {
-						tile: tile,
-						coords: coords
-					});
-				}
-				if (!this._tileCache[key]) {
-					var twips = this._coordsToTwips(coords);
-					if (tilePositionsX !== '')
-						tilePositionsX += ',';
-					tilePositionsX += twips.x;
-					if (tilePositionsY !== '')
-						tilePositionsY += ',';
-					tilePositionsY += twips.y;
-				}
-				else {
-					tile.src = this._tileCache[key];
-				}
-			}
-
-			if (tilePositionsX !== '' && tilePositionsY !== '') {
-				var message = 'tilecombine ' +
-					'part=' + this._selectedPart + ' ' +
-					'width=' + this._tileSize + ' ' +
-					'height=' + this._tileSize + ' ' +
-					'tileposx=' + tilePositionsX + ' ' +
-					'tileposy=' + tilePositionsY + ' ' +
-					'tilewidth=' + this._tileWidthTwips + ' ' +
-					'tileheight=' + this._tileHeightTwips;
-
-				this._map._socket.sendMessage(message, "");
+				this._addTile(queue[i], fragment, true);
 			}
 
 			this._level.el.appendChild(fragment);
 		}
+
+		this._sendClientViewport(tileRange, zoom);
 	},
 
 	_isValidTile: function (coords) {
@@ -779,7 +794,7 @@ L.GridLayer = L.Layer.extend({
 		}
 	},
 
-	_addTile: function (coords, fragment) {
+	_addTile: function (coords, fragment, skipRequest) {
 		var tilePos = this._getTilePos(coords),
 			key = this._tileCoordsToKey(coords);
 
@@ -815,11 +830,15 @@ L.GridLayer = L.Layer.extend({
 		}
 
 		if (!this._tileCache[key]) {
+			if (skipRequest) {
+				// covered by the viewport subscription
+				return;
+			}
 			var twips = this._coordsToTwips(coords);
 			var msg = 'tile ' +
 					'part=' + coords.part + ' ' +
-					'width=' + this._tileSize + ' ' +
-					'height=' + this._tileSize + ' ' +
+					'width=' + this._getTilePixelSize() + ' ' +
+					'height=' + this._getTilePixelSize() + ' ' +
 					'tileposx=' + twips.x + ' '	+
 					'tileposy=' + twips.y + ' ' +
 					'tilewidth=' + this._tileWidthTwips + ' ' +
@@ -18,13 +18,13 @@ L.ImpressTileLayer = L.TileLayer.extend({
 		var offset = new L.Point(command.width, command.height);
 		var bottomRightTwips = topLeftTwips.add(offset);
 		var invalidBounds = new L.Bounds(topLeftTwips, bottomRightTwips);
-		var visibleTopLeft = this._latLngToTwips(this._map.getBounds().getNorthWest());
-		var visibleBottomRight = this._latLngToTwips(this._map.getBounds().getSouthEast());
-		var visibleArea = new L.Bounds(visibleTopLeft, visibleBottomRight);
-
-		var tilePositionsX = '';
-		var tilePositionsY = '';
-		var needsNewTiles = false;
+		// the server re-sends the subscribed tiles itself, see _sendClientViewport()
+		var visibleArea = this._viewportTwips;
+		if (!visibleArea) {
+			var visibleTopLeft = this._latLngToTwips(this._map.getBounds().getNorthWest());
+			var visibleBottomRight = this._latLngToTwips(this._map.getBounds().getSouthEast());
+			visibleArea = new L.Bounds(visibleTopLeft, visibleBottomRight);
+		}
 
 		for (var key in this._tiles) {
 			var coords = this._tiles[key].coords;
@@ -38,21 +38,7 @@ L.ImpressTileLayer = L.TileLayer.extend({
 				else {
 					this._tiles[key]._invalidCount = 1;
 				}
-				if (visibleArea.intersects(bounds)) {
-					if (!this._transientInvalidationKeys[key]) {
-						if (tilePositionsX !== '') {
-							tilePositionsX += ',';
-						}
-						tilePositionsX += tileTopLeft.x;
-						if (tilePositionsY !== '') {
-							tilePositionsY += ',';
-						}
-						tilePositionsY += tileTopLeft.y;
-						needsNewTiles = true;
-						this._transientInvalidationKeys[key] = true;
-					}
-				}
-				else {
+				if (!visibleArea.intersects(bounds)) {
 					// tile outside of the visible area, just remove it
 					this._preFetchBorder = null;
 					this._removeTile(key);
@@ -60,20 +46,6 @@ L.ImpressTileLayer = L.TileLayer.extend({
 			}
 		}
 
-		if (needsNewTiles && command.part === this._selectedPart)
-		{
-			var message = 'tilecombine ' +
-				'part=' + command.part + ' ' +
-				'width=' + this._tileSize + ' ' +
-				'height=' + this._tileSize + ' ' +
-				'tileposx=' + tilePositionsX + ' ' +
-				'tileposy=' + tilePositionsY + ' ' +
-				'tilewidth=' + this._tileWidthTwips + ' ' +
-				'tileheight=' + this._tileHeightTwips;
-
-			this._map._socket.sendMessage(message, '');
-		}
-
 		for (key in this._tileCache) {
 			// compute the rectangle that each tile covers in the document based
 			// on the zoom level
@@ -120,8 +120,9 @@ L.TileLayer = L.GridLayer.extend({
 		this._previewInvalidations = [];
 		this._partPageRectanglesTwips = [];
 		this._partPageRectanglesPixels = [];
-		this._clientZoom = 'tilepixelwidth=' + this.options.tileSize + ' ' +
-			'tilepixelheight=' + this.options.tileSize + ' ' +
+		var tilePixelSize = Math.round(this.options.tileSize * this.options.tilePixelRatio);
+		this._clientZoom = 'tilepixelwidth=' + tilePixelSize + ' ' +
+			'tilepixelheight=' + tilePixelSize + ' ' +
 			'tiletwipwidth=' + this.options.tileWidthTwips + ' ' +
 			'tiletwipheight=' + this.options.tileHeightTwips;
 		// Mark visible area as dirty by default.
@@ -130,7 +131,6 @@ L.TileLayer = L.GridLayer.extend({
 
     onAdd: function (map) {
 		this._initContainer();
-		this._getToolbarCommandsValues();
 		this._selections = new L.LayerGroup();
 		map.addLayer(this._selections);
 
@@ -140,7 +140,8 @@ L.TileLayer = L.GridLayer.extend({
 		this._levels = {};
 		this._tiles = {};
 		this._tileCache = {};
-		this._transientInvalidationKeys = {};
+		// versions of the tiles we have, to revalidate them with the server
+		this._tileVersions = {};
 
 		map._fadeAnimated = false;
 		this._viewReset();
@@ -238,13 +239,6 @@ L.TileLayer = L.GridLayer.extend({
 		return tile;
 	},
 
-	_getToolbarCommandsValues: function() {
-		for (var i = 0; i < this._map.unoToolbarCommands.length; i++) {
-			var command = this._map.unoToolbarCommands[i];
-			this._map._socket.sendMessage('commandvalues command=' + command);
-		}
-	},
-
 	_onMessage: function (textMsg, img) {
 		if (textMsg.startsWith('commandvalues:')) {
 			this._onCommandValuesMsg(textMsg);
@@ -329,6 +323,9 @@ L.TileLayer = L.GridLayer.extend({
 		else if (textMsg.startsWith('tile:')) {
 			this._onTileMsg(textMsg, img);
 		}
+		else if (textMsg.startsWith('tilenotmodified:')) {
+			this._onTileNotModifiedMsg(textMsg);
+		}
 		else if (textMsg.startsWith('unocommandresult:')) {
 			this._onUnoCommandResultMsg(textMsg);
 		}
@@ -377,9 +374,6 @@ L.TileLayer = L.GridLayer.extend({
 				this._map.fire('filedownloadready', {url: url, name: name, id: command.id});
 			}
 		}
-		else if (command.id === 'slideshow') {
-			this._map.fire('slidedownloadready', {url: url});
-		}
 		else {
 			this._map._fileDownloader.src = url;
 		}
@@ -685,14 +679,24 @@ L.TileLayer = L.GridLayer.extend({
 	},
 
 	_onTileMsg: function (textMsg, img) {
-		this._transientInvalidationKeys = {};
 		var command = this._map._socket.parseServerCmd(textMsg);
 		var coords = this._twipsToCoords(command);
 		coords.z = command.zoom;
 		coords.part = command.part;
 		var key = this._tileCoordsToKey(coords);
 		var tile = this._tiles[key];
-		if (command.id !== undefined) {
+		if (command.version !== undefined && command.id === undefined) {
+			this._tileVersions[key] = command.version;
+		}
+		if (command.id === 'slideshow') {
+			this._map.fire('slide', {
+				tile: img,
+				part: command.part,
+				width: command.width,
+				height: command.height
+			});
+		}
+		else if (command.id !== undefined) {
 			this._map.fire('tilepreview', {
 				tile: img,
 				id: command.id,
@@ -721,6 +725,19 @@ L.TileLayer = L.GridLayer.extend({
 
 	},
 
+	_onTileNotModifiedMsg: function (textMsg) {
+		var command = this._map._socket.parseServerCmd(textMsg);
+		var coords = this._twipsToCoords(command);
+		coords.z = command.zoom;
+		coords.part = command.part;
+		var key = this._tileCoordsToKey(coords);
+		var tile = this._tiles[key];
+		// what we show is still current, only the invalidation is over
+		if (tile && tile._invalidCount > 0) {
+			tile._invalidCount -= 1;
+		}
+	},
+
 	_tileOnLoad: function (done, tile) {
 		done(null, tile);
 	},
@@ -1264,8 +1281,8 @@ L.TileLayer = L.GridLayer.extend({
 	},
 
 	_updateClientZoom: function () {
-		this._clientZoom = 'tilepixelwidth=' + this._tileSize + ' ' +
-			'tilepixelheight=' + this._tileSize + ' ' +
+		this._clientZoom = 'tilepixelwidth=' + this._getTilePixelSize() + ' ' +
+			'tilepixelheight=' + this._getTilePixelSize() + ' ' +
 			'tiletwipwidth=' + this._tileWidthTwips + ' ' +
 			'tiletwipheight=' + this._tileHeightTwips;
 		// Zoom changed, mark visible area as dirty.
@@ -14,12 +14,22 @@ L.Map = L.Evented.extend({
 		trackResize: true,
 		markerZoomAnimation: true,
 		defaultZoom: 10,
+		// layout size of the tiles, 512 or 1024 need fewer renders
+		tileSize: 256,
+		// render the tiles at the screen resolution on HiDPI screens
+		tilePixelRatio: Math.max(1, Math.min(3, Math.round(window.devicePixelRatio || 1))),
 		tileWidthTwips: 3000,
 		tileHeightTwips: 3000
 	},
 
 	initialize: function (id, options) { // (HTMLElement or String, Object)
+		// the default twips are for 256 pixel tiles, larger ones cover more at the same zoom
+		var scaleTwips = !options || options.tileWidthTwips === undefined;
 		options = L.setOptions(this, options);
+		if (scaleTwips && options.tileSize !== 256) {
+			options.tileWidthTwips = Math.round(options.tileWidthTwips * options.tileSize / 256);
+			options.tileHeightTwips = Math.round(options.tileHeightTwips * options.tileSize / 256);
+		}
 
 		if (this.options.documentContainer) {
 			// have it as DOM object
@@ -14,16 +14,18 @@ L.Map.SlideShow = L.Handler.extend({
 
 	addHooks: function () {
 		this._map.on('fullscreen', this._onFullScreen, this);
-		this._map.on('slidedownloadready', this._onSlideDownloadReady, this);
+		this._map.on('slide', this._onSlide, this);
 	},
 
 	removeHooks: function () {
 		this._map.off('fullscreen', this._onFullScreen, this);
-		this._map.off('slidedownloadready', this._onSlideDownloadReady, this);
+		this._map.off('slide', this._onSlide, this);
 	},
 
 	_onFullScreen: function () {
-		this._slideShow = L.DomUtil.create('iframe', '', this._map._container);
+		this._slideShow = L.DomUtil.create('div', 'leaflet-slideshow', this._map._container);
+		this._slideShow.tabIndex = '0';
+		this._slide = L.DomUtil.create('img', '', this._slideShow);
 		if (this._slideShow.requestFullscreen) {
 			this._slideShow.requestFullscreen();
 		}
@@ -39,9 +41,12 @@ L.Map.SlideShow = L.Handler.extend({
 
 		L.DomEvent.on(document, 'fullscreenchange webkitfullscreenchange mozfullscreenchange msfullscreenchange',
 				this._onFullScreenChange, this);
+		L.DomEvent.on(this._slideShow, 'keydown', this._onKeyDown, this);
+		L.DomEvent.on(this._slideShow, 'click', this._onClick, this);
+		this._slideShow.focus();
 
 		this.fullscreen = true;
-		this._map.downloadAs('slideshow.svg', 'svg', null, 'slideshow');
+		this._showSlide(this._map.getCurrentPartNumber());
 	},
 
 	_onFullScreenChange: function () {
@@ -51,12 +56,55 @@ L.Map.SlideShow = L.Handler.extend({
 			document.mozFullScreen ||
 			document.msFullscreenElement;
 		if (!this.fullscreen) {
+			L.DomEvent.off(document, 'fullscreenchange webkitfullscreenchange mozfullscreenchange msfullscreenchange',
+					this._onFullScreenChange, this);
 			L.DomUtil.remove(this._slideShow);
 		}
 	},
 
-	_onSlideDownloadReady: function (e) {
-		this._slideShow.src = e.url + '?mime_type=image/svg%2Bxml';
+	_showSlide: function (part) {
+		if (part < 0 || part >= this._map.getNumberOfParts()) {
+			return;
+		}
+		this._currentSlide = part;
+		// the server sends this slide, and renders the adjacent ones
+		// ahead, so that advancing doesn't wait for them
+		var pixelRatio = window.devicePixelRatio || 1;
+		this._map._socket.sendMessage('slideshow ' +
+			'part=' + part + ' ' +
+			'width=' + Math.round(window.screen.width * pixelRatio) + ' ' +
+			'height=' + Math.round(window.screen.height * pixelRatio));
+	},
+
+	_onSlide: function (e) {
+		if (this.fullscreen && e.part === this._currentSlide) {
+			this._slide.src = e.tile;
+		}
+	},
+
+	_onKeyDown: function (e) {
+		switch (e.keyCode) {
+		case 32: // space
+		case 34: // page down
+		case 39: // right
+		case 40: // down
+			this._showSlide(this._currentSlide + 1);
+			break;
+		case 8: // backspace
+		case 33: // page up
+		case 37: // left
+		case 38: // up
+			this._showSlide(this._currentSlide - 1);
+			break;
+		default:
+			return;
+		}
+		L.DomEvent.stop(e);
+	},
+
+	_onClick: function (e) {
+		this._showSlide(this._currentSlide + 1);
+		L.DomEvent.stop(e);
 	}
 });
 
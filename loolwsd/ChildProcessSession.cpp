@@ -8,6 +8,9 @@
  */
 
 #include <sys/prctl.h>
+#include <algorithm>
+#include <climits>
+#include <cstdlib>
 #include <iostream>
 
 #include <Poco/Exception.h>
@@ -15,8 +18,6 @@
 #include <Poco/JSON/Object.h>
 #include <Poco/JSON/Parser.h>
 #include <Poco/Net/WebSocket.h>
-#include <Poco/Notification.h>
-#include <Poco/NotificationQueue.h>
 #include <Poco/Path.h>
 #include <Poco/Process.h>
 #include <Poco/String.h>
@@ -37,8 +38,6 @@ using Poco::File;
 using Poco::IOException;
 using Poco::JSON::Object;
 using Poco::JSON::Parser;
-using Poco::Notification;
-using Poco::NotificationQueue;
 using Poco::Net::WebSocket;
 using Poco::Path;
 using Poco::Process;
@@ -46,264 +45,8 @@ using Poco::ProcessHandle;
 using Poco::StringTokenizer;
 using Poco::URI;
 
-class CallbackNotification: public Poco::Notification
-{
-public:
-    typedef Poco::AutoPtr<CallbackNotification> Ptr;
-
-    CallbackNotification(const int nType, const std::string& rPayload)
-      : _nType(nType),
-        _aPayload(rPayload)
-    {
-    }
-
-    const int _nType;
-    const std::string _aPayload;
-};
-
-/// This thread handles callbacks from the lokit instance.
-class CallbackWorker: public Poco::Runnable
-{
-public:
-    CallbackWorker(NotificationQueue& queue, ChildProcessSession& session):
-        _queue(queue),
-        _session(session),
-        _stop(false)
-    {
-    }
-
-    std::string callbackTypeToString (const int nType)
-    {
-        switch (nType)
-        {
-        case LOK_CALLBACK_INVALIDATE_TILES:
-            return std::string("LOK_CALLBACK_INVALIDATE_TILES");
-        case LOK_CALLBACK_INVALIDATE_VISIBLE_CURSOR:
-            return std::string("LOK_CALLBACK_INVALIDATE_VISIBLE_CURSOR");
-        case LOK_CALLBACK_TEXT_SELECTION:
-            return std::string("LOK_CALLBACK_TEXT_SELECTION");
-        case LOK_CALLBACK_TEXT_SELECTION_START:
-            return std::string("LOK_CALLBACK_TEXT_SELECTION_START");
-        case LOK_CALLBACK_TEXT_SELECTION_END:
-            return std::string("LOK_CALLBACK_TEXT_SELECTION_END");
-        case LOK_CALLBACK_CURSOR_VISIBLE:
-            return std::string("LOK_CALLBACK_CURSOR_VISIBLE");
-        case LOK_CALLBACK_GRAPHIC_SELECTION:
-            return std::string("LOK_CALLBACK_GRAPHIC_SELECTION");
-        case LOK_CALLBACK_CELL_CURSOR:
-            return std::string("LOK_CALLBACK_CELL_CURSOR");
-        case LOK_CALLBACK_CELL_FORMULA:
-            return std::string("LOK_CALLBACK_CELL_FORMULA");
-        case LOK_CALLBACK_MOUSE_POINTER:
-            return std::string("LOK_CALLBACK_MOUSE_POINTER");
-        case LOK_CALLBACK_SEARCH_RESULT_SELECTION:
-            return std::string("LOK_CALLBACK_SEARCH_RESULT_SELECTION");
-        case LOK_CALLBACK_UNO_COMMAND_RESULT:
-            return std::string("LOK_CALLBACK_UNO_COMMAND_RESULT");
-        case LOK_CALLBACK_HYPERLINK_CLICKED:
-            return std::string("LOK_CALLBACK_HYPERLINK_CLICKED");
-        case LOK_CALLBACK_STATE_CHANGED:
-            return std::string("LOK_CALLBACK_STATE_CHANGED");
-        case LOK_CALLBACK_STATUS_INDICATOR_START:
-            return std::string("LOK_CALLBACK_STATUS_INDICATOR_START");
-        case LOK_CALLBACK_STATUS_INDICATOR_SET_VALUE:
-            return std::string("LOK_CALLBACK_STATUS_INDICATOR_SET_VALUE");
-        case LOK_CALLBACK_STATUS_INDICATOR_FINISH:
-            return std::string("LOK_CALLBACK_STATUS_INDICATOR_FINISH");
-        case LOK_CALLBACK_SEARCH_NOT_FOUND:
-            return std::string("LOK_CALLBACK_SEARCH_NOT_FOUND");
-        case LOK_CALLBACK_DOCUMENT_SIZE_CHANGED:
-            return std::string("LOK_CALLBACK_DOCUMENT_SIZE_CHANGED");
-        case LOK_CALLBACK_SET_PART:
-            return std::string("LOK_CALLBACK_SET_PART");
-        }
-        return std::to_string(nType);
-    }
-
-    void callback(const int nType, const std::string& rPayload)
-    {
-        auto lock = _session.getLock();
-
-        Log::trace() << "Callback [" << _session.getViewId() << "] "
-                     << callbackTypeToString(nType)
-                     << " [" << rPayload << "]." << Log::end;
-        if (_session.isDisconnected())
-        {
-            Log::trace("Skipping callback on disconnected session " + _session.getName());
-            return;
-        }
-        else if (_session.isInactive())
-        {
-            Log::trace("Skipping callback on inactive session " + _session.getName());
-            return;
-        }
-
-        switch (static_cast<LibreOfficeKitCallbackType>(nType))
-        {
-        case LOK_CALLBACK_INVALIDATE_TILES:
-            {
-                int curPart = _session.getLoKitDocument()->pClass->getPart(_session.getLoKitDocument());
-                _session.sendTextFrame("curpart: part=" + std::to_string(curPart));
-                if (_session.getDocType() == "text")
-                {
-                    curPart = 0;
-                }
-
-                StringTokenizer tokens(rPayload, " ", StringTokenizer::TOK_IGNORE_EMPTY | StringTokenizer::TOK_TRIM);
-                if (tokens.count() == 4)
-                {
-                    int x, y, width, height;
-
-                    try
-                    {
-                        x = std::stoi(tokens[0]);
-                        y = std::stoi(tokens[1]);
-                        width = std::stoi(tokens[2]);
-                        height = std::stoi(tokens[3]);
-                    }
-                    catch (const std::out_of_range&)
-                    {
-                        // something went wrong, invalidate everything
-                        Log::warn("Ignoring integer values out of range: " + rPayload);
-                        x = 0;
-                        y = 0;
-                        width = INT_MAX;
-                        height = INT_MAX;
-                    }
-
-                    _session.sendTextFrame("invalidatetiles:"
-                                       " part=" + std::to_string(curPart) +
-                                       " x=" + std::to_string(x) +
-                                       " y=" + std::to_string(y) +
-                                       " width=" + std::to_string(width) +
-                                       " height=" + std::to_string(height));
-                }
-                else
-                {
-                    _session.sendTextFrame("invalidatetiles: " + rPayload);
-                }
-            }
-            break;
-        case LOK_CALLBACK_INVALIDATE_VISIBLE_CURSOR:
-            _session.sendTextFrame("invalidatecursor: " + rPayload);
-            break;
-        case LOK_CALLBACK_TEXT_SELECTION:
-            _session.sendTextFrame("textselection: " + rPayload);
-            break;
-        case LOK_CALLBACK_TEXT_SELECTION_START:
-            _session.sendTextFrame("textselectionstart: " + rPayload);
-            break;
-        case LOK_CALLBACK_TEXT_SELECTION_END:
-            _session.sendTextFrame("textselectionend: " + rPayload);
-            break;
-        case LOK_CALLBACK_CURSOR_VISIBLE:
-            _session.sendTextFrame("cursorvisible: " + rPayload);
-            break;
-        case LOK_CALLBACK_GRAPHIC_SELECTION:
-            _session.sendTextFrame("graphicselection: " + rPayload);
-            break;
-        case LOK_CALLBACK_CELL_CURSOR:
-            _session.sendTextFrame("cellcursor: " + rPayload);
-            break;
-        case LOK_CALLBACK_CELL_FORMULA:
-            _session.sendTextFrame("cellformula: " + rPayload);
-            break;
-        case LOK_CALLBACK_MOUSE_POINTER:
-            _session.sendTextFrame("mousepointer: " + rPayload);
-            break;
-        case LOK_CALLBACK_HYPERLINK_CLICKED:
-            _session.sendTextFrame("hyperlinkclicked: " + rPayload);
-            break;
-        case LOK_CALLBACK_STATE_CHANGED:
-            _session.sendTextFrame("statechanged: " + rPayload);
-            break;
-        case LOK_CALLBACK_STATUS_INDICATOR_START:
-            _session.sendTextFrame("statusindicatorstart:");
-            break;
-        case LOK_CALLBACK_STATUS_INDICATOR_SET_VALUE:
-            _session.sendTextFrame("statusindicatorsetvalue: " + rPayload);
-            break;
-        case LOK_CALLBACK_STATUS_INDICATOR_FINISH:
-            _session.sendTextFrame("statusindicatorfinish:");
-            break;
-        case LOK_CALLBACK_SEARCH_NOT_FOUND:
-            _session.sendTextFrame("searchnotfound: " + rPayload);
-            break;
-        case LOK_CALLBACK_SEARCH_RESULT_SELECTION:
-            _session.sendTextFrame("searchresultselection: " + rPayload);
-            break;
-        case LOK_CALLBACK_DOCUMENT_SIZE_CHANGED:
-            _session.getStatus("", 0);
-            _session.getPartPageRectangles("", 0);
-            break;
-        case LOK_CALLBACK_SET_PART:
-            _session.sendTextFrame("setpart: " + rPayload);
-            break;
-        case LOK_CALLBACK_UNO_COMMAND_RESULT:
-            _session.sendTextFrame("unocommandresult: " + rPayload);
-            break;
-        case LOK_CALLBACK_DOCUMENT_PASSWORD:
-            break;
-        case LOK_CALLBACK_DOCUMENT_PASSWORD_TO_MODIFY:
-            break;
-        }
-    }
-
-    void run()
-    {
-        static const std::string thread_name = "kit_callback";
-#ifdef __linux
-        if (prctl(PR_SET_NAME, reinterpret_cast<unsigned long>(thread_name.c_str()), 0, 0, 0) != 0)
-            Log::error("Cannot set thread name to " + thread_name + ".");
-#endif
-        Log::debug("Thread [" + thread_name + "] started.");
-
-        while (!_stop && !TerminationFlag)
-        {
-            Notification::Ptr aNotification(_queue.waitDequeueNotification());
-            if (!_stop && !TerminationFlag && aNotification)
-            {
-                CallbackNotification::Ptr aCallbackNotification = aNotification.cast<CallbackNotification>();
-                assert(aCallbackNotification);
-
-                const auto nType = aCallbackNotification->_nType;
-                try
-                {
-                    callback(nType, aCallbackNotification->_aPayload);
-                }
-                catch (const Exception& exc)
-                {
-                    Log::error() << "Error while handling callback [" << callbackTypeToString(nType) << "]. "
-                                 << exc.displayText()
-                                 << (exc.nested() ? " (" + exc.nested()->displayText() + ")" : "")
-                                 << Log::end;
-                }
-                catch (const std::exception& exc)
-                {
-                    Log::error("Error while handling callback [" + callbackTypeToString(nType) + "]. " +
-                               std::string("Exception: ") + exc.what());
-                }
-            }
-            else
-                break;
-        }
-
-        Log::debug("Thread [" + thread_name + "] finished.");
-    }
-
-    void stop()
-    {
-        _stop = true;
-        _queue.wakeUpAll();
-    }
-
-private:
-    NotificationQueue& _queue;
-    ChildProcessSession& _session;
-    volatile bool _stop;
-};
-
 std::recursive_mutex ChildProcessSession::Mutex;
+std::atomic<int> ChildProcessSession::PrefetchingView(-1);
 
 ChildProcessSession::ChildProcessSession(const std::string& id,
                                          std::shared_ptr<Poco::Net::WebSocket> ws,
@@ -320,11 +63,18 @@ ChildProcessSession::ChildProcessSession(const std::string& id,
     _clientPart(0),
     _onLoad(onLoad),
     _onUnload(onUnload),
-    _callbackWorker(new CallbackWorker(_callbackQueue, *this))
+    _viewportPart(-1),
+    _viewportPixelWidth(0),
+    _viewportPixelHeight(0),
+    _viewportTileWidth(0),
+    _viewportTileHeight(0),
+    _viewportColumns(0),
+    _viewportRows(0),
+    _missedSequence(0),
+    _missedDocumentSize(false),
+    _prefetchPart(-1)
 {
     Log::info("ChildProcessSession ctor [" + getName() + "].");
-
-    _callbackThread.start(*_callbackWorker);
 }
 
 ChildProcessSession::~ChildProcessSession()
@@ -332,10 +82,6 @@ ChildProcessSession::~ChildProcessSession()
     Log::info("~ChildProcessSession dtor [" + getName() + "].");
 
     disconnect();
-
-    // Wait for the callback worker to finish.
-    _callbackWorker->stop();
-    _callbackThread.join();
 }
 
 void ChildProcessSession::disconnect(const std::string& reason)
@@ -366,26 +112,10 @@ bool ChildProcessSession::_handleInput(const char *buffer, int length)
         Log::debug("Handling message after inactivity of " + std::to_string(_stats.getInactivityMS()) + "ms.");
 
         // Client is getting active again.
-        // Send invalidation and other sync-up messages.
+        // Send what it missed, under the lock so no callback slips between.
         std::unique_lock<std::recursive_mutex> lock(Mutex);
-
-        if (_multiView)
-            _loKitDocument->pClass->setView(_loKitDocument, _viewId);
-
-        int curPart = _loKitDocument->pClass->getPart(_loKitDocument);
-        sendTextFrame("curpart: part=" + std::to_string(curPart));
-        if (getDocType() == "text")
-        {
-            curPart = 0;
-        }
-
-        sendTextFrame("invalidatetiles:"
-                       " part=" + std::to_string(curPart) +
-                       " x=0 y=0"
-                       " width=" + std::to_string(INT_MAX) +
-                       " height=" + std::to_string(INT_MAX));
-
-        //TODO: Sync cursor.
+        _stats.updateLastActivityTime();
+        sendMissedUpdates();
     }
 
     _stats.updateLastActivityTime();
@@ -445,6 +175,10 @@ bool ChildProcessSession::_handleInput(const char *buffer, int length)
     {
         sendCombinedTiles(buffer, length, tokens);
     }
+    else if (tokens[0] == "viewport")
+    {
+        return setViewport(buffer, length, tokens);
+    }
     else
     {
         // All other commands are such that they always require a LibreOfficeKitDocument session,
@@ -568,6 +302,7 @@ bool ChildProcessSession::loadDocument(const char * /*buffer*/, int /*length*/,
     assert(!_docURL.empty());
     assert(!_jailedFilePath.empty());
 
+    // Views after the first get their document when created.
     _loKitDocument = _onLoad(getId(), _jailedFilePath);
 
     std::unique_lock<std::recursive_mutex> lock(Mutex);
@@ -592,8 +327,9 @@ bool ChildProcessSession::loadDocument(const char * /*buffer*/, int /*length*/,
         _loKitDocument->pClass->setPart(_loKitDocument, part);
     }
 
-    // Respond by the document status, which has no arguments.
-    if (!getStatus(nullptr, 0))
+    // Respond by the document status with all the client asks for on
+    // load, for every view: what wsd cached from earlier ones may be stale.
+    if (!sendLoadBundle())
         return false;
 
     Log::info("Loaded session " + getId());
@@ -650,15 +386,66 @@ bool ChildProcessSession::getStatus(const char* /*buffer*/, int /*length*/)
         _loKitDocument->pClass->setView(_loKitDocument, _viewId);
 
     const std::string status = "status: " + LOKitHelper::documentStatus(_loKitDocument);
+    if (!updateDocType(status))
+        return false;
+
+    _lastStatus = status;
+    sendTextFrame(status);
+
+    return true;
+}
+
+bool ChildProcessSession::updateDocType(const std::string& status)
+{
     StringTokenizer tokens(status, " ", StringTokenizer::TOK_IGNORE_EMPTY | StringTokenizer::TOK_TRIM);
-    if (!getTokenString(tokens[1], "type", _docType))
+    if (tokens.count() < 2 || !getTokenString(tokens[1], "type", _docType))
     {
         Log::error("failed to get document type from status [" + status + "].");
         return false;
     }
 
-    sendTextFrame(status);
+    return true;
+}
+
+bool ChildProcessSession::sendLoadBundle()
+{
+    std::unique_lock<std::recursive_mutex> lock(Mutex);
 
+    if (_multiView)
+        _loKitDocument->pClass->setView(_loKitDocument, _viewId);
+
+    const std::string status = "status: " + LOKitHelper::documentStatus(_loKitDocument);
+    if (!updateDocType(status))
+        return false;
+
+    char* pValues = _loKitDocument->pClass->getPartPageRectangles(_loKitDocument);
+    const std::string rectangles = "partpagerectangles: " + std::string(pValues ? pValues : "");
+    std::free(pValues);
+
+    std::vector<std::string> messages = { status, rectangles };
+    for (const auto& command : { ".uno:CharFontName", ".uno:StyleApply" })
+    {
+        pValues = _loKitDocument->pClass->getCommandValues(_loKitDocument, command);
+        if (pValues != nullptr)
+        {
+            messages.push_back("commandvalues: " + std::string(pValues));
+            std::free(pValues);
+        }
+    }
+
+    _lastStatus = status;
+    _lastPartPageRectangles = rectangles;
+
+    std::string sizes;
+    std::string payload;
+    for (const auto& message : messages)
+    {
+        sizes += (sizes.empty() ? "" : ",") + std::to_string(message.size());
+        payload += message;
+    }
+
+    const std::string bundle = "loadbundle: sizes=" + sizes + "\n" + payload;
+    sendBinaryFrame(bundle.data(), bundle.size());
     return true;
 }
 
@@ -687,10 +474,52 @@ bool ChildProcessSession::getPartPageRectangles(const char* /*buffer*/, int /*le
     if (_multiView)
         _loKitDocument->pClass->setView(_loKitDocument, _viewId);
 
-    sendTextFrame("partpagerectangles: " + std::string(_loKitDocument->pClass->getPartPageRectangles(_loKitDocument)));
+    char* pRectangles = _loKitDocument->pClass->getPartPageRectangles(_loKitDocument);
+    _lastPartPageRectangles = "partpagerectangles: " + std::string(pRectangles ? pRectangles : "");
+    std::free(pRectangles);
+
+    sendTextFrame(_lastPartPageRectangles);
     return true;
 }
 
+size_t ChildProcessSession::sendDocumentSize(const std::string& status, const std::string& rectangles)
+{
+    if (isDisconnected())
+    {
+        Log::trace("Skipping document size on disconnected session " + getName());
+        return 0;
+    }
+    else if (isInactive())
+    {
+        Log::trace("Deferring document size on inactive session " + getName());
+        _missedDocumentSize = true;
+        return 0;
+    }
+
+    size_t unchanged = 0;
+    if (status != _lastStatus)
+    {
+        _lastStatus = status;
+        sendTextFrame(status);
+    }
+    else
+    {
+        ++unchanged;
+    }
+
+    if (rectangles != _lastPartPageRectangles)
+    {
+        _lastPartPageRectangles = rectangles;
+        sendTextFrame(rectangles);
+    }
+    else
+    {
+        ++unchanged;
+    }
+
+    return unchanged;
+}
+
 void ChildProcessSession::sendTile(const char* /*buffer*/, int /*length*/, StringTokenizer& tokens)
 {
     int part, width, height, tilePosX, tilePosY, tileWidth, tileHeight;
@@ -735,8 +564,13 @@ void ChildProcessSession::sendTile(const char* /*buffer*/, int /*length*/, Strin
     std::vector<unsigned char> pixmap;
     pixmap.resize(4 * width * height);
 
-    if (_docType != "text" && part != _loKitDocument->pClass->getPart(_loKitDocument))
+    // Rendering another part, eg. the slides of a slideshow or rendering
+    // ahead, must not move the view: switch back, as when prefetching.
+    const int curPart = _loKitDocument->pClass->getPart(_loKitDocument);
+    const bool switchPart = (_docType != "text" && part != curPart);
+    if (switchPart)
     {
+        PrefetchingView = _viewId;
         _loKitDocument->pClass->setPart(_loKitDocument, part);
     }
 
@@ -745,6 +579,12 @@ void ChildProcessSession::sendTile(const char* /*buffer*/, int /*length*/, Strin
     Log::trace() << "paintTile at [" << tilePosX << ", " << tilePosY
                  << "] rendered in " << (timestamp.elapsed()/1000.) << " ms" << Log::end;
 
+    if (switchPart)
+    {
+        _loKitDocument->pClass->setPart(_loKitDocument, curPart);
+        PrefetchingView = -1;
+    }
+
     LibreOfficeKitTileMode mode = static_cast<LibreOfficeKitTileMode>(_loKitDocument->pClass->getTileMode(_loKitDocument));
     if (!Util::encodeBufferToPNG(pixmap.data(), width, height, output, mode))
     {
@@ -781,12 +621,10 @@ void ChildProcessSession::sendCombinedTiles(const char* /*buffer*/, int /*length
         return;
     }
 
-    Util::Rectangle renderArea;
-
     StringTokenizer positionXtokens(tilePositionsX, ",", StringTokenizer::TOK_IGNORE_EMPTY | StringTokenizer::TOK_TRIM);
     StringTokenizer positionYtokens(tilePositionsY, ",", StringTokenizer::TOK_IGNORE_EMPTY | StringTokenizer::TOK_TRIM);
 
-    size_t numberOfPositions = positionYtokens.count();
+    size_t numberOfPositions = positionXtokens.count();
     // check that number of positions for X and Y is the same
     if (numberOfPositions != positionYtokens.count())
     {
@@ -812,20 +650,27 @@ void ChildProcessSession::sendCombinedTiles(const char* /*buffer*/, int /*length
             return;
         }
 
-        Util::Rectangle rectangle(x, y, tileWidth, tileHeight);
+        tiles.emplace_back(x, y, tileWidth, tileHeight);
+    }
 
-        if (tiles.empty())
-        {
-            renderArea = rectangle;
-        }
-        else
-        {
-            renderArea.extend(rectangle);
-        }
+    renderTiles(part, pixelWidth, pixelHeight, tiles, tileWidth, tileHeight, "");
+}
 
-        tiles.push_back(rectangle);
+void ChildProcessSession::renderTiles(int part, int pixelWidth, int pixelHeight,
+                                      const std::vector<Util::Rectangle>& tiles,
+                                      int tileWidth, int tileHeight, const std::string& suffix)
+{
+    Util::Rectangle renderArea;
+    for (Util::Rectangle rectangle : tiles)
+    {
+        renderArea.extend(rectangle);
     }
 
+    std::unique_lock<std::recursive_mutex> lock(Mutex);
+
+    if (_multiView)
+        _loKitDocument->pClass->setView(_loKitDocument, _viewId);
+
     if (_docType != "text" && part != _loKitDocument->pClass->getPart(_loKitDocument))
     {
         _loKitDocument->pClass->setPart(_loKitDocument, part);
@@ -852,7 +697,7 @@ void ChildProcessSession::sendCombinedTiles(const char* /*buffer*/, int /*length
                 << " (" << renderArea.getWidth() << ", " << renderArea.getHeight() << ") rendered in "
                 << double(timestamp.elapsed())/1000 <<  "ms" << Log::end;
 
-    for (Util::Rectangle& tileRect : tiles)
+    for (Util::Rectangle tileRect : tiles)
     {
         std::string response = "tile: part=" + std::to_string(part) +
                                " width=" + std::to_string(pixelWidth) +
@@ -860,7 +705,7 @@ void ChildProcessSession::sendCombinedTiles(const char* /*buffer*/, int /*length
                                " tileposx=" + std::to_string(tileRect.getLeft()) +
                                " tileposy=" + std::to_string(tileRect.getTop()) +
                                " tilewidth=" + std::to_string(tileWidth) +
-                               " tileheight=" + std::to_string(tileHeight) + "\n";
+                               " tileheight=" + std::to_string(tileHeight) + suffix + "\n";
 
         std::vector<char> output;
         output.reserve(pixelWidth * pixelHeight * 4 + response.size());
@@ -1281,10 +1126,380 @@ bool ChildProcessSession::setPage(const char* /*buffer*/, int /*length*/, String
     return true;
 }
 
-void ChildProcessSession::loKitCallback(const int nType, const char *pPayload)
+bool ChildProcessSession::setViewport(const char* /*buffer*/, int /*length*/, StringTokenizer& tokens)
 {
-    auto pNotif = new CallbackNotification(nType, pPayload ? pPayload : "(nil)");
-    _callbackQueue.enqueueNotification(pNotif);
+    int part, pixelWidth, pixelHeight, tileWidth, tileHeight, x, y, viewWidth, viewHeight;
+
+    if (tokens.count() < 10 ||
+        !getTokenInteger(tokens[1], "part", part) ||
+        !getTokenInteger(tokens[2], "width", pixelWidth) ||
+        !getTokenInteger(tokens[3], "height", pixelHeight) ||
+        !getTokenInteger(tokens[4], "tilewidth", tileWidth) ||
+        !getTokenInteger(tokens[5], "tileheight", tileHeight) ||
+        !getTokenInteger(tokens[6], "x", x) ||
+        !getTokenInteger(tokens[7], "y", y) ||
+        !getTokenInteger(tokens[8], "viewwidth", viewWidth) ||
+        !getTokenInteger(tokens[9], "viewheight", viewHeight))
+    {
+        sendTextFrame("error: cmd=viewport kind=syntax");
+        return false;
+    }
+
+    if (part < 0 || pixelWidth <= 0 || pixelHeight <= 0 ||
+        tileWidth <= 0 || tileHeight <= 0 ||
+        x < 0 || y < 0 || viewWidth <= 0 || viewHeight <= 0)
+    {
+        sendTextFrame("error: cmd=viewport kind=invalid");
+        return false;
+    }
+
+    // Only the size of the view matters, the adjacent parts are prefetched from their top-left.
+    const int columns = std::min((viewWidth + tileWidth - 1) / tileWidth, MAX_VIEWPORT_TILES);
+    const int rows = std::min((viewHeight + tileHeight - 1) / tileHeight, MAX_VIEWPORT_TILES / columns);
+
+    if (part != _viewportPart ||
+        pixelWidth != _viewportPixelWidth || pixelHeight != _viewportPixelHeight ||
+        tileWidth != _viewportTileWidth || tileHeight != _viewportTileHeight ||
+        columns != _viewportColumns || rows != _viewportRows)
+    {
+        _viewportPart = part;
+        _viewportPixelWidth = pixelWidth;
+        _viewportPixelHeight = pixelHeight;
+        _viewportTileWidth = tileWidth;
+        _viewportTileHeight = tileHeight;
+        _viewportColumns = columns;
+        _viewportRows = rows;
+
+        // Whatever was left to prefetch is for another part or zoom.
+        _prefetchPart = -1;
+        _prefetchRows.clear();
+    }
+
+    return true;
+}
+
+bool ChildProcessSession::handleIdle()
+{
+    if (_docURL.empty() || _loKitDocument == nullptr || _docType == "text" || _viewportPart < 0)
+        return false;
+
+    if (_prefetchPart != _viewportPart)
+    {
+        std::unique_lock<std::recursive_mutex> lock(Mutex);
+
+        const int parts = _loKitDocument->pClass->getParts(_loKitDocument);
+        for (const int part : { _viewportPart + 1, _viewportPart - 1 })
+        {
+            if (part < 0 || part >= parts)
+                continue;
+
+            for (int row = 0; row < _viewportRows; ++row)
+                _prefetchRows.emplace_back(part, row);
+        }
+
+        _prefetchPart = _viewportPart;
+        return !_prefetchRows.empty();
+    }
+
+    if (_prefetchRows.empty())
+        return false;
+
+    const int part = _prefetchRows.front().first;
+    const int row = _prefetchRows.front().second;
+    _prefetchRows.pop_front();
+
+    std::vector<Util::Rectangle> tiles;
+    tiles.reserve(_viewportColumns);
+    for (int column = 0; column < _viewportColumns; ++column)
+    {
+        tiles.emplace_back(column * _viewportTileWidth, row * _viewportTileHeight,
+                           _viewportTileWidth, _viewportTileHeight);
+    }
+
+    Log::trace() << getName() << ": prefetching row " << row << " of part " << part << "." << Log::end;
+
+    std::unique_lock<std::recursive_mutex> lock(Mutex);
+
+    if (_multiView)
+        _loKitDocument->pClass->setView(_loKitDocument, _viewId);
+
+    // Switch back to where we were, rendering must not move the views around.
+    const int curPart = _loKitDocument->pClass->getPart(_loKitDocument);
+    PrefetchingView = _viewId;
+    try
+    {
+        renderTiles(part, _viewportPixelWidth, _viewportPixelHeight, tiles,
+                    _viewportTileWidth, _viewportTileHeight, " background=true");
+    }
+    catch (const std::exception&)
+    {
+        PrefetchingView = -1;
+        throw;
+    }
+    if (_loKitDocument->pClass->getPart(_loKitDocument) != curPart)
+    {
+        _loKitDocument->pClass->setPart(_loKitDocument, curPart);
+    }
+    PrefetchingView = -1;
+
+    return !_prefetchRows.empty();
+}
+
+void ChildProcessSession::loKitCallback(const int nType, const std::string& rPayload)
+{
+    Log::trace() << "Callback [" << _viewId << "] "
+                 << LOKitHelper::kitCallbackTypeToString(nType)
+                 << " [" << rPayload << "]." << Log::end;
+    if (isDisconnected())
+    {
+        Log::trace("Skipping callback on disconnected session " + getName());
+        return;
+    }
+    else if (isInactive())
+    {
+        std::unique_lock<std::recursive_mutex> lock(Mutex);
+        if (isInactive())
+        {
+            Log::trace("Deferring callback on inactive session " + getName());
+            trackMissedCallback(nType, rPayload);
+            return;
+        }
+    }
+
+    switch (static_cast<LibreOfficeKitCallbackType>(nType))
+    {
+    case LOK_CALLBACK_INVALIDATE_TILES:
+        {
+            std::unique_lock<std::recursive_mutex> lock(Mutex);
+
+            int curPart = _loKitDocument->pClass->getPart(_loKitDocument);
+            sendTextFrame("curpart: part=" + std::to_string(curPart));
+            if (getDocType() == "text")
+            {
+                curPart = 0;
+            }
+
+            StringTokenizer tokens(rPayload, " ", StringTokenizer::TOK_IGNORE_EMPTY | StringTokenizer::TOK_TRIM);
+            if (tokens.count() == 4)
+            {
+                int x, y, width, height;
+
+                try
+                {
+                    x = std::stoi(tokens[0]);
+                    y = std::stoi(tokens[1]);
+                    width = std::stoi(tokens[2]);
+                    height = std::stoi(tokens[3]);
+                }
+                catch (const std::out_of_range&)
+                {
+                    // something went wrong, invalidate everything
+                    Log::warn("Ignoring integer values out of range: " + rPayload);
+                    x = 0;
+                    y = 0;
+                    width = INT_MAX;
+                    height = INT_MAX;
+                }
+
+                sendTextFrame("invalidatetiles:"
+                              " part=" + std::to_string(curPart) +
+                              " x=" + std::to_string(x) +
+                              " y=" + std::to_string(y) +
+                              " width=" + std::to_string(width) +
+                              " height=" + std::to_string(height));
+            }
+            else
+            {
+                sendTextFrame("invalidatetiles: " + rPayload);
+            }
+        }
+        break;
+    case LOK_CALLBACK_INVALIDATE_VISIBLE_CURSOR:
+        sendTextFrame("invalidatecursor: " + rPayload);
+        break;
+    case LOK_CALLBACK_TEXT_SELECTION:
+        sendTextFrame("textselection: " + rPayload);
+        break;
+    case LOK_CALLBACK_TEXT_SELECTION_START:
+        sendTextFrame("textselectionstart: " + rPayload);
+        break;
+    case LOK_CALLBACK_TEXT_SELECTION_END:
+        sendTextFrame("textselectionend: " + rPayload);
+        break;
+    case LOK_CALLBACK_CURSOR_VISIBLE:
+        sendTextFrame("cursorvisible: " + rPayload);
+        break;
+    case LOK_CALLBACK_GRAPHIC_SELECTION:
+        sendTextFrame("graphicselection: " + rPayload);
+        break;
+    case LOK_CALLBACK_CELL_CURSOR:
+        sendTextFrame("cellcursor: " + rPayload);
+        break;
+    case LOK_CALLBACK_CELL_FORMULA:
+        sendTextFrame("cellformula: " + rPayload);
+        break;
+    case LOK_CALLBACK_MOUSE_POINTER:
+        sendTextFrame("mousepointer: " + rPayload);
+        break;
+    case LOK_CALLBACK_HYPERLINK_CLICKED:
+        sendTextFrame("hyperlinkclicked: " + rPayload);
+        break;
+    case LOK_CALLBACK_STATE_CHANGED:
+        sendTextFrame("statechanged: " + rPayload);
+        break;
+    case LOK_CALLBACK_STATUS_INDICATOR_START:
+        sendTextFrame("statusindicatorstart:");
+        break;
+    case LOK_CALLBACK_STATUS_INDICATOR_SET_VALUE:
+        sendTextFrame("statusindicatorsetvalue: " + rPayload);
+        break;
+    case LOK_CALLBACK_STATUS_INDICATOR_FINISH:
+        sendTextFrame("statusindicatorfinish:");
+        break;
+    case LOK_CALLBACK_SEARCH_NOT_FOUND:
+        sendTextFrame("searchnotfound: " + rPayload);
+        break;
+    case LOK_CALLBACK_SEARCH_RESULT_SELECTION:
+        sendTextFrame("searchresultselection: " + rPayload);
+        break;
+    case LOK_CALLBACK_DOCUMENT_SIZE_CHANGED:
+        // Debounced by the Document, which calls sendDocumentSize().
+        break;
+    case LOK_CALLBACK_SET_PART:
+        sendTextFrame("setpart: " + rPayload);
+        break;
+    case LOK_CALLBACK_UNO_COMMAND_RESULT:
+        sendTextFrame("unocommandresult: " + rPayload);
+        break;
+    case LOK_CALLBACK_DOCUMENT_PASSWORD:
+        break;
+    case LOK_CALLBACK_DOCUMENT_PASSWORD_TO_MODIFY:
+        break;
+    }
+}
+
+void ChildProcessSession::trackMissedCallback(const int nType, const std::string& rPayload)
+{
+    if (nType == LOK_CALLBACK_INVALIDATE_TILES)
+    {
+        if (_multiView)
+            _loKitDocument->pClass->setView(_loKitDocument, _viewId);
+
+        int curPart = _loKitDocument->pClass->getPart(_loKitDocument);
+        if (getDocType() == "text")
+        {
+            curPart = 0;
+        }
+
+        // Anything but an area, like EMPTY, invalidates all the parts.
+        Util::Rectangle area(0, 0, INT_MAX, INT_MAX);
+        StringTokenizer tokens(rPayload, " ,", StringTokenizer::TOK_IGNORE_EMPTY | StringTokenizer::TOK_TRIM);
+        if (tokens.count() != 4)
+        {
+            curPart = -1;
+        }
+        else
+        {
+            try
+            {
+                const int x = std::stoi(tokens[0]);
+                const int y = std::stoi(tokens[1]);
+                const int width = std::min<long>(std::stoi(tokens[2]), static_cast<long>(INT_MAX) - x);
+                const int height = std::min<long>(std::stoi(tokens[3]), static_cast<long>(INT_MAX) - y);
+                area = Util::Rectangle(x, y, width, height);
+            }
+            catch (const std::exception&)
+            {
+                Log::warn("Invalidating the whole part for: " + rPayload);
+            }
+        }
+
+        const auto it = _missedInvalidations.find(curPart);
+        if (it == _missedInvalidations.end())
+        {
+            _missedInvalidations.emplace(curPart, area);
+        }
+        else
+        {
+            it->second.extend(area);
+        }
+    }
+    else if (nType == LOK_CALLBACK_STATUS_INDICATOR_START || nType == LOK_CALLBACK_STATUS_INDICATOR_FINISH)
+    {
+        // Whether the progress is shown is one state, and its value
+        // starts over or ends with it.
+        _missedStates.erase("statusindicatorsetvalue");
+        _missedStates["statusindicator"] = MissedCallback{ ++_missedSequence, nType, rPayload };
+    }
+    else if (nType == LOK_CALLBACK_STATUS_INDICATOR_SET_VALUE)
+    {
+        _missedStates["statusindicatorsetvalue"] = MissedCallback{ ++_missedSequence, nType, rPayload };
+    }
+    else if (nType == LOK_CALLBACK_SET_PART)
+    {
+        _missedStates["setpart"] = MissedCallback{ ++_missedSequence, nType, rPayload };
+    }
+    else if (LOKitHelper::isStateCallback(nType))
+    {
+        // Only the latest value matters, state changes are per command.
+        const std::string key = std::to_string(nType) +
+                                (nType == LOK_CALLBACK_STATE_CHANGED ? " " + rPayload.substr(0, rPayload.find('=')) : "");
+        _missedStates[key] = MissedCallback{ ++_missedSequence, nType, rPayload };
+    }
+}
+
+void ChildProcessSession::sendMissedUpdates()
+{
+    if (_multiView)
+        _loKitDocument->pClass->setView(_loKitDocument, _viewId);
+
+    if (!_missedInvalidations.empty())
+    {
+        sendTextFrame("curpart: part=" + std::to_string(_loKitDocument->pClass->getPart(_loKitDocument)));
+    }
+
+    if (_missedInvalidations.find(-1) != _missedInvalidations.end())
+    {
+        sendTextFrame("invalidatetiles: EMPTY");
+    }
+    else
+    {
+        for (auto& it : _missedInvalidations)
+        {
+            Log::debug() << "Sending the invalidations missed while inactive, part " << it.first
+                         << ": " << it.second.getLeft() << ", " << it.second.getTop() << ", "
+                         << it.second.getWidth() << ", " << it.second.getHeight() << Log::end;
+            sendTextFrame("invalidatetiles:"
+                          " part=" + std::to_string(it.first) +
+                          " x=" + std::to_string(it.second.getLeft()) +
+                          " y=" + std::to_string(it.second.getTop()) +
+                          " width=" + std::to_string(it.second.getWidth()) +
+                          " height=" + std::to_string(it.second.getHeight()));
+        }
+    }
+
+    _missedInvalidations.clear();
+
+    if (_missedDocumentSize)
+    {
+        _missedDocumentSize = false;
+        getStatus(nullptr, 0);
+        getPartPageRectangles(nullptr, 0);
+    }
+
+    // The session is active again, so these are sent on now, in the
+    // order they came, e.g. a selection after the part it is on.
+    std::vector<MissedCallback> missedStates;
+    for (const auto& it : _missedStates)
+        missedStates.push_back(it.second);
+    _missedStates.clear();
+
+    std::sort(missedStates.begin(), missedStates.end(),
+              [](const MissedCallback& a, const MissedCallback& b) { return a._sequence < b._sequence; });
+    for (const auto& it : missedStates)
+    {
+        loKitCallback(it._type, it._payload);
+    }
 }
 
 /* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -10,20 +10,22 @@
 #ifndef INCLUDED_LOOLCHILDPROCESSSESSION_HPP
 #define INCLUDED_LOOLCHILDPROCESSSESSION_HPP
 
+#include <atomic>
+#include <deque>
+#include <map>
 #include <mutex>
+#include <vector>
 
 #define LOK_USE_UNSTABLE_API
 #include <LibreOfficeKit/LibreOfficeKit.h>
 
 #include <Poco/Thread.h>
-#include <Poco/NotificationQueue.h>
 #include "LOOLSession.hpp"
+#include "Rectangle.hpp"
 
 // The client port number, which is changed via loolwsd args.
 static int ClientPortNumber = DEFAULT_CLIENT_PORT_NUMBER;
 
-class CallbackWorker;
-
 class ChildProcessSession final : public LOOLSession
 {
 public:
@@ -76,15 +78,33 @@ public:
     virtual void disconnect(const std::string& reason = "") override;
     virtual bool handleDisconnect(Poco::StringTokenizer& tokens) override;
 
+    /// Prefetches the top-left of the parts next to the one the client
+    /// views, one row of tiles per call, when the connection is quiet.
+    /// Returns false when there is nothing (left) to do.
+    bool handleIdle();
+
     int getViewId() const  { return _viewId; }
 
     const std::string& getDocType() const { return _docType; }
 
     LibreOfficeKitDocument *getLoKitDocument() const { return _loKitDocument; }
 
-    void loKitCallback(const int nType, const char* pPayload);
+    /// Handles a LOK callback for this view, on the callback thread of the document.
+    void loKitCallback(const int nType, const std::string& rPayload);
+
+    /// Sends the status: and partpagerectangles: messages after the document
+    /// size changed, those that differ from the last ones sent. Returns how
+    /// many were left out as unchanged.
+    size_t sendDocumentSize(const std::string& status, const std::string& rectangles);
+
+    /// True while rendering ahead, when the callbacks LOK emits are
+    /// partly about our own part switching, not for the clients.
+    static bool isPrefetching() { return PrefetchingView >= 0; }
 
-    std::unique_lock<std::recursive_mutex> getLock() { return std::unique_lock<std::recursive_mutex>(Mutex); }
+    /// The view rendering ahead, whose part is switched, -1 when none.
+    static int getPrefetchingView() { return PrefetchingView; }
+
+    static std::unique_lock<std::recursive_mutex> getLock() { return std::unique_lock<std::recursive_mutex>(Mutex); }
 
     const Statistics& getStatistics() const { return _stats; }
     bool isInactive() const { return _stats.getInactivityMS() >= InactivityThresholdMS; }
@@ -114,11 +134,30 @@ public:
     bool saveAs(const char *buffer, int length, Poco::StringTokenizer& tokens);
     bool setClientPart(const char *buffer, int length, Poco::StringTokenizer& tokens);
     bool setPage(const char *buffer, int length, Poco::StringTokenizer& tokens);
+    bool setViewport(const char *buffer, int length, Poco::StringTokenizer& tokens);
 
 private:
+    /// Renders the tiles as one area and sends them, suffix is
+    /// appended to the header of each tile: message.
+    void renderTiles(int part, int pixelWidth, int pixelHeight,
+                     const std::vector<Util::Rectangle>& tiles,
+                     int tileWidth, int tileHeight, const std::string& suffix);
 
     virtual bool _handleInput(const char *buffer, int length) override;
 
+    /// Takes the document type from a status: message.
+    bool updateDocType(const std::string& status);
+
+    /// Sends the status, page rectangles and the command values for the
+    /// toolbar, that the client needs after loading, as one message.
+    bool sendLoadBundle();
+
+    /// Records what a callback changed while the client was inactive.
+    void trackMissedCallback(const int nType, const std::string& rPayload);
+
+    /// Sends the client what it missed while inactive.
+    void sendMissedUpdates();
+
 private:
     LibreOfficeKitDocument *_loKitDocument;
     std::string _docType;
@@ -132,14 +171,47 @@ private:
     /// Statistics and activity tracking.
     Statistics _stats;
 
-    std::unique_ptr<CallbackWorker> _callbackWorker;
-    Poco::Thread _callbackThread;
-    Poco::NotificationQueue _callbackQueue;
+    /// The viewport of the client, as forwarded by the master.
+    int _viewportPart;
+    int _viewportPixelWidth;
+    int _viewportPixelHeight;
+    int _viewportTileWidth;
+    int _viewportTileHeight;
+    int _viewportColumns;
+    int _viewportRows;
+    /// A callback missed while inactive, numbered in the order it came.
+    struct MissedCallback
+    {
+        unsigned _sequence;
+        int _type;
+        std::string _payload;
+    };
+
+    /// What the client missed while inactive, guarded by Mutex: the
+    /// invalidated area per part (-1 for all), the latest callback of
+    /// each state, to replay in the order they came, and whether the
+    /// document size changed.
+    std::map<int, Util::Rectangle> _missedInvalidations;
+    std::map<std::string, MissedCallback> _missedStates;
+    unsigned _missedSequence;
+    bool _missedDocumentSize;
+
+    /// The last status: and partpagerectangles: sent.
+    std::string _lastStatus;
+    std::string _lastPartPageRectangles;
+
+    /// The part the prefetch queue was built for, -1 to rebuild it.
+    int _prefetchPart;
+    /// The (part, row) pairs of tile rows still to prefetch.
+    std::deque<std::pair<int, int>> _prefetchRows;
 
     /// Synchronize _loKitDocument acess.
     /// This should be owned by Document.
     static std::recursive_mutex Mutex;
 
+    /// Set while prefetching, see isPrefetching().
+    static std::atomic<int> PrefetchingView;
+
     static constexpr auto InactivityThresholdMS = 120 * 1000;
 };
 
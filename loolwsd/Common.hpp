@@ -18,10 +18,13 @@ constexpr int MAX_SESSIONS = 1024;
 
 constexpr int DEFAULT_CLIENT_PORT_NUMBER = 9980;
 constexpr int MASTER_PORT_NUMBER = 9981;
-constexpr int INTERVAL_PROBES = 10;
 constexpr int MAINTENANCE_INTERVAL = 1;
 constexpr int CHILD_TIMEOUT_SECS = 10;
 constexpr int POLL_TIMEOUT_MS = 1000;
+/// How often, in seconds, the kits report their memory to the broker.
+constexpr int MEMORY_REPORT_INTERVAL = 30;
+/// How often, in seconds, wsd logs its statistics, when they changed.
+constexpr int STATISTICS_INTERVAL = 20;
 
 /// Pipe and Socket read buffer size.
 /// Should be large enough for ethernet packets
@@ -33,7 +36,20 @@ constexpr int READ_BUFFER_SIZE = 2048;
 /// size are considered small messages.
 constexpr int SMALL_MESSAGE_SIZE = READ_BUFFER_SIZE / 2;
 
+/// Upper bound on the number of tiles a single 'viewport'
+/// subscription may cover, to reject bogus view sizes.
+constexpr int MAX_VIEWPORT_TILES = 1024;
+
+/// How long the input of a kit connection must be quiet
+/// before it gets to do background work, like prefetching.
+constexpr int IDLE_WORK_DELAY_MS = 500;
+
 static const std::string JailedDocumentRoot = "/user/docs/";
 
+/// The abstract sockets, suffixed with the jail id, on which
+/// wsd listens for the broker, and the broker for the kits.
+static const std::string WSD_SOCKET_PREFIX = "loolwsd-";
+static const std::string BROKER_SOCKET_PREFIX = "loolbroker-";
+
 #endif
 /* vim:set shiftwidth=4 softtabstop=4 expandtab: */
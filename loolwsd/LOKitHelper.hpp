@@ -10,7 +10,12 @@
 #ifndef INCLUDED_LOKITHELPER_HPP
 #define INCLUDED_LOKITHELPER_HPP
 
+#include <algorithm>
+#include <climits>
 #include <string>
+#include <vector>
+
+#include <Poco/StringTokenizer.h>
 
 #define LOK_USE_UNSTABLE_API
 #include <LibreOfficeKit/LibreOfficeKit.h>
@@ -36,6 +41,190 @@ namespace LOKitHelper
         }
     }
 
+    inline
+    std::string kitCallbackTypeToString(const int nType)
+    {
+        switch (nType)
+        {
+        case LOK_CALLBACK_INVALIDATE_TILES:
+            return std::string("LOK_CALLBACK_INVALIDATE_TILES");
+        case LOK_CALLBACK_INVALIDATE_VISIBLE_CURSOR:
+            return std::string("LOK_CALLBACK_INVALIDATE_VISIBLE_CURSOR");
+        case LOK_CALLBACK_TEXT_SELECTION:
+            return std::string("LOK_CALLBACK_TEXT_SELECTION");
+        case LOK_CALLBACK_TEXT_SELECTION_START:
+            return std::string("LOK_CALLBACK_TEXT_SELECTION_START");
+        case LOK_CALLBACK_TEXT_SELECTION_END:
+            return std::string("LOK_CALLBACK_TEXT_SELECTION_END");
+        case LOK_CALLBACK_CURSOR_VISIBLE:
+            return std::string("LOK_CALLBACK_CURSOR_VISIBLE");
+        case LOK_CALLBACK_GRAPHIC_SELECTION:
+            return std::string("LOK_CALLBACK_GRAPHIC_SELECTION");
+        case LOK_CALLBACK_CELL_CURSOR:
+            return std::string("LOK_CALLBACK_CELL_CURSOR");
+        case LOK_CALLBACK_CELL_FORMULA:
+            return std::string("LOK_CALLBACK_CELL_FORMULA");
+        case LOK_CALLBACK_MOUSE_POINTER:
+            return std::string("LOK_CALLBACK_MOUSE_POINTER");
+        case LOK_CALLBACK_SEARCH_RESULT_SELECTION:
+            return std::string("LOK_CALLBACK_SEARCH_RESULT_SELECTION");
+        case LOK_CALLBACK_UNO_COMMAND_RESULT:
+            return std::string("LOK_CALLBACK_UNO_COMMAND_RESULT");
+        case LOK_CALLBACK_HYPERLINK_CLICKED:
+            return std::string("LOK_CALLBACK_HYPERLINK_CLICKED");
+        case LOK_CALLBACK_STATE_CHANGED:
+            return std::string("LOK_CALLBACK_STATE_CHANGED");
+        case LOK_CALLBACK_STATUS_INDICATOR_START:
+            return std::string("LOK_CALLBACK_STATUS_INDICATOR_START");
+        case LOK_CALLBACK_STATUS_INDICATOR_SET_VALUE:
+            return std::string("LOK_CALLBACK_STATUS_INDICATOR_SET_VALUE");
+        case LOK_CALLBACK_STATUS_INDICATOR_FINISH:
+            return std::string("LOK_CALLBACK_STATUS_INDICATOR_FINISH");
+        case LOK_CALLBACK_SEARCH_NOT_FOUND:
+            return std::string("LOK_CALLBACK_SEARCH_NOT_FOUND");
+        case LOK_CALLBACK_DOCUMENT_SIZE_CHANGED:
+            return std::string("LOK_CALLBACK_DOCUMENT_SIZE_CHANGED");
+        case LOK_CALLBACK_SET_PART:
+            return std::string("LOK_CALLBACK_SET_PART");
+        }
+        return std::to_string(nType);
+    }
+
+    /// Callbacks carrying the current value of some state, where
+    /// a newer one makes a pending one obsolete.
+    inline
+    bool isStateCallback(const int nType)
+    {
+        switch (nType)
+        {
+        case LOK_CALLBACK_INVALIDATE_VISIBLE_CURSOR:
+        case LOK_CALLBACK_TEXT_SELECTION:
+        case LOK_CALLBACK_TEXT_SELECTION_START:
+        case LOK_CALLBACK_TEXT_SELECTION_END:
+        case LOK_CALLBACK_CURSOR_VISIBLE:
+        case LOK_CALLBACK_GRAPHIC_SELECTION:
+        case LOK_CALLBACK_CELL_CURSOR:
+        case LOK_CALLBACK_CELL_FORMULA:
+        case LOK_CALLBACK_MOUSE_POINTER:
+        case LOK_CALLBACK_STATE_CHANGED:
+        case LOK_CALLBACK_STATUS_INDICATOR_SET_VALUE:
+        case LOK_CALLBACK_DOCUMENT_SIZE_CHANGED:
+            return true;
+        }
+
+        return false;
+    }
+
+    /// True for the callbacks after which the invalidations may be of another
+    /// part: a part switch, or parts added or removed.
+    inline
+    bool isPartChange(const int nType)
+    {
+        return (nType == LOK_CALLBACK_SET_PART || nType == LOK_CALLBACK_DOCUMENT_SIZE_CHANGED);
+    }
+
+    /// Parses an invalidation payload into its corners,
+    /// false for EMPTY (or anything else invalidating everything).
+    inline
+    bool getInvalidatedArea(const std::string& rPayload, long& x1, long& y1, long& x2, long& y2)
+    {
+        Poco::StringTokenizer tokens(rPayload, " ,", Poco::StringTokenizer::TOK_IGNORE_EMPTY | Poco::StringTokenizer::TOK_TRIM);
+        if (tokens.count() != 4)
+            return false;
+
+        try
+        {
+            x1 = std::stol(tokens[0]);
+            y1 = std::stol(tokens[1]);
+            x2 = x1 + std::stol(tokens[2]);
+            y2 = y1 + std::stol(tokens[3]);
+        }
+        catch (const std::exception&)
+        {
+            return false;
+        }
+
+        return true;
+    }
+
+    /// The session of the callbacks of the document, rather than of a view.
+    constexpr long AllSessions = -1;
+
+    /// A callback waiting to be dispatched to its session.
+    struct PendingCallback
+    {
+        PendingCallback(const long intSessionId, const int nType, const std::string& payload)
+          : _intSessionId(intSessionId),
+            _nType(nType),
+            _payload(payload)
+        {
+        }
+
+        long _intSessionId;
+        int _nType;
+        std::string _payload;
+    };
+
+    /// Adds the callback to the pending ones, replacing the obsolete ones and
+    /// merging the invalidations into one, per session. The result goes last,
+    /// so its order relative to the other callbacks is that of the newest one.
+    /// Invalidations are not merged across a part change of the session: they
+    /// are of the part current when sent, which the merged one would not be.
+    inline
+    void coalesceCallback(std::vector<PendingCallback>& pending, const long intSessionId,
+                          const int nType, const std::string& rPayload)
+    {
+        std::string payload = rPayload;
+        if (nType == LOK_CALLBACK_INVALIDATE_TILES || isStateCallback(nType))
+        {
+            // State changes are per command, like ".uno:Bold=true".
+            const std::string key = (nType == LOK_CALLBACK_STATE_CHANGED ? rPayload.substr(0, rPayload.find('=')) : "");
+
+            for (auto rit = pending.rbegin(); rit != pending.rend(); ++rit)
+            {
+                if (nType == LOK_CALLBACK_INVALIDATE_TILES && isPartChange(rit->_nType) &&
+                    (rit->_intSessionId == intSessionId ||
+                     rit->_intSessionId == AllSessions ||
+                     intSessionId == AllSessions))
+                {
+                    break;
+                }
+
+                const auto it = std::next(rit).base();
+                if (it->_intSessionId != intSessionId || it->_nType != nType ||
+                    (nType == LOK_CALLBACK_STATE_CHANGED && it->_payload.substr(0, it->_payload.find('=')) != key))
+                {
+                    continue;
+                }
+
+                if (nType == LOK_CALLBACK_INVALIDATE_TILES)
+                {
+                    long x1, y1, x2, y2, otherX1, otherY1, otherX2, otherY2;
+                    if (!getInvalidatedArea(payload, x1, y1, x2, y2) ||
+                        !getInvalidatedArea(it->_payload, otherX1, otherY1, otherX2, otherY2))
+                    {
+                        payload = "EMPTY";
+                    }
+                    else
+                    {
+                        x1 = std::min(x1, otherX1);
+                        y1 = std::min(y1, otherY1);
+                        x2 = std::max(x2, otherX2);
+                        y2 = std::max(y2, otherY2);
+                        payload = std::to_string(x1) + ", " + std::to_string(y1) + ", " +
+                                  std::to_string(std::min<long>(x2 - x1, INT_MAX)) + ", " +
+                                  std::to_string(std::min<long>(y2 - y1, INT_MAX));
+                    }
+                }
+
+                pending.erase(it);
+                break;
+            }
+        }
+
+        pending.emplace_back(intSessionId, nType, payload);
+    }
+
     inline
     std::string documentStatus(LibreOfficeKitDocument *loKitDocument)
     {
@@ -9,19 +9,35 @@
 
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 
 #include <utime.h>
 #include <ftw.h>
+#include <dirent.h>
+#include <sched.h>
 #include <unistd.h>
 #include <dlfcn.h>
 
 #include <atomic>
 #include <mutex>
+#include <unordered_map>
+#include <cctype>
 #include <cstring>
 #include <cassert>
 #include <iostream>
 #include <fstream>
 #include <deque>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <sstream>
 
 #include <Poco/Types.h>
 #include <Poco/Random.h>
@@ -59,18 +75,58 @@ using Poco::Process;
 using Poco::Thread;
 using Poco::ProcessHandle;
 
-const std::string FIFO_FILE = "/tmp/loolwsdfifo";
-const std::string FIFO_BROKER = "/tmp/loolbroker.fifo";
-const std::string BROKER_SUFIX = ".fifo";
-const std::string BROKER_PREFIX = "/tmp/lokit";
-
-static int readerChild = -1;
-static int readerBroker = -1;
+/// The connection with wsd.
+static int wsdSocket = -1;
+/// Where the kits connect to us.
+static int kitListenSocket = -1;
+/// The exits of the kits and the termination signals.
+static int signalFd = -1;
+/// Set to when the main loop next has to expire requests or resize the pool.
+static int timerFd = -1;
+/// The main loop waits on it for wsd, the kits, the signals and the timer.
+static int epollFd = -1;
 
 static std::atomic<unsigned> forkCounter;
-static std::chrono::steady_clock::time_point lastMaintenanceTime = std::chrono::steady_clock::now();
+static std::atomic<bool> poolChanged(false);
 static unsigned int childCounter = 0;
 static signed numPreSpawnedChildren = 0;
+static signed maxPreSpawnedChildren = 0;
+/// The PSS above which a kit is recycled rather than reused, 0 for no limit.
+static size_t childMemLimitKB = 0;
+static size_t recycledChildren = 0;
+/// /proc, opened before the chroot.
+static int procDir = -1;
+/// The CPUs of the NUMA nodes the kits are pinned to, if asked to,
+/// and how many documents each of them hosts.
+static std::vector<cpu_set_t> kitNodes;
+static std::vector<unsigned> nodeDocuments;
+
+/// What the kits are scheduled with, by the workload class of their
+/// clients, from the highest priority. Only conversions are niced, as
+/// unprivileged we cannot raise a kit back when an editor joins in.
+struct WorkloadClass
+{
+    const char* _name;
+    int _nice;
+    /// Best-effort I/O priority, 0 to 7, 4 by default.
+    int _ioLevel;
+    /// Relative to the other classes, in the cgroup if given.
+    int _cpuWeight;
+};
+static const WorkloadClass workloadClasses[] =
+{
+    { "interactive", 0, 4, 100 },
+    { "viewonly", 0, 6, 50 },
+    { "conversion", 10, 7, 10 }
+};
+constexpr size_t NumWorkloadClasses = sizeof(workloadClasses) / sizeof(workloadClasses[0]);
+/// The cgroup.procs of the class cgroups, opened before the chroot.
+static int workloadCgroups[NumWorkloadClasses] = { -1, -1, -1 };
+
+// Not in glibc, from linux/ioprio.h.
+constexpr int IOPRIO_WHO_PROCESS = 1;
+constexpr int IOPRIO_CLASS_BE = 2;
+constexpr int IOPRIO_CLASS_SHIFT = 13;
 
 static std::recursive_mutex forkMutex;
 
@@ -79,41 +135,24 @@ namespace
     class ChildProcess
     {
     public:
-        ChildProcess() :
-            _pid(-1),
-            _readPipe(-1),
-            _writePipe(-1)
-        {
-        }
-
-        ChildProcess(const Poco::Process::PID pid, const int readPipe, const int writePipe) :
+        /// Takes over the reader of the socket, with what it read past the hello.
+        ChildProcess(const Poco::Process::PID pid, const int socket, const Util::MessageReader& reader,
+                     const int node, const std::chrono::steady_clock::time_point spawnTime) :
             _pid(pid),
-            _readPipe(readPipe),
-            _writePipe(writePipe)
-        {
-        }
-
-        ChildProcess(ChildProcess&& other) :
-            _pid(other._pid),
-            _readPipe(other._readPipe),
-            _writePipe(other._writePipe)
+            _socket(socket),
+            _node(node),
+            _workload(0),
+            _nice(0),
+            _spawnTime(spawnTime),
+            _ready(false),
+            _reader(reader),
+            _pssKB(0),
+            _ussKB(0)
         {
-            other._pid = -1;
-            other._readPipe = -1;
-            other._writePipe = -1;
         }
 
-        const ChildProcess& operator=(ChildProcess&& other)
-        {
-            _pid = other._pid;
-            other._pid = -1;
-            _readPipe = other._readPipe;
-            other._readPipe = -1;
-            _writePipe = other._writePipe;
-            other._writePipe = -1;
-
-            return *this;
-        }
+        ChildProcess(const ChildProcess&) = delete;
+        ChildProcess& operator=(const ChildProcess&) = delete;
 
         ~ChildProcess()
         {
@@ -129,16 +168,10 @@ namespace
                _pid = -1;
             }
 
-            if (_readPipe != -1)
+            if (_socket != -1)
             {
-                ::close(_readPipe);
-                _readPipe = -1;
-            }
-
-            if (_writePipe != -1)
-            {
-                ::close(_writePipe);
-                _writePipe = -1;
+                ::close(_socket);
+                _socket = -1;
             }
         }
 
@@ -146,63 +179,649 @@ namespace
         const std::string& getUrl() const { return _url; }
 
         Poco::Process::PID getPid() const { return _pid; }
-        int getReadPipe() const { return _readPipe; }
-        int getWritePipe() const { return _writePipe; }
+        int getSocket() const { return _socket; }
+
+        /// The NUMA node the kit is pinned to, or -1.
+        int getNode() const { return _node; }
+
+        /// When we started spawning it.
+        std::chrono::steady_clock::time_point getSpawnTime() const { return _spawnTime; }
+
+        /// Whether it has initialized LibreOfficeKit and warmed up, to take documents.
+        void setReady() { _ready = true; }
+        bool isReady() const { return _ready; }
+
+        /// The index of its workload class, 0 for interactive.
+        void setWorkload(const size_t workload) { _workload = workload; }
+        size_t getWorkload() const { return _workload; }
+
+        /// The nice level it runs at, which may not be that of its class.
+        void setNice(const int nice) { _nice = nice; }
+        int getNice() const { return _nice; }
+
+        /// As last reported by the kit.
+        void setMemory(const size_t pssKB, const size_t ussKB) { _pssKB = pssKB; _ussKB = ussKB; }
+        size_t getPssKB() const { return _pssKB; }
+        size_t getUssKB() const { return _ussKB; }
+        bool isOverMemoryLimit() const { return childMemLimitKB > 0 && _pssKB > childMemLimitKB; }
+
+        /// Only the main loop sends to the kits.
+        bool send(const std::string& message) { return Util::sendMessage(_socket, message); }
+
+        /// Only the main loop reads from the kits. False once the kit is gone.
+        bool read(std::vector<std::string>& messages) { return _reader.read(messages); }
+        bool read(std::vector<std::string>& messages, const int timeoutMs) { return _reader.read(messages, timeoutMs); }
 
     private:
         std::string _url;
         Poco::Process::PID _pid;
-        int _readPipe;
-        int _writePipe;
+        int _socket;
+        int _node;
+        size_t _workload;
+        int _nice;
+        std::chrono::steady_clock::time_point _spawnTime;
+        bool _ready;
+        Util::MessageReader _reader;
+        size_t _pssKB;
+        size_t _ussKB;
+    };
+
+    /// A thread request sent to a kit, until it responds.
+    struct PendingRequest
+    {
+        Process::PID _pid;
+        std::string _tid;
+        std::string _url;
+        /// When the request came from the master.
+        std::chrono::steady_clock::time_point _received;
     };
 
     static std::map<Process::PID, std::shared_ptr<ChildProcess>> _childProcesses;
 
-    /// Safely looks up a child hosting a URL.
+    /// The children by their socket, for the main loop.
+    static std::unordered_map<int, std::shared_ptr<ChildProcess>> _childrenBySocket;
+
+    /// The children by the URL they host, and the empty ones, kept
+    /// up to date with setChildUrl as the kits report their changes.
+    static std::unordered_map<std::string, std::shared_ptr<ChildProcess>> _childrenByUrl;
+    static std::unordered_map<Process::PID, std::shared_ptr<ChildProcess>> _emptyChildren;
+
+    /// The requests in flight to the kits, by the id the master gave them.
+    /// The responses come in any order, as the main loop reads them.
+    static std::map<std::string, PendingRequest> _pendingRequests;
+
+    /// A request from the master that no kit could take yet.
+    struct ParkedRequest
+    {
+        std::string _tid;
+        std::string _url;
+        std::string _rid;
+        size_t _workload;
+        std::chrono::steady_clock::time_point _received;
+        /// Whether it asked the pool for a child of its own yet.
+        bool _missed;
+    };
+
+    /// The requests waiting for a kit, in the order they came. The main
+    /// loop serves them as the kits report ready or close their document.
+    static std::deque<ParkedRequest> _parkedRequests;
+
+    /// A kit spawned, until it connects and says hello.
+    struct SpawningChild
+    {
+        int _node;
+        std::chrono::steady_clock::time_point _spawnTime;
+    };
+
+    /// A connection accepted, until the kit says who it is.
+    struct ConnectingKit
+    {
+        Util::MessageReader _reader;
+        std::chrono::steady_clock::time_point _accepted;
+    };
+
+    /// The kits spawned and not connected yet, by pid, and the
+    /// connections not identified yet, by socket. The main loop
+    /// gives up on them after CHILD_TIMEOUT_SECS.
+    static std::map<Process::PID, SpawningChild> _spawningChildren;
+    static std::map<int, ConnectingKit> _connectingKits;
+
+    /// Safely adds a new child process, empty once it reports ready.
+    void addChild(const std::shared_ptr<ChildProcess>& child)
+    {
+        std::lock_guard<std::recursive_mutex> lock(forkMutex);
+        _childProcesses[child->getPid()] = child;
+        _childrenBySocket[child->getSocket()] = child;
+
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.fd = child->getSocket();
+        if (epoll_ctl(epollFd, EPOLL_CTL_ADD, child->getSocket(), &event) < 0)
+            Log::error("Error: failed to add the socket of child [" + std::to_string(child->getPid()) + "] to the main loop.");
+    }
+
+    /// Safely changes the URL a child hosts, empty for none.
+    void setChildUrl(const std::shared_ptr<ChildProcess>& child, const std::string& url)
+    {
+        std::lock_guard<std::recursive_mutex> lock(forkMutex);
+        if (child->getUrl().empty())
+        {
+            _emptyChildren.erase(child->getPid());
+        }
+        else
+        {
+            const auto it = _childrenByUrl.find(child->getUrl());
+            if (it != _childrenByUrl.end() && it->second == child)
+                _childrenByUrl.erase(it);
+        }
+
+        if (child->getNode() >= 0 && child->getUrl().empty() != url.empty())
+        {
+            if (url.empty())
+                --nodeDocuments[child->getNode()];
+            else
+                ++nodeDocuments[child->getNode()];
+        }
+
+        child->setUrl(url);
+        if (url.empty())
+            _emptyChildren[child->getPid()] = child;
+        else
+            _childrenByUrl[url] = child;
+    }
+
+    /// Safely looks up a child hosting a URL, or else an empty one.
     std::shared_ptr<ChildProcess> findChild(const std::string& url)
     {
         std::lock_guard<std::recursive_mutex> lock(forkMutex);
 
-        std::shared_ptr<ChildProcess> child;
-        for (const auto& it : _childProcesses)
+        const auto it = _childrenByUrl.find(url);
+        if (it != _childrenByUrl.end())
+            return it->second;
+
+        // New documents go to the node hosting the fewest.
+        std::shared_ptr<ChildProcess> best;
+        unsigned bestDocuments = 0;
+        for (const auto& empty : _emptyChildren)
         {
-            if (it.second->getUrl() == url)
+            const int node = empty.second->getNode();
+            const unsigned documents = (node >= 0 ? nodeDocuments[node] : 0);
+            if (!best || documents < bestDocuments)
             {
-                return it.second;
+                best = empty.second;
+                bestDocuments = documents;
+                if (documents == 0)
+                    break;
             }
-
-            if (it.second->getUrl().empty())
-                child = it.second;
         }
 
-        return child;
+        return best;
     }
 
-    /// Safely looks up the pipe descriptor
-    /// of a child. Returns -1 on error.
-    int getChildPipe(const Process::PID pid)
+    /// Safely picks the node with the fewest kits for a new one, or -1.
+    int chooseNode()
     {
         std::lock_guard<std::recursive_mutex> lock(forkMutex);
-        const auto it = _childProcesses.find(pid);
-        return (it != _childProcesses.end() ? it->second->getWritePipe() : -1);
+        if (kitNodes.empty())
+            return -1;
+
+        std::vector<unsigned> kits(kitNodes.size(), 0);
+        for (const auto& it : _childProcesses)
+        {
+            if (it.second->getNode() >= 0)
+                ++kits[it.second->getNode()];
+        }
+
+        for (const auto& it : _spawningChildren)
+        {
+            if (it.second._node >= 0)
+                ++kits[it.second._node];
+        }
+
+        return std::min_element(kits.begin(), kits.end()) - kits.begin();
     }
 
     /// Safely removes a child process.
     void removeChild(const Process::PID pid)
     {
         std::lock_guard<std::recursive_mutex> lock(forkMutex);
+        _spawningChildren.erase(pid);
+
         const auto it = _childProcesses.find(pid);
         if (it != _childProcesses.end())
         {
+            const auto child = it->second;
+            if (child->getUrl().empty())
+            {
+                _emptyChildren.erase(pid);
+            }
+            else
+            {
+                if (child->getNode() >= 0)
+                    --nodeDocuments[child->getNode()];
+
+                const auto urlIt = _childrenByUrl.find(child->getUrl());
+                if (urlIt != _childrenByUrl.end() && urlIt->second == child)
+                    _childrenByUrl.erase(urlIt);
+            }
+
+            for (auto pending = _pendingRequests.begin(); pending != _pendingRequests.end(); )
+            {
+                if (pending->second._pid == pid)
+                {
+                    Log::error("Child [" + std::to_string(pid) + "] is gone with request [" +
+                               pending->first + "] for thread [" + pending->second._tid + "].");
+                    pending = _pendingRequests.erase(pending);
+                }
+                else
+                    ++pending;
+            }
+
             // Close the child resources.
-            it->second->close();
+            _childrenBySocket.erase(child->getSocket());
+            child->close();
             _childProcesses.erase(it);
         }
     }
 
+    /// Safely completes a request with the response of its kit.
+    void completeRequest(const Process::PID pid, const std::string& id, const bool ok, const std::string& kitMS)
+    {
+        std::lock_guard<std::recursive_mutex> lock(forkMutex);
+        const auto it = _pendingRequests.find(id);
+        if (it == _pendingRequests.end() || it->second._pid != pid)
+        {
+            Log::warn("Response from child [" + std::to_string(pid) + "] to unknown request [" + id + "].");
+            return;
+        }
+
+        const auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                            std::chrono::steady_clock::now() - it->second._received).count();
+        if (ok)
+        {
+            Log::info() << "Request [" << id << "] for thread [" << it->second._tid << "] done by child ["
+                        << pid << "] in " << ms << " ms, of which the kit took " << kitMS << " ms." << Log::end;
+        }
+        else
+        {
+            Log::error() << "Child [" << pid << "] failed request [" << id << "] for thread ["
+                         << it->second._tid << "] on URL [" << it->second._url << "] in " << ms << " ms." << Log::end;
+        }
+
+        _pendingRequests.erase(it);
+    }
+
+    /// Safely drops the requests the kits didn't respond to in time.
+    void expireRequests()
+    {
+        std::lock_guard<std::recursive_mutex> lock(forkMutex);
+        const auto now = std::chrono::steady_clock::now();
+        for (auto it = _pendingRequests.begin(); it != _pendingRequests.end(); )
+        {
+            if (now - it->second._received > std::chrono::seconds(CHILD_TIMEOUT_SECS))
+            {
+                Log::error("Child [" + std::to_string(it->second._pid) + "] did not respond to request [" +
+                           it->first + "] for thread [" + it->second._tid + "].");
+                it = _pendingRequests.erase(it);
+            }
+            else
+                ++it;
+        }
+
+        // The master gave up on them meanwhile.
+        while (!_parkedRequests.empty() &&
+               now - _parkedRequests.front()._received > std::chrono::seconds(CHILD_TIMEOUT_SECS))
+        {
+            Log::error("No child for request [" + _parkedRequests.front()._rid + "] for thread [" +
+                       _parkedRequests.front()._tid + "] in time.");
+            _parkedRequests.pop_front();
+        }
+    }
+
+    /// Safely returns when the oldest request in flight or parked expires, or
+    /// max() when there is none.
+    std::chrono::steady_clock::time_point getRequestsDeadline()
+    {
+        std::lock_guard<std::recursive_mutex> lock(forkMutex);
+        auto deadline = std::chrono::steady_clock::time_point::max();
+        for (const auto& it : _pendingRequests)
+            deadline = std::min(deadline, it.second._received + std::chrono::seconds(CHILD_TIMEOUT_SECS));
+        if (!_parkedRequests.empty())
+            deadline = std::min(deadline, _parkedRequests.front()._received + std::chrono::seconds(CHILD_TIMEOUT_SECS));
+
+        return deadline;
+    }
+
+    /// Safely gives up on the kits that did not connect and say hello in time.
+    void expireSpawns()
+    {
+        std::lock_guard<std::recursive_mutex> lock(forkMutex);
+        const auto now = std::chrono::steady_clock::now();
+        for (auto it = _spawningChildren.begin(); it != _spawningChildren.end(); )
+        {
+            if (now - it->second._spawnTime > std::chrono::seconds(CHILD_TIMEOUT_SECS))
+            {
+                Log::error("Error: kit [" + std::to_string(it->first) + "] did not connect. Abandoning child.");
+                if (kill(it->first, SIGTERM) != 0 && kill(it->first, 0) != 0)
+                    Log::warn("Cannot terminate lokit [" + std::to_string(it->first) + "]. Abandoning.");
+                it = _spawningChildren.erase(it);
+            }
+            else
+                ++it;
+        }
+
+        for (auto it = _connectingKits.begin(); it != _connectingKits.end(); )
+        {
+            if (now - it->second._accepted > std::chrono::seconds(CHILD_TIMEOUT_SECS))
+            {
+                Log::warn("Connection from a kit that did not say hello. Closing.");
+                epoll_ctl(epollFd, EPOLL_CTL_DEL, it->first, nullptr);
+                close(it->first);
+                it = _connectingKits.erase(it);
+            }
+            else
+                ++it;
+        }
+    }
+
+    /// Safely returns when the first kit that is spawned or connected,
+    /// but didn't say hello yet, expires, or max() when there is none.
+    std::chrono::steady_clock::time_point getSpawnsDeadline()
+    {
+        std::lock_guard<std::recursive_mutex> lock(forkMutex);
+        auto deadline = std::chrono::steady_clock::time_point::max();
+        for (const auto& it : _spawningChildren)
+            deadline = std::min(deadline, it.second._spawnTime + std::chrono::seconds(CHILD_TIMEOUT_SECS));
+        for (const auto& it : _connectingKits)
+            deadline = std::min(deadline, it.second._accepted + std::chrono::seconds(CHILD_TIMEOUT_SECS));
+
+        return deadline;
+    }
+
+    /// Safely recycles a child that grew over the memory limit, once it
+    /// hosts nothing and no request is on its way to it. Returns whether it did.
+    bool recycleChild(const std::shared_ptr<ChildProcess>& child)
+    {
+        std::lock_guard<std::recursive_mutex> lock(forkMutex);
+        for (const auto& it : _pendingRequests)
+        {
+            if (it.second._pid == child->getPid())
+                return false;
+        }
+
+        ++recycledChildren;
+        Log::info() << "Recycling child [" << child->getPid() << "], using "
+                    << child->getPssKB() << " kB PSS." << Log::end;
+        removeChild(child->getPid());
+        poolChanged = true;
+        return true;
+    }
+
+    /// Looks up a workload class by name, or else returns interactive.
+    size_t findWorkload(const std::string& name)
+    {
+        for (size_t i = 0; i < NumWorkloadClasses; ++i)
+        {
+            if (name == workloadClasses[i]._name)
+                return i;
+        }
+
+        Log::warn("Unknown workload class [" + name + "], taking it as interactive.");
+        return 0;
+    }
+
+    /// Safely schedules all the threads of a kit by a workload class,
+    /// and moves it to the cgroup of the class. Each is done even if
+    /// another fails, and the class is recorded, so that it is not retried
+    /// (and warned about) on every request. Returns whether the kit runs
+    /// at the nice level of the class, which takes CAP_SYS_NICE to lower.
+    bool applyWorkload(const std::shared_ptr<ChildProcess>& child, const size_t workload)
+    {
+        std::lock_guard<std::recursive_mutex> lock(forkMutex);
+        const WorkloadClass& target = workloadClasses[workload];
+        if (child->getWorkload() == workload && child->getNice() == target._nice)
+            return true;
+
+        // The nice level and the I/O priority are per thread.
+        const std::string pid = std::to_string(child->getPid());
+        std::vector<std::string> tids;
+        const int taskDir = (procDir < 0 ? -1 : openat(procDir, (pid + "/task").c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+        DIR* dir = (taskDir < 0 ? nullptr : fdopendir(taskDir));
+        if (dir)
+        {
+            while (const struct dirent* entry = readdir(dir))
+            {
+                if (std::isdigit(entry->d_name[0]))
+                    tids.push_back(entry->d_name);
+            }
+
+            closedir(dir);
+        }
+        else
+        {
+            if (taskDir >= 0)
+                close(taskDir);
+            tids.push_back(pid);
+        }
+
+        bool niced = true;
+        bool ioPriority = true;
+        for (const auto& tid : tids)
+        {
+            const int id = std::stoi(tid);
+            if (setpriority(PRIO_PROCESS, id, target._nice) != 0)
+                niced = false;
+
+            if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, id,
+                        (IOPRIO_CLASS_BE << IOPRIO_CLASS_SHIFT) | target._ioLevel) != 0)
+                ioPriority = false;
+        }
+
+        const bool cgroup = (workloadCgroups[workload] < 0 ||
+                             write(workloadCgroups[workload], pid.data(), pid.size()) == static_cast<ssize_t>(pid.size()));
+
+        // Warned once per change of class.
+        if (child->getWorkload() != workload && (!niced || !ioPriority || !cgroup))
+        {
+            Log::warn() << "Child [" << pid << "] scheduled as " << target._name << " only partly:"
+                        << (niced ? "" : " cannot set nice " + std::to_string(target._nice) +
+                                         " (lowering it needs CAP_SYS_NICE), stays at " +
+                                         std::to_string(child->getNice()) + ";")
+                        << (ioPriority ? "" : " cannot set the I/O priority;")
+                        << (cgroup ? "" : " cannot move it to its cgroup;") << Log::end;
+        }
+        else
+        {
+            Log::debug("Child [" + pid + "] scheduled as " + target._name + ".");
+        }
+
+        child->setWorkload(workload);
+        if (niced)
+            child->setNice(target._nice);
+
+        return niced;
+    }
+
+    /// Safely sums up the memory the kits reported.
+    std::string getMemoryStatistics()
+    {
+        std::lock_guard<std::recursive_mutex> lock(forkMutex);
+        size_t pssKB = 0;
+        size_t ussKB = 0;
+        size_t maxPssKB = 0;
+        size_t over = 0;
+        for (const auto& it : _childProcesses)
+        {
+            pssKB += it.second->getPssKB();
+            ussKB += it.second->getUssKB();
+            maxPssKB = std::max(maxPssKB, it.second->getPssKB());
+            over += (it.second->isOverMemoryLimit() ? 1 : 0);
+        }
+
+        std::ostringstream oss;
+        oss << "Kits: " << _childProcesses.size() << ", PSS: " << pssKB << " kB, max: " << maxPssKB
+            << " kB, USS: " << ussKB << " kB, over the limit: " << over << ", recycled: " << recycledChildren << ".";
+        return oss.str();
+    }
+
+    /// Reads a file under /proc, empty on failure.
+    std::string readProcFile(const std::string& name)
+    {
+        std::string content;
+        const int fd = openat(procDir, name.c_str(), O_RDONLY);
+        if (fd < 0)
+            return content;
+
+        char buffer[4096];
+        ssize_t n;
+        while ((n = read(fd, buffer, sizeof(buffer))) > 0)
+            content.append(buffer, n);
+
+        ::close(fd);
+        return content;
+    }
+
+    /// Returns a field of /proc/meminfo in kB, 0 if unknown.
+    size_t getMemInfoKB(const std::string& field)
+    {
+        const std::string memInfo = readProcFile("meminfo");
+        const auto pos = memInfo.find(field + ":");
+        return (pos != std::string::npos ? std::strtoul(memInfo.c_str() + pos + field.size() + 1, nullptr, 10) : 0);
+    }
+
+    /// Returns the resident memory of a process in kB, 0 if unknown.
+    size_t getResidentKB(const Process::PID pid)
+    {
+        const std::string statm = readProcFile(std::to_string(pid) + "/statm");
+        StringTokenizer tokens(statm, " ", StringTokenizer::TOK_IGNORE_EMPTY | StringTokenizer::TOK_TRIM);
+        return (tokens.count() > 1 ? std::strtoul(tokens[1].c_str(), nullptr, 10) * (sysconf(_SC_PAGESIZE) / 1024) : 0);
+    }
+
+    /// The windows over which the demand for children is measured.
+    constexpr int ShortWindowSecs = 10;
+    constexpr int LongWindowSecs = 300;
+
+    /// Sizes the pool of empty children to the recent demand, the time it
+    /// takes to spawn one, and the memory available, within the bounds
+    /// given by --numprespawns and --maxprespawns. Guarded by forkMutex.
+    class ChildPool
+    {
+    public:
+        ChildPool() :
+            _min(1),
+            _max(1),
+            _hits(0),
+            _misses(0),
+            _spawns(0),
+            _spawnTotalMS(0),
+            _spawnMaxMS(0),
+            _target(0)
+        {
+        }
+
+        void setBounds(const unsigned min, const unsigned max)
+        {
+            _min = min;
+            _max = std::max(min, max);
+            _target = _min;
+        }
+
+        /// A request for a new document got an empty child, or found none.
+        void recordRequest(const bool hit)
+        {
+            _requests.push_back(std::chrono::steady_clock::now());
+            if (hit)
+                ++_hits;
+            else
+                ++_misses;
+        }
+
+        void recordSpawn(const double ms)
+        {
+            ++_spawns;
+            _spawnTotalMS += ms;
+            _spawnMaxMS = std::max(_spawnMaxMS, ms);
+        }
+
+        /// Returns how many empty children to keep, given how many
+        /// there are and the memory one takes (0 if unknown).
+        unsigned getTarget(const unsigned empty, const size_t childKB)
+        {
+            // The demand is the faster of the short and the long term
+            // rates, so that a spike grows the pool and it shrinks slowly.
+            const auto now = std::chrono::steady_clock::now();
+            while (!_requests.empty() && now - _requests.front() > std::chrono::seconds(LongWindowSecs))
+                _requests.pop_front();
+
+            const auto recent = std::count_if(_requests.begin(), _requests.end(),
+                                              [&now](const std::chrono::steady_clock::time_point& time)
+                                              { return now - time <= std::chrono::seconds(ShortWindowSecs); });
+            const double rate = std::max(static_cast<double>(recent) / ShortWindowSecs,
+                                         static_cast<double>(_requests.size()) / LongWindowSecs);
+
+            // Keep what the demand takes until new children are spawned.
+            const double horizonSecs = getSpawnAverageMS() / 1000 + MAINTENANCE_INTERVAL;
+            unsigned target = std::min<unsigned>(_min + std::ceil(rate * horizonSecs), _max);
+
+            // Leave a tenth of the memory to the documents being edited.
+            const size_t availableKB = getMemInfoKB("MemAvailable");
+            const size_t reserveKB = getMemInfoKB("MemTotal") / 10;
+            if (childKB > 0 && availableKB > 0 && target > empty)
+            {
+                const size_t affordable = (availableKB > reserveKB ? (availableKB - reserveKB) / childKB : 0);
+                target = std::max<unsigned>(_min, std::min<size_t>(target, empty + affordable));
+            }
+
+            if (target != _target)
+            {
+                Log::info() << "Pre-spawn target " << _target << " -> " << target
+                            << ", demand " << rate * 60 << " per minute. " << getStatistics() << Log::end;
+                _target = target;
+            }
+
+            return target;
+        }
+
+        /// Whether the demand is still decaying, changing the target.
+        bool hasDemand() const { return !_requests.empty(); }
+
+        std::string getStatistics() const
+        {
+            std::ostringstream oss;
+            oss << "Pool hits: " << _hits << ", misses: " << _misses
+                << ", spawns: " << _spawns << ", spawn time avg: " << getSpawnAverageMS()
+                << " ms, max: " << _spawnMaxMS << " ms.";
+            return oss.str();
+        }
+
+    private:
+        double getSpawnAverageMS() const
+        {
+            return (_spawns > 0 ? _spawnTotalMS / _spawns : 0);
+        }
+
+    private:
+        unsigned _min;
+        unsigned _max;
+        std::deque<std::chrono::steady_clock::time_point> _requests;
+        size_t _hits;
+        size_t _misses;
+        size_t _spawns;
+        double _spawnTotalMS;
+        double _spawnMaxMS;
+        unsigned _target;
+    };
+
+    ChildPool childPool;
+
     ThreadLocal<std::string> sourceForLinkOrCopy;
     ThreadLocal<Path> destinationForLinkOrCopy;
 
+    /// What setting up the jail created, to compare the methods.
+    size_t jailLinks = 0;
+    size_t jailDirectories = 0;
+    size_t jailMounts = 0;
+
     int linkOrCopyFunction(const char *fpath,
                            const struct stat* /*sb*/,
                            int typeflag,
@@ -231,6 +850,7 @@ namespace
                            "\") failed. Exiting.");
                 exit(Application::EXIT_SOFTWARE);
             }
+            ++jailLinks;
             break;
         case FTW_DP:
             {
@@ -241,6 +861,7 @@ namespace
                     return 1;
                 }
                 File(newPath).createDirectories();
+                ++jailDirectories;
                 struct utimbuf ut;
                 ut.actime = st.st_atime;
                 ut.modtime = st.st_mtime;
@@ -275,267 +896,266 @@ namespace
         if (nftw(source.c_str(), linkOrCopyFunction, 10, FTW_DEPTH) == -1)
             Log::error("linkOrCopy: nftw() failed for '" + source + "'");
     }
-}
 
-class PipeRunnable: public Runnable
-{
-public:
-    PipeRunnable()
-      : _pStart(nullptr),
-        _pEnd(nullptr)
-    {
-    }
-
-    ssize_t getResponseLine(int nPipeReader, std::string& aLine)
+#ifdef __linux
+    /// Returns the mount points at or below a directory, from the mountinfo
+    /// of our namespace, the mount point being its fifth field.
+    std::vector<std::string> getMountPoints(const std::string& directory)
     {
-        ssize_t nBytes = -1;
-        aLine.clear();
-
-        try
+        std::vector<std::string> mountPoints;
+        std::ifstream mountInfo("/proc/self/mountinfo");
+        std::string line;
+        while (std::getline(mountInfo, line))
         {
-            while (true)
+            std::istringstream fields(line);
+            std::string field;
+            for (int i = 0; i < 5; ++i)
+                fields >> field;
+
+            // Blanks and backslashes are escaped in octal, e.g. \040.
+            std::string mountPoint;
+            for (size_t i = 0; i < field.size(); ++i)
             {
-                if ( _pStart == _pEnd )
-                {
-                    nBytes = Util::readMessage(nPipeReader, _aBuffer, sizeof(_aBuffer));
-                    if ( nBytes < 0 )
-                    {
-                        _pStart = _pEnd = nullptr;
-                        break;
-                    }
-
-                    _pStart = _aBuffer;
-                    _pEnd   = _aBuffer + nBytes;
-                }
-
-                if ( _pStart != _pEnd )
+                if (field[i] == '\\' && i + 3 < field.size())
                 {
-                    char aChar = *_pStart++;
-                    while (_pStart != _pEnd && aChar != '\r' && aChar != '\n')
-                    {
-                        aLine += aChar;
-                        aChar  = *_pStart++;
-                    }
-
-                    if ( aChar == '\r' && *_pStart == '\n')
-                    {
-                        _pStart++;
-                        break;
-                    }
+                    mountPoint += static_cast<char>(std::stoi(field.substr(i + 1, 3), nullptr, 8));
+                    i += 3;
                 }
+                else
+                    mountPoint += field[i];
             }
-        }
-        catch (const std::exception& exc)
-        {
-            Log::error() << "Exception while reading from pipe ["
-                         << nPipeReader << "]: " << exc.what() << Log::end;
-            return -1;
+
+            if (mountPoint == directory || mountPoint.compare(0, directory.size() + 1, directory + "/") == 0)
+                mountPoints.push_back(mountPoint);
         }
 
-        return nBytes;
+        return mountPoints;
     }
 
-    bool createThread(const Process::PID nPID, const std::string& aTID, const std::string& aURL)
+    /// Remounts a mount point read-only, keeping the flags it has, which
+    /// a remount can't drop unless asked to.
+    bool remountReadOnly(const std::string& mountPoint)
     {
-        const std::string aMessage = "thread " + aTID + " " + aURL + "\r\n";
-        if (Util::writeFIFO(getChildPipe(nPID), aMessage) < 0)
+        struct statvfs st;
+        if (statvfs(mountPoint.c_str(), &st) != 0)
+            return false;
+
+        unsigned long flags = MS_BIND | MS_REMOUNT | MS_RDONLY;
+        flags |= (st.f_flag & ST_NOSUID ? MS_NOSUID : 0);
+        flags |= (st.f_flag & ST_NODEV ? MS_NODEV : 0);
+        flags |= (st.f_flag & ST_NOEXEC ? MS_NOEXEC : 0);
+        flags |= (st.f_flag & ST_NOATIME ? MS_NOATIME : 0);
+        flags |= (st.f_flag & ST_NODIRATIME ? MS_NODIRATIME : 0);
+        flags |= (st.f_flag & ST_RELATIME ? MS_RELATIME : 0);
+        return mount(nullptr, mountPoint.c_str(), nullptr, flags, nullptr) == 0;
+    }
+
+    /// Bind mounts a directory, read-only, with whatever is mounted below it.
+    bool bindMount(const std::string& source, const Path& destination)
+    {
+        File(destination).createDirectories();
+
+        const std::string target = destination.toString();
+        if (mount(source.c_str(), target.c_str(), nullptr, MS_BIND | MS_REC, nullptr) == -1)
         {
-            Log::error("Error sending thread message to child [" + std::to_string(nPID) + "].");
+            Log::error("Error: bind mount of [" + source + "] failed.");
             return false;
         }
 
-        std::string aResponse;
-        if (getResponseLine(readerChild, aResponse) < 0)
+        // Bind mounts only become read-only when remounted, and that
+        // ignores MS_REC, so each of the submounts is remounted too.
+        std::string mountRoot = target;
+        while (mountRoot.size() > 1 && mountRoot.back() == '/')
+            mountRoot.pop_back();
+
+        for (const auto& mountPoint : getMountPoints(mountRoot))
         {
-            Log::error("Error reading response to thread message from child [" + std::to_string(nPID) + "].");
-            return false;
+            if (!remountReadOnly(mountPoint))
+            {
+                Log::error("Error: read-only remount of [" + mountPoint + "] failed.");
+                umount2(target.c_str(), MNT_DETACH);
+                return false;
+            }
         }
 
-        StringTokenizer tokens(aResponse, " ", StringTokenizer::TOK_IGNORE_EMPTY | StringTokenizer::TOK_TRIM);
-        return (tokens.count() == 2 && tokens[0] == std::to_string(nPID) && tokens[1] == "ok");
+        ++jailMounts;
+        return true;
     }
 
-    /// Sync ChildProcess instances with its child.
-    /// Returns the number of empty childs.
-    size_t syncChilds()
+    /// Like linkOrCopy, but bind mounts the directories instead, except
+    /// those we write into, given relative to the destination, and
+    /// their parents, which are set up entry by entry.
+    void mountOrLink(const std::string& source, const Path& destination,
+                     const std::vector<std::string>& writable, const std::string& relative = "")
     {
-        std::lock_guard<std::recursive_mutex> lock(forkMutex);
+        DIR* dir = opendir(source.c_str());
+        if (dir == nullptr)
+        {
+            Log::error("Error: cannot read directory [" + source + "].");
+            return;
+        }
 
-        Log::trace("Synching Childs.");
-        size_t empty_count = 0;
-        for (auto it = _childProcesses.begin(); it != _childProcesses.end(); )
+        File(destination).createDirectories();
+        while (const struct dirent* entry = readdir(dir))
         {
-            const auto aMessage = "query url \r\n";
-            std::string aResponse;
-            if (Util::writeFIFO(it->second->getWritePipe(), aMessage) < 0 ||
-                getResponseLine(readerChild, aResponse) < 0)
-            {
-                auto log = Log::error();
-                log << "Error querying child [" << std::to_string(it->second->getPid()) << "].";
-                if (it->second->getUrl().empty())
-                {
-                    log << " Removing empty child.";
-                    it = _childProcesses.erase(it);
-                }
+            const std::string name = entry->d_name;
+            if (name == "." || name == "..")
+                continue;
 
-                log << Log::end;
-                ++it;
+            const std::string sourcePath = source + "/" + name;
+            const std::string relativePath = relative + name;
+
+            // Follow the symlinks, like linkOrCopy.
+            struct stat st;
+            if (stat(sourcePath.c_str(), &st) == -1)
+            {
+                Log::error("Error: stat(\"" + sourcePath + "\") failed.");
                 continue;
             }
 
-            StringTokenizer tokens(aResponse, " ", StringTokenizer::TOK_IGNORE_EMPTY | StringTokenizer::TOK_TRIM);
-            if (tokens.count() == 2 && tokens[0] == std::to_string(it->second->getPid()))
+            if (!S_ISDIR(st.st_mode))
             {
-                Log::debug("Child [" + std::to_string(it->second->getPid()) + "] hosts [" + tokens[1] + "].");
-                if (tokens[1] == "empty")
-                {
-                    it->second->setUrl("");
-                    ++empty_count;
-                }
+                const Path newPath(destination, name);
+                if (link(sourcePath.c_str(), newPath.toString().c_str()) == -1)
+                    Log::error("Error: link(\"" + sourcePath + "\",\"" + newPath.toString() + "\") failed.");
                 else
-                {
-                    it->second->setUrl(tokens[1]);
-                }
+                    ++jailLinks;
+                continue;
             }
-            else
+
+            bool isWritable = false;
+            bool hasWritable = false;
+            for (const auto& path : writable)
             {
-                Log::error("Unexpected response from child [" + std::to_string(it->second->getPid()) +
-                           "] to query: [" + tokens[1] + "].");
+                isWritable |= (path == relativePath);
+                hasWritable |= (path.compare(0, relativePath.size() + 1, relativePath + "/") == 0);
             }
 
-            ++it;
+            const Path newPath = Path::forDirectory(Path(destination, name).toString());
+            if (isWritable)
+            {
+                linkOrCopy(sourcePath, newPath);
+            }
+            else if (hasWritable)
+            {
+                mountOrLink(sourcePath, newPath, writable, relativePath + "/");
+            }
+            else if (!bindMount(sourcePath, newPath))
+            {
+                linkOrCopy(sourcePath, newPath);
+            }
         }
 
-        return empty_count;
+        closedir(dir);
     }
+#endif
+}
 
-    void handleInput(const std::string& aMessage)
+/// Hands a parked request to a kit, if one can take it, without waiting
+/// for the kit: the main loop gets the response, so any number of requests
+/// can be in flight, and one slow kit doesn't hold up the others.
+static bool dispatchRequest(ParkedRequest& request)
+{
+    std::shared_ptr<ChildProcess> child;
     {
         std::lock_guard<std::recursive_mutex> lock(forkMutex);
 
-        StringTokenizer tokens(aMessage, " ", StringTokenizer::TOK_IGNORE_EMPTY | StringTokenizer::TOK_TRIM);
-        if (tokens[0] == "request" && tokens.count() == 3)
+        child = findChild(request._url);
+        if (!child)
         {
-            const std::string aTID = tokens[1];
-            const std::string aURL = tokens[2];
-
-            Log::debug("Finding kit for URL [" + aURL + "] on thread [" + aTID + "].");
-
-            const auto child = findChild(aURL);
-            if (child)
-            {
-                if (child->getUrl() == aURL)
-                    Log::debug("Found URL [" + aURL + "] hosted on child [" + std::to_string(child->getPid()) + "].");
-                else
-                    Log::debug("URL [" + aURL + "] is not hosted. Using empty child [" + std::to_string(child->getPid()) + "].");
-
-                if (!createThread(child->getPid(), aTID, aURL))
-                {
-                    Log::error("Error creating thread [" + aTID + "] for URL [" + aURL + "].");
-                }
-
-                child->setUrl(aURL);
-            }
-            else
+            // Once per request, the retries are ours.
+            if (!request._missed)
             {
-                Log::info("No children available. Creating more.");
+                Log::info("No children available for request [" + request._rid + "]. Creating more.");
+                childPool.recordRequest(false);
                 ++forkCounter;
+                request._missed = true;
             }
+
+            return false;
         }
-    }
 
-    void run() override
-    {
-        std::string aMessage;
-        char  aBuffer[READ_BUFFER_SIZE];
-        char* pStart;
-        char* pEnd;
+        if (child->getUrl() == request._url)
+            Log::debug("Found URL [" + request._url + "] hosted on child [" + std::to_string(child->getPid()) + "].");
+        else
+            Log::debug("URL [" + request._url + "] is not hosted. Using empty child [" + std::to_string(child->getPid()) + "].");
 
-        struct pollfd aPoll;
-        ssize_t nBytes = -1;
+        if (child->getUrl().empty())
+        {
+            if (!request._missed)
+                childPool.recordRequest(true);
+            poolChanged = true;
+        }
 
-        aPoll.fd = readerBroker;
-        aPoll.events = POLLIN;
-        aPoll.revents = 0;
+        // A document runs with the highest class of its clients.
+        if (child->getUrl().empty() || request._workload < child->getWorkload())
+            applyWorkload(child, request._workload);
 
-        pStart = aBuffer;
-        pEnd   = aBuffer;
+        // Taken now, so that the next request for another URL
+        // doesn't get it as well.
+        setChildUrl(child, request._url);
+        _pendingRequests[request._rid] = PendingRequest{ child->getPid(), request._tid, request._url, request._received };
+    }
 
-        static const std::string thread_name = "brk_pipe_reader";
-#ifdef __linux
-        if (prctl(PR_SET_NAME, reinterpret_cast<unsigned long>(thread_name.c_str()), 0, 0, 0) != 0)
-            Log::error("Cannot set thread name to " + thread_name + ".");
-#endif
-        Log::debug("Thread [" + thread_name + "] started.");
+    const std::string aRequest = "thread " + request._tid + " " + request._url + " " + request._rid;
+    if (!child->send(aRequest))
+    {
+        Log::error("Error sending thread message to child [" + std::to_string(child->getPid()) + "].");
 
-        while (!TerminationFlag)
-        {
-            if ( pStart == pEnd )
-            {
-                if (poll(&aPoll, 1, POLL_TIMEOUT_MS) < 0)
-                {
-                    Log::error("Failed to poll pipe [" + FIFO_FILE + "].");
-                    continue;
-                }
-                else
-                if (aPoll.revents & (POLLIN | POLLPRI))
-                {
-                    nBytes = Util::readFIFO(readerBroker, aBuffer, sizeof(aBuffer));
-                    if (nBytes < 0)
-                    {
-                        pStart = pEnd = nullptr;
-                        Log::error("Error reading message from pipe [" + FIFO_FILE + "].");
-                        continue;
-                    }
-                    pStart = aBuffer;
-                    pEnd   = aBuffer + nBytes;
-                }
-                else
-                if (aPoll.revents & (POLLERR | POLLHUP))
-                {
-                    Log::error("Broken pipe [" + FIFO_FILE + "] with wsd.");
-                    break;
-                }
-            }
+        std::lock_guard<std::recursive_mutex> lock(forkMutex);
+        _pendingRequests.erase(request._rid);
+    }
 
-            if ( pStart != pEnd )
-            {
-                char aChar = *pStart++;
-                while (pStart != pEnd && aChar != '\r' && aChar != '\n')
-                {
-                    aMessage += aChar;
-                    aChar = *pStart++;
-                }
+    return true;
+}
+
+/// Serves the parked requests that a kit can take now, in the order they
+/// came, so a request never overtakes an earlier one for an empty kit.
+static void serveParkedRequests()
+{
+    std::lock_guard<std::recursive_mutex> lock(forkMutex);
+    for (auto it = _parkedRequests.begin(); it != _parkedRequests.end(); )
+    {
+        if (dispatchRequest(*it))
+            it = _parkedRequests.erase(it);
+        else
+            ++it;
+    }
+}
 
-                if ( aChar == '\r' && *pStart == '\n')
-                {
-                    pStart++;
+/// Parks a request from the master until a kit takes it.
+static void handleInput(const std::string& aMessage)
+{
+    const auto received = std::chrono::steady_clock::now();
 
-                    Log::trace("BrokerFromMaster: " + aMessage);
-                    if (aMessage == "eof")
-                        break;
+    StringTokenizer tokens(aMessage, " ", StringTokenizer::TOK_IGNORE_EMPTY | StringTokenizer::TOK_TRIM);
+    if (tokens[0] == "request" && tokens.count() >= 4)
+    {
+        const size_t workload = findWorkload(tokens.count() > 4 ? tokens[4] : "interactive");
+        Log::debug("Finding kit for URL [" + tokens[2] + "] on thread [" + tokens[1] + "], request [" + tokens[3] + "].");
 
-                    const auto duration = (std::chrono::steady_clock::now() - lastMaintenanceTime);
-                    if (duration >= std::chrono::seconds(10))
-                    {
-                        syncChilds();
-                        lastMaintenanceTime = std::chrono::steady_clock::now();
-                    }
+        std::lock_guard<std::recursive_mutex> lock(forkMutex);
+        _parkedRequests.push_back(ParkedRequest{ tokens[1], tokens[2], tokens[3], workload, received, false });
+        serveParkedRequests();
+    }
+}
 
-                    handleInput(aMessage);
-                    aMessage.clear();
-                }
-            }
-        }
+/// Reads what wsd has for us. False once wsd is gone, or told us it is.
+static bool handleMasterInput(Util::MessageReader& reader)
+{
+    std::vector<std::string> messages;
+    const bool alive = reader.read(messages);
+    for (const auto& aMessage : messages)
+    {
+        Log::trace("BrokerFromMaster: " + aMessage);
+        if (aMessage == "eof")
+            return false;
 
-        Log::debug("Thread [" + thread_name + "] finished.");
+        handleInput(aMessage);
     }
 
-private:
-    char* _pStart;
-    char* _pEnd;
-    char  _aBuffer[READ_BUFFER_SIZE];
-};
+    return alive;
+}
 
 /// Initializes LibreOfficeKit for cross-fork re-use.
 static bool globalPreinit(const std::string &loSubPath)
@@ -568,30 +1188,133 @@ static bool globalPreinit(const std::string &loSubPath)
     return preInit(("/" + loSubPath + "/program").c_str(), "file:///user") == 0;
 }
 
-static int createLibreOfficeKit(const bool sharePages,
-                                const std::string& loSubPath,
-                                const std::string& jailId)
+/// Reads the CPUs of each NUMA node, or of the whole machine as one
+/// node without NUMA, leaving out the reserved ones and empty nodes.
+static std::vector<cpu_set_t> readNodes(const cpu_set_t& reserved)
 {
-    Poco::UInt64 childPID;
-    int nFIFOWriter = -1;
+    std::vector<std::string> lists;
+    DIR* dir = opendir("/sys/devices/system/node");
+    if (dir)
+    {
+        struct dirent* entry;
+        while ((entry = readdir(dir)) != nullptr)
+        {
+            if (strncmp(entry->d_name, "node", 4) != 0 || !std::isdigit(entry->d_name[4]))
+                continue;
+
+            std::ifstream file(std::string("/sys/devices/system/node/") + entry->d_name + "/cpulist");
+            std::string list;
+            if (std::getline(file, list))
+                lists.push_back(list);
+        }
+
+        closedir(dir);
+    }
+
+    if (lists.empty())
+    {
+        // We inherit the affinity of wsd, so ask for all that are online.
+        std::ifstream file("/sys/devices/system/cpu/online");
+        std::string list;
+        if (std::getline(file, list))
+            lists.push_back(list);
+    }
+
+    std::vector<cpu_set_t> nodes;
+    for (const auto& list : lists)
+    {
+        cpu_set_t cpus;
+        if (!Util::parseCpuList(list, cpus))
+            continue;
 
-    const std::string pipe = BROKER_PREFIX + std::to_string(childCounter++) + BROKER_SUFIX;
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+        {
+            if (CPU_ISSET(cpu, &reserved))
+                CPU_CLR(cpu, &cpus);
+        }
+
+        if (CPU_COUNT(&cpus) > 0)
+            nodes.push_back(cpus);
+    }
+
+    return nodes;
+}
+
+/// Sets up a cgroup for each workload class under a cgroup (v2) that
+/// is delegated to us, and keeps them open to move the kits from the jail.
+static void openWorkloadCgroups(const std::string& cgroup)
+{
+    std::ofstream controllers(cgroup + "/cgroup.subtree_control");
+    controllers << "+cpu" << std::endl;
+    if (!controllers)
+        Log::warn("Cannot enable the cpu controller in cgroup [" + cgroup + "], the classes get no CPU weight.");
 
-    if (mkfifo(pipe.c_str(), 0666) < 0)
+    for (size_t i = 0; i < NumWorkloadClasses; ++i)
     {
-        Log::error("Error: mkfifo failed.");
-        return -1;
+        const std::string path = cgroup + "/" + workloadClasses[i]._name;
+        if (mkdir(path.c_str(), 0755) != 0 && errno != EEXIST)
+        {
+            Log::error("Error: cannot create cgroup [" + path + "].");
+            continue;
+        }
+
+        std::ofstream weight(path + "/cpu.weight");
+        weight << workloadClasses[i]._cpuWeight << std::endl;
+
+        if ( (workloadCgroups[i] = open((path + "/cgroup.procs").c_str(), O_WRONLY | O_CLOEXEC) ) < 0)
+            Log::error("Error: cannot open cgroup [" + path + "].");
     }
+}
+
+static void handleChildMessage(const std::string& message);
+
+static int createLibreOfficeKit(const bool sharePages,
+                                const std::string& loSubPath,
+                                const std::string& jailId)
+{
+    Poco::UInt64 childPID;
+    ++childCounter;
+    const int node = chooseNode();
+    const auto spawnTime = std::chrono::steady_clock::now();
 
     if (sharePages)
     {
         Log::debug("Forking LibreOfficeKit.");
 
+        // We don't hold the lock while spawning, so
+        // the child can't look at the children itself.
+        std::vector<int> kitSockets;
+        {
+            std::lock_guard<std::recursive_mutex> lock(forkMutex);
+            for (const auto& it : _childProcesses)
+                kitSockets.push_back(it.second->getSocket());
+            for (const auto& it : _connectingKits)
+                kitSockets.push_back(it.first);
+        }
+
         Poco::UInt64 pid;
         if (!(pid = fork()))
         {
             // child
-            lokit_main(loSubPath, jailId, pipe);
+            // The kits see the broker die by EOF on their socket,
+            // so they don't keep copies of our ends of the others.
+            for (const int kitSocket : kitSockets)
+                close(kitSocket);
+            close(kitListenSocket);
+            close(wsdSocket);
+            close(epollFd);
+            close(signalFd);
+            close(timerFd);
+            for (const int fd : workloadCgroups)
+            {
+                if (fd >= 0)
+                    close(fd);
+            }
+
+            if (node >= 0 && sched_setaffinity(0, sizeof(cpu_set_t), &kitNodes[node]) != 0)
+                Log::error("Error: failed to pin kit to node " + std::to_string(node) + ".");
+
+            lokit_main(loSubPath, jailId, procDir);
             _exit(Application::EXIT_OK);
         }
         else
@@ -606,8 +1329,11 @@ static int createLibreOfficeKit(const bool sharePages,
         Process::Args args;
         args.push_back("--losubpath=" + loSubPath);
         args.push_back("--jailid=" + jailId);
-        args.push_back("--pipe=" + pipe);
         args.push_back("--clientport=" + std::to_string(ClientPortNumber));
+        args.push_back("--sessionidletimeout=" + std::to_string(SessionIdleTimeoutSecs));
+        args.push_back("--docidletimeout=" + std::to_string(DocumentIdleTimeoutSecs));
+        if (AutoSave)
+            args.push_back("--autosave");
 
         Log::info("Launching LibreOfficeKit #" + std::to_string(childCounter) +
                   ": " + JAILED_LOOLKIT_PATH + " " +
@@ -623,19 +1349,111 @@ static int createLibreOfficeKit(const bool sharePages,
             Log::error("Error: loolkit [" + std::to_string(childPID) + "] was stillborn.");
             return -1;
         }
+
+        // Early enough, LibreOfficeKit is not up yet.
+        if (node >= 0 && sched_setaffinity(childPID, sizeof(cpu_set_t), &kitNodes[node]) != 0)
+            Log::error("Error: failed to pin kit [" + std::to_string(childPID) + "] to node " + std::to_string(node) + ".");
+    }
+
+    // The kit connects first thing, and says hello with its pid,
+    // which the main loop handles, see handleKitHello().
+    std::lock_guard<std::recursive_mutex> lock(forkMutex);
+    _spawningChildren[childPID] = SpawningChild{ node, spawnTime };
+    return childPID;
+}
+
+/// Accepts the kits connecting, whose hello the main loop then waits for.
+static void acceptKits()
+{
+    int socket;
+    while ((socket = accept4(kitListenSocket, nullptr, nullptr, SOCK_CLOEXEC)) >= 0)
+    {
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.fd = socket;
+        if (epoll_ctl(epollFd, EPOLL_CTL_ADD, socket, &event) < 0)
+        {
+            Log::error("Error: failed to add the socket of a kit to the main loop.");
+            close(socket);
+            continue;
+        }
+
+        std::lock_guard<std::recursive_mutex> lock(forkMutex);
+        _connectingKits.emplace(socket, ConnectingKit{ Util::MessageReader(socket), std::chrono::steady_clock::now() });
     }
 
-    if ( (nFIFOWriter = open(pipe.c_str(), O_WRONLY)) < 0 )
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        Log::error("Error: failed to accept a kit.");
+}
+
+/// Reads the hello of a kit that connected, with its pid, and adds it
+/// to the children if we spawned it. Returns false if not connecting.
+static bool handleKitHello(const int socket)
+{
+    std::lock_guard<std::recursive_mutex> lock(forkMutex);
+    const auto it = _connectingKits.find(socket);
+    if (it == _connectingKits.end())
+        return false;
+
+    // Only the ready report may come with it, when warming up is quick.
+    std::vector<std::string> messages;
+    const bool alive = it->second._reader.read(messages);
+    if (messages.empty() && alive)
+        return true;
+
+    StringTokenizer tokens(messages.empty() ? "" : messages.front(), " ", StringTokenizer::TOK_IGNORE_EMPTY | StringTokenizer::TOK_TRIM);
+    const Process::PID pid = (tokens.count() == 2 && tokens[1] == "hello" ? std::atoi(tokens[0].c_str()) : -1);
+    const auto spawning = _spawningChildren.find(pid);
+    const Util::MessageReader reader = it->second._reader;
+    _connectingKits.erase(it);
+    epoll_ctl(epollFd, EPOLL_CTL_DEL, socket, nullptr);
+    if (spawning == _spawningChildren.end())
     {
-        Log::error("Error: failed to open write pipe [" + pipe + "] with kit. Abandoning child.");
-        ChildProcess(childPID, -1, -1);
-        return -1;
+        // Late from an earlier spawn we gave up on.
+        Log::warn("Unexpected connection from a kit. Closing.");
+        close(socket);
+        return true;
     }
 
-    Log::info() << "Adding Kit #" << childCounter << ", PID: " << childPID << Log::end;
+    const SpawningChild child = spawning->second;
+    _spawningChildren.erase(spawning);
 
-    _childProcesses[childPID] = std::make_shared<ChildProcess>(childPID, -1, nFIFOWriter);
-    return childPID;
+    // Interactive, until a request for another class takes it.
+    const std::string kitPid = std::to_string(pid);
+    if (workloadCgroups[0] >= 0 && write(workloadCgroups[0], kitPid.data(), kitPid.size()) != static_cast<ssize_t>(kitPid.size()))
+        Log::warn("Failed to move kit [" + kitPid + "] to its cgroup.");
+
+    Log::info() << "Adding Kit PID: " << pid
+                << (child._node >= 0 ? ", node: " + std::to_string(child._node) : std::string()) << Log::end;
+
+    addChild(std::make_shared<ChildProcess>(pid, socket, reader, child._node, child._spawnTime));
+    for (auto message = messages.begin() + 1; message != messages.end(); ++message)
+        handleChildMessage(*message);
+
+    if (!alive)
+    {
+        Log::info("Child [" + kitPid + "] closed its socket.");
+        removeChild(pid);
+    }
+
+    return true;
+}
+
+/// Arms the timer of the main loop for a deadline, or disarms it for max().
+static void setTimer(const std::chrono::steady_clock::time_point deadline)
+{
+    struct itimerspec timer = {};
+    if (deadline != std::chrono::steady_clock::time_point::max())
+    {
+        // Zero would disarm it, when due already.
+        const auto ns = std::max<long long>(1, std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                                   deadline - std::chrono::steady_clock::now()).count());
+        timer.it_value.tv_sec = ns / 1000000000;
+        timer.it_value.tv_nsec = ns % 1000000000;
+    }
+
+    if (timerfd_settime(timerFd, 0, &timer, nullptr) < 0)
+        Log::error("Error: failed to set the timer of the main loop.");
 }
 
 static bool waitForTerminationChild(const Process::PID aPID, signed count = CHILD_TIMEOUT_SECS)
@@ -656,6 +1474,141 @@ static bool waitForTerminationChild(const Process::PID aPID, signed count = CHIL
     return false;
 }
 
+/// Handles a message from the kits: either the report of what one
+/// hosts or of its memory, or the response to a request: "<pid> ok|bad <id> <ms>".
+static void handleChildMessage(const std::string& message)
+{
+    Log::trace("BrokerFromKit: " + message);
+
+    StringTokenizer tokens(message, " ", StringTokenizer::TOK_IGNORE_EMPTY | StringTokenizer::TOK_TRIM);
+    if (tokens.count() < 2)
+    {
+        Log::error("Unexpected message from kit: [" + message + "].");
+        return;
+    }
+
+    std::lock_guard<std::recursive_mutex> lock(forkMutex);
+    const auto it = _childProcesses.find(std::atoi(tokens[0].c_str()));
+    if (it == _childProcesses.end())
+    {
+        Log::warn("Message from unknown kit: [" + message + "].");
+        return;
+    }
+
+    if (tokens[1] == "ready" && tokens.count() == 2)
+    {
+        // Up to ready, so that the pool sizing knows how long a new child takes.
+        const auto child = it->second;
+        if (!child->isReady())
+        {
+            const double ms = std::chrono::duration<double, std::milli>(
+                                  std::chrono::steady_clock::now() - child->getSpawnTime()).count();
+            Log::info() << "Child [" << child->getPid() << "] is ready, " << ms << " ms after spawning." << Log::end;
+            childPool.recordSpawn(ms);
+
+            child->setReady();
+            _emptyChildren[child->getPid()] = child;
+            poolChanged = true;
+        }
+    }
+    else if (tokens[1] == "url" && tokens.count() == 3)
+    {
+        Log::debug("Child [" + tokens[0] + "] hosts [" + tokens[2] + "].");
+        const std::string url = (tokens[2] == "empty" ? "" : tokens[2]);
+        if (url != it->second->getUrl())
+        {
+            // Grown too large to take another document.
+            if (url.empty() && it->second->isOverMemoryLimit() && recycleChild(it->second))
+                return;
+
+            // Niced down for good, it can't take an interactive document again.
+            if (url.empty() && !applyWorkload(it->second, 0) && recycleChild(it->second))
+                return;
+
+            setChildUrl(it->second, url);
+            poolChanged = true;
+        }
+    }
+    else if (tokens[1] == "memory" && tokens.count() == 4)
+    {
+        const auto child = it->second;
+        const bool wasOver = child->isOverMemoryLimit();
+        child->setMemory(std::strtoul(tokens[2].c_str(), nullptr, 10), std::strtoul(tokens[3].c_str(), nullptr, 10));
+        if (child->isOverMemoryLimit())
+        {
+            // The document stays where it is loaded, with its sessions,
+            // but the child won't be given another one.
+            if (!wasOver)
+            {
+                Log::warn() << "Child [" << child->getPid() << "] uses " << child->getPssKB()
+                            << " kB PSS, over the limit of " << childMemLimitKB
+                            << " kB. Recycling it once its document is closed." << Log::end;
+            }
+
+            if (child->getUrl().empty())
+                recycleChild(child);
+        }
+    }
+    else if ((tokens[1] == "ok" || tokens[1] == "bad") && tokens.count() >= 3)
+    {
+        completeRequest(it->first, tokens[2], tokens[1] == "ok", tokens.count() > 3 ? tokens[3] : "?");
+    }
+    else
+    {
+        Log::error("Unexpected message from kit: [" + message + "].");
+    }
+}
+
+/// Reaps the children that changed state, after a SIGCHLD.
+static void reapChildren()
+{
+    int status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, WUNTRACED | WCONTINUED | WNOHANG)) > 0)
+    {
+        if (WIFEXITED(status))
+        {
+            Log::info() << "Child process [" << pid << "] exited with code: "
+                        << WEXITSTATUS(status) << "." << Log::end;
+
+            removeChild(pid);
+        }
+        else
+        if (WIFSIGNALED(status))
+        {
+            std::string fate = "died";
+#ifdef WCOREDUMP
+            if (WCOREDUMP(status))
+                fate = "core-dumped";
+#endif
+            Log::error() << "Child process [" << pid << "] " << fate
+                         << " with " << Util::signalName(WTERMSIG(status))
+                         << " signal. " << Log::end;
+
+            removeChild(pid);
+        }
+        else if (WIFSTOPPED(status))
+        {
+            Log::info() << "Child process [" << pid << "] stopped with "
+                        << Util::signalName(WSTOPSIG(status))
+                        << " signal. " << Log::end;
+        }
+        else if (WIFCONTINUED(status))
+        {
+            Log::info() << "Child process [" << pid << "] resumed with SIGCONT."
+                        << Log::end;
+        }
+        else
+        {
+            Log::warn() << "Unknown status returned by waitpid: "
+                        << std::hex << status << "." << Log::end;
+        }
+    }
+
+    if (pid < 0 && errno != ECHILD)
+        Log::error("Error: waitpid failed.");
+}
+
 // Broker process
 int main(int argc, char** argv)
 {
@@ -678,6 +1631,10 @@ int main(int argc, char** argv)
     std::string loSubPath;
     std::string sysTemplate;
     std::string loTemplate;
+    cpu_set_t wsdCpus;
+    CPU_ZERO(&wsdCpus);
+    bool pinKits = false;
+    std::string cgroup;
 
     for (int i = 0; i < argc; ++i)
     {
@@ -719,12 +1676,56 @@ int main(int argc, char** argv)
             if (*eq)
                 numPreSpawnedChildren = std::stoi(std::string(++eq));
         }
+        else if (strstr(cmd, "--maxprespawns=") == cmd)
+        {
+            eq = strchrnul(cmd, '=');
+            if (*eq)
+                maxPreSpawnedChildren = std::stoi(std::string(++eq));
+        }
+        else if (strstr(cmd, "--childmemlimit=") == cmd)
+        {
+            eq = strchrnul(cmd, '=');
+            if (*eq)
+                childMemLimitKB = std::stoul(std::string(++eq)) * 1024;
+        }
         else if (strstr(cmd, "--clientport=") == cmd)
         {
             eq = strchrnul(cmd, '=');
             if (*eq)
                 ClientPortNumber = std::stoll(std::string(++eq));
         }
+        else if (strstr(cmd, "--sessionidletimeout=") == cmd)
+        {
+            eq = strchrnul(cmd, '=');
+            if (*eq)
+                SessionIdleTimeoutSecs = std::stoi(std::string(++eq));
+        }
+        else if (strstr(cmd, "--docidletimeout=") == cmd)
+        {
+            eq = strchrnul(cmd, '=');
+            if (*eq)
+                DocumentIdleTimeoutSecs = std::stoi(std::string(++eq));
+        }
+        else if (strstr(cmd, "--autosave") == cmd)
+        {
+            AutoSave = true;
+        }
+        else if (strstr(cmd, "--wsdcpus=") == cmd)
+        {
+            eq = strchrnul(cmd, '=');
+            if (*eq && !Util::parseCpuList(std::string(++eq), wsdCpus))
+                Log::warn("Ignoring the malformed --wsdcpus.");
+        }
+        else if (strstr(cmd, "--pinkits") == cmd)
+        {
+            pinKits = true;
+        }
+        else if (strstr(cmd, "--cgroup=") == cmd)
+        {
+            eq = strchrnul(cmd, '=');
+            if (*eq)
+                cgroup = std::string(++eq);
+        }
     }
 
     if (loSubPath.empty())
@@ -757,9 +1758,46 @@ int main(int argc, char** argv)
         exit(Application::EXIT_SOFTWARE);
     }
 
-    if ( (readerBroker = open(FIFO_FILE.c_str(), O_RDONLY) ) < 0 )
+    childPool.setBounds(numPreSpawnedChildren, std::max(maxPreSpawnedChildren, numPreSpawnedChildren));
+
+    // For sizing the pool to the memory, from within the jail.
+    if ( (procDir = open("/proc", O_RDONLY | O_DIRECTORY | O_CLOEXEC) ) < 0 )
+    {
+        Log::warn("Failed to open /proc, the pre-spawned children will not be limited by memory.");
+    }
+
+    // Keep off the cores of wsd, and spread the kits over the NUMA nodes,
+    // so that each one renders with the memory it first touched, local.
+    if (pinKits || CPU_COUNT(&wsdCpus) > 0)
+    {
+        const auto nodes = readNodes(wsdCpus);
+        cpu_set_t allCpus;
+        CPU_ZERO(&allCpus);
+        for (const auto& node : nodes)
+            CPU_OR(&allCpus, &allCpus, &node);
+
+        if (nodes.empty() || sched_setaffinity(0, sizeof(allCpus), &allCpus) != 0)
+        {
+            Log::error("Error: failed to set the CPUs of the kits, leaving them unpinned.");
+        }
+        else
+        {
+            Log::info() << "Kits run on " << CPU_COUNT(&allCpus) << " CPUs in "
+                        << nodes.size() << " NUMA nodes." << Log::end;
+            if (pinKits)
+            {
+                kitNodes = nodes;
+                nodeDocuments.assign(nodes.size(), 0);
+            }
+        }
+    }
+
+    if (!cgroup.empty())
+        openWorkloadCgroups(cgroup);
+
+    if ( (wsdSocket = Util::connectSocket(WSD_SOCKET_PREFIX + jailId) ) < 0 )
     {
-        Log::error("Error: failed to open pipe [" + FIFO_FILE + "] read only. Exiting.");
+        Log::error("Error: failed to connect to wsd. Exiting.");
         exit(Application::EXIT_SOFTWARE);
     }
 
@@ -799,8 +1837,41 @@ int main(int argc, char** argv)
     File(jailLOInstallation).createDirectory();
 
     // Copy (link) LO installation and other necessary files into it from the template.
-    linkOrCopy(sysTemplate, jailPath);
-    linkOrCopy(loTemplate, jailLOInstallation);
+    // Rather than hardlinking every file, bind mount the templates read-only,
+    // when we can have a mount namespace of our own, shared with the kits only.
+    // That takes cap_sys_admin, which make and the packages give loolbroker,
+    // and which is dropped after the chroot. LOOL_NO_BIND_MOUNTS forces the hardlinking.
+    const auto jailStartTime = std::chrono::steady_clock::now();
+    bool bindMounts = false;
+#ifdef __linux
+    if (!std::getenv("LOOL_NO_BIND_MOUNTS"))
+    {
+        bindMounts = (unshare(CLONE_NEWNS) == 0 &&
+                      mount(nullptr, "/", nullptr, MS_REC | MS_PRIVATE, nullptr) == 0);
+        if (!bindMounts)
+            Log::warn("Cannot have a mount namespace, hardlinking the jail instead.", true);
+    }
+
+    if (bindMounts)
+    {
+        // What we write into below, and wsd into /user.
+        const std::vector<std::string> writable = { "dev", "etc", "tmp", "usr/bin" };
+        mountOrLink(sysTemplate, jailPath, writable);
+        if (!bindMount(loTemplate, jailLOInstallation))
+            linkOrCopy(loTemplate, jailLOInstallation);
+    }
+    else
+#endif
+    {
+        linkOrCopy(sysTemplate, jailPath);
+        linkOrCopy(loTemplate, jailLOInstallation);
+    }
+
+    Log::info() << "Jail set up with " << (bindMounts ? "bind mounts" : "hardlinks") << " in "
+                << std::chrono::duration_cast<std::chrono::milliseconds>(
+                       std::chrono::steady_clock::now() - jailStartTime).count()
+                << " ms: " << jailMounts << " mounts, " << jailLinks << " links, "
+                << jailDirectories << " directories." << Log::end;
 
     // It is necessary to deploy loolkit process to chroot jail.
     File(loolkitPath).copyTo(Path(jailPath, JAILED_LOOLKIT_PATH).toString());
@@ -851,16 +1922,41 @@ int main(int argc, char** argv)
     dropCapability(CAP_SYS_CHROOT);
     dropCapability(CAP_MKNOD);
     dropCapability(CAP_FOWNER);
+    dropCapability(CAP_SYS_ADMIN);
 #else
     dropCapability();
 #endif
 
-    if (mkfifo(FIFO_BROKER.c_str(), 0666) == -1)
+    if ( (kitListenSocket = Util::listenSocket(BROKER_SOCKET_PREFIX + jailId) ) < 0 ||
+         fcntl(kitListenSocket, F_SETFL, O_NONBLOCK) < 0 )
+    {
+        Log::error("Error: failed to listen for the kits.");
+        exit(Application::EXIT_SOFTWARE);
+    }
+
+    // The exits of the children and the termination signals come through
+    // a signalfd, so they are blocked before any thread or child inherits
+    // the mask. The kits unblock them again.
+    if ((signalFd = Util::openSignalFd()) < 0 ||
+        (timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0 ||
+        (epollFd = epoll_create1(EPOLL_CLOEXEC)) < 0)
     {
-        Log::error("Error: Failed to create pipe FIFO [" + FIFO_BROKER + "].");
+        Log::error("Error: failed to set up the main loop.");
         exit(Application::EXIT_SOFTWARE);
     }
 
+    for (const int fd : { signalFd, timerFd, wsdSocket, kitListenSocket })
+    {
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.fd = fd;
+        if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) < 0)
+        {
+            Log::error("Error: failed to add descriptor to the main loop.");
+            exit(Application::EXIT_SOFTWARE);
+        }
+    }
+
     // Initialize LoKit and hope we can fork and save memory by sharing pages.
     const bool sharePages = globalPreinit(loSubPath);
 
@@ -871,102 +1967,162 @@ int main(int argc, char** argv)
         exit(Application::EXIT_SOFTWARE);
     }
 
-    if (numPreSpawnedChildren > 1)
-        forkCounter = numPreSpawnedChildren - 1;
-
-    if ( (readerChild = open(FIFO_BROKER.c_str(), O_RDONLY) ) < 0 )
-    {
-        Log::error("Error: pipe opened for reading.");
-        exit(Application::EXIT_SOFTWARE);
-    }
-
-    PipeRunnable pipeHandler;
-    Poco::Thread aPipe;
-
-    aPipe.start(pipeHandler);
+    // wsd and the kits are served by the main loop alone,
+    // so a request never waits for another thread.
+    Util::MessageReader wsdReader(wsdSocket);
 
     Log::info("loolbroker is ready.");
 
-    unsigned timeoutCounter = 0;
+    auto lastPoolTime = std::chrono::steady_clock::now();
+    bool poolSettled = false;
+    std::string lastMemoryStatistics;
     while (!TerminationFlag)
     {
-        if (forkCounter > 0)
+        // Resize the pool when it was used, or now and then, as the demand decays.
+        if (forkCounter > 0 || poolChanged.exchange(false) ||
+            std::chrono::steady_clock::now() - lastPoolTime >= std::chrono::seconds(MAINTENANCE_INTERVAL))
         {
-            std::lock_guard<std::recursive_mutex> lock(forkMutex);
+            lastPoolTime = std::chrono::steady_clock::now();
+
+            // Decided under the lock, but spawned without it,
+            // so that the forked kit doesn't inherit it held.
+            signed spawn = 0;
+            {
+                std::lock_guard<std::recursive_mutex> lock(forkMutex);
 
-            const signed empty = pipeHandler.syncChilds();
-            const signed total = _childProcesses.size();
+                std::vector<std::shared_ptr<ChildProcess>> emptyChildren;
+                size_t emptyKB = 0;
+                for (const auto& it : _emptyChildren)
+                {
+                    emptyChildren.push_back(it.second);
+                    emptyKB += getResidentKB(it.first);
+                }
+
+                // Those still starting or warming up will be empty soon.
+                signed warming = _spawningChildren.size();
+                for (const auto& it : _childProcesses)
+                {
+                    if (!it.second->isReady())
+                        ++warming;
+                }
+
+                const signed total = _childProcesses.size();
+                const signed empty = emptyChildren.size() + warming;
+                const signed target = childPool.getTarget(empty, empty > 0 ? emptyKB / empty : 0);
+                poolSettled = (empty == target && warming == 0 && !childPool.hasDemand());
+
+                // Every parked request gets a child of its own, on top of the pool.
+                spawn = std::max(target - empty, static_cast<signed>(forkCounter.exchange(0)));
+                if (spawn > 0)
+                {
+                    Log::debug() << "Creating " << spawn << " childs. Current Total: "
+                                 << total << ", Empty: " << empty << ", Target: " << target << Log::end;
+                }
+                else if (empty > target && !emptyChildren.empty())
+                {
+                    // The demand dropped, give the memory back, one at a time.
+                    const auto child = emptyChildren.back();
+                    Log::info() << "Retiring empty child [" << child->getPid() << "]. Current Total: "
+                                << total << ", Empty: " << empty << ", Target: " << target << Log::end;
+                    removeChild(child->getPid());
+                }
+            }
 
-            // Figure out how many children we need. Always create at least as many
-            // as configured pre-spawn or one more than requested (whichever is larger).
-            signed spawn = std::max(static_cast<int>(forkCounter) + 1, numPreSpawnedChildren);
-            Log::debug() << "Creating " << spawn << " childs. Current Total: "
-                         << total << ", Empty: " << empty << Log::end;
-            do
+            for (; spawn > 0; --spawn)
             {
                 if (createLibreOfficeKit(sharePages, loSubPath, jailId) < 0)
                     Log::error("Error: fork failed.");
             }
-            while (--spawn > 0);
 
-            // We've done our best. If need more, retrying will bump the counter.
-            forkCounter = 0;
+            const std::string memoryStatistics = getMemoryStatistics();
+            if (memoryStatistics != lastMemoryStatistics)
+            {
+                Log::debug("Memory: " + memoryStatistics);
+                lastMemoryStatistics = memoryStatistics;
+            }
         }
 
-        int status;
-        const pid_t pid = waitpid(-1, &status, WUNTRACED | WNOHANG);
-        if (pid > 0)
+        // Sleep until wsd or a kit has something to say, one exits,
+        // we are told to terminate, or the timer is due:
+        // for a request to expire, or the pool to follow the demand.
+        auto deadline = std::min(getRequestsDeadline(), getSpawnsDeadline());
+        if (!poolSettled)
+            deadline = std::min(deadline, lastPoolTime + std::chrono::seconds(MAINTENANCE_INTERVAL));
+        setTimer(deadline);
+
+        struct epoll_event events[16];
+        const int count = epoll_wait(epollFd, events, 16, -1);
+        if (count < 0 && errno != EINTR)
+            Log::error("Error: epoll_wait failed.");
+
+        expireRequests();
+        expireSpawns();
+
+        for (int i = 0; i < count; ++i)
         {
-            if (WIFEXITED(status))
+            const int fd = events[i].data.fd;
+            if (fd == signalFd)
             {
-                Log::info() << "Child process [" << pid << "] exited with code: "
-                            << WEXITSTATUS(status) << "." << Log::end;
-
-                removeChild(pid);
+                // Signals coalesce, so reap all that changed.
+                if (Util::readSignalFd(signalFd))
+                    reapChildren();
             }
-            else
-            if (WIFSIGNALED(status))
+            else if (fd == timerFd)
             {
-                std::string fate = "died";
-#ifdef WCOREDUMP
-                if (WCOREDUMP(status))
-                    fate = "core-dumped";
-#endif
-                Log::error() << "Child process [" << pid << "] " << fate
-                             << " with " << Util::signalName(WTERMSIG(status))
-                             << " signal. " << Log::end;
-
-                removeChild(pid);
+                uint64_t expirations;
+                if (read(timerFd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+                    Log::error("Error: failed to read the timer.");
             }
-            else if (WIFSTOPPED(status))
+            else if (fd == wsdSocket)
             {
-                Log::info() << "Child process [" << pid << "] stopped with "
-                            << Util::signalName(WSTOPSIG(status))
-                            << " signal. " << Log::end;
+                // Nobody to serve anymore.
+                if (!handleMasterInput(wsdReader) && !TerminationFlag)
+                {
+                    Log::info("No more requests from wsd. Terminating.");
+                    TerminationFlag = true;
+                }
             }
-            else if (WIFCONTINUED(status))
+            else if (fd == kitListenSocket)
             {
-                Log::info() << "Child process [" << pid << "] resumed with SIGCONT."
-                            << Log::end;
+                acceptKits();
             }
-            else
+            else if (!handleKitHello(fd))
             {
-                Log::warn() << "Unknown status returned by waitpid: "
-                            << std::hex << status << "." << Log::end;
-            }
+                std::shared_ptr<ChildProcess> child;
+                {
+                    std::lock_guard<std::recursive_mutex> lock(forkMutex);
+                    const auto it = _childrenBySocket.find(fd);
+                    if (it != _childrenBySocket.end())
+                        child = it->second;
+                }
 
-            pipeHandler.syncChilds();
-        }
-        else if (pid < 0)
-            Log::error("Error: waitpid failed.");
+                if (!child)
+                    continue;
 
-        if (timeoutCounter++ == INTERVAL_PROBES)
-        {
-            timeoutCounter = 0;
-            sleep(MAINTENANCE_INTERVAL);
+                std::vector<std::string> messages;
+                const bool alive = child->read(messages);
+                for (const auto& message : messages)
+                    handleChildMessage(message);
+
+                if (!alive)
+                {
+                    Log::info("Child [" + std::to_string(child->getPid()) + "] closed its socket.");
+                    removeChild(child->getPid());
+                }
+            }
         }
+
+        // A kit got ready or closed its document meanwhile.
+        if (!_parkedRequests.empty())
+            serveParkedRequests();
     }
 
+    // Those that never said hello only need to go.
+    for (const auto& it : _connectingKits)
+        close(it.first);
+    for (const auto& it : _spawningChildren)
+        Process::requestTermination(it.first);
+
     // Terminate child processes
     for (auto& it : _childProcesses)
     {
@@ -984,11 +2140,25 @@ int main(int argc, char** argv)
         }
     }
 
+    _pendingRequests.clear();
+    _parkedRequests.clear();
+    _connectingKits.clear();
+    _spawningChildren.clear();
+    _childrenBySocket.clear();
+    _childrenByUrl.clear();
+    _emptyChildren.clear();
     _childProcesses.clear();
 
-    aPipe.join();
-    close(readerChild);
-    close(readerBroker);
+    Log::info(childPool.getStatistics());
+    Log::info("Memory: " + getMemoryStatistics());
+    if (procDir >= 0)
+        close(procDir);
+
+    close(epollFd);
+    close(signalFd);
+    close(timerFd);
+    close(kitListenSocket);
+    close(wsdSocket);
 
     Log::info("Process [loolbroker] finished.");
     return Application::EXIT_OK;
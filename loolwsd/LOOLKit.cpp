@@ -13,12 +13,27 @@
 
 #include <sys/prctl.h>
 #include <sys/poll.h>
+#include <sys/resource.h>
 #include <sys/syscall.h>
+#include <fcntl.h>
 #include <signal.h>
+#include <unistd.h>
 
 #include <atomic>
+#include <cassert>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <limits>
 #include <memory>
+#include <mutex>
 #include <iostream>
+#include <iterator>
+#include <vector>
 
 #include <Poco/Net/WebSocket.h>
 #include <Poco/Net/HTTPClientSession.h>
@@ -27,6 +42,7 @@
 #include <Poco/Thread.h>
 #include <Poco/ThreadPool.h>
 #include <Poco/Runnable.h>
+#include <Poco/RunnableAdapter.h>
 #include <Poco/StringTokenizer.h>
 #include <Poco/Exception.h>
 #include <Poco/Process.h>
@@ -34,15 +50,17 @@
 #include <Poco/NotificationQueue.h>
 #include <Poco/Notification.h>
 #include <Poco/Mutex.h>
+#include <Poco/Timestamp.h>
 #include <Poco/Util/ServerApplication.h>
 
 #define LOK_USE_UNSTABLE_API
 #include <LibreOfficeKit/LibreOfficeKitInit.h>
 
 #include "Common.hpp"
-#include "QueueHandler.hpp"
+#include "MessageQueue.hpp"
 #include "Util.hpp"
 #include "ChildProcessSession.hpp"
+#include "LOKitHelper.hpp"
 #include "LOOLProtocol.hpp"
 
 using namespace LOOLProtocol;
@@ -61,16 +79,33 @@ using Poco::FastMutex;
 using Poco::Util::Application;
 
 const std::string CHILD_URI = "/loolws/child/";
-const std::string LOKIT_BROKER = "/tmp/loolbroker.fifo";
 
-class Connection: public Runnable
+/// Seconds without input from its client after which a session is
+/// disconnected, 0 for never.
+static int SessionIdleTimeoutSecs = 0;
+/// Seconds without input from any of its sessions after which a
+/// document is unloaded, 0 for never.
+static int DocumentIdleTimeoutSecs = 0;
+/// Whether to save the modified documents we unload.
+static bool AutoSave = false;
+/// How many documents this kit loaded, to tell the first one.
+static std::atomic<unsigned> DocumentsLoaded(0);
+
+/// A view of the document, with its socket to the parent and its input queue.
+/// It has no thread of its own: the reader of the Document reads its socket,
+/// and the workers of the Document handle its input, one at a time.
+class Connection
 {
 public:
     Connection(std::shared_ptr<ChildProcessSession> session,
                std::shared_ptr<WebSocket> ws) :
         _session(session),
         _ws(ws),
-        _stop(false)
+        _reading(true),
+        _running(true),
+        _scheduled(false),
+        _idleWork(true),
+        _lastInputTime(std::chrono::steady_clock::now())
     {
         Log::info("Connection ctor in child for " + _session->getId());
     }
@@ -84,131 +119,397 @@ public:
     std::shared_ptr<WebSocket> getWebSocket() const { return _ws; }
     std::shared_ptr<ChildProcessSession> getSession() { return _session; }
 
-    void start()
+    /// False once the session finished handling its input.
+    bool isRunning() const { return _running; }
+
+    /// False once the socket is closed, or the parent said goodbye.
+    bool isReading() const { return _reading && _running; }
+
+    void stop()
     {
-        _thread.start(*this);
+        _reading = false;
     }
 
-    bool isRunning()
+    /// Reads a frame from the socket into the queue, on the reader thread,
+    /// when the socket is readable. Returns true when the connection needs
+    /// a worker to handle it.
+    bool readFrame()
     {
-        return _thread.isRunning();
+        int flags = 0;
+        int n = 0;
+        try
+        {
+            char buffer[1024];
+            n = _ws->receiveFrame(buffer, sizeof(buffer), flags);
+            if (n > 0 && (flags & WebSocket::FRAME_OP_BITMASK) != WebSocket::FRAME_OP_CLOSE)
+            {
+                std::string firstLine = getFirstLine(buffer, n);
+                if (firstLine == "eof")
+                {
+                    Log::info("Received EOF. Finishing.");
+                    return finishReading();
+                }
+
+                StringTokenizer tokens(firstLine, " ", StringTokenizer::TOK_IGNORE_EMPTY | StringTokenizer::TOK_TRIM);
+
+                if (firstLine == "disconnect")
+                {
+                    Log::info("Client disconnected [" + (tokens.count() == 2 ? tokens[1] : std::string("no reason")) + "].");
+                    return finishReading();
+                }
+
+                // Check if it is a "nextmessage:" and in that case read the large
+                // follow-up message separately, and handle that only.
+                int size;
+                if (tokens.count() == 2 && tokens[0] == "nextmessage:" && getTokenInteger(tokens[1], "size", size) && size > 0)
+                {
+                    char largeBuffer[size];
+                    n = _ws->receiveFrame(largeBuffer, size, flags);
+                    if (n > 0 && (flags & WebSocket::FRAME_OP_BITMASK) != WebSocket::FRAME_OP_CLOSE)
+                    {
+                        firstLine = getFirstLine(largeBuffer, n);
+                        return put(firstLine, largeBuffer, n);
+                    }
+                }
+                else
+                    return put(firstLine, buffer, n);
+            }
+        }
+        catch (const Exception& exc)
+        {
+            Log::error() << "Error: " << exc.displayText()
+                         << (exc.nested() ? " (" + exc.nested()->displayText() + ")" : "")
+                         << Log::end;
+        }
+        catch (const std::exception& exc)
+        {
+            Log::error(std::string("Exception: ") + exc.what());
+        }
+
+        Log::debug() << "Finishing reading " << _session->getName()
+                     << ", payload size: " << n
+                     << ", flags: " << std::hex << flags << Log::end;
+        return finishReading();
     }
 
-    void stop()
+    /// Handles the next input, on a worker thread, when scheduled.
+    /// Returns true when there is more, and it stays scheduled.
+    bool handleNext()
     {
-        _stop = true;
+        std::string input;
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            if (!_queue.get(input, 0))
+            {
+                _scheduled = false;
+                return false;
+            }
+
+            // Input may leave new work to do once it's quiet again.
+            _idleWork = true;
+            _lastInputTime = std::chrono::steady_clock::now();
+        }
+
+        if (input == "eof")
+        {
+            finish();
+            return false;
+        }
+
+        try
+        {
+            if (_session->handleInput(input.c_str(), input.size()))
+            {
+                return true;
+            }
+
+            Log::info("Socket handler flagged for finishing.");
+        }
+        catch (const std::exception& exc)
+        {
+            Log::error(std::string("Exception: ") + exc.what());
+        }
+
+        finish();
+        return false;
     }
 
-    void join()
+    /// Takes the connection for idle work, when it has some, and had
+    /// no input for IDLE_WORK_DELAY_MS. Reschedule it when done.
+    bool claimIdle()
     {
-        _thread.join();
+        std::unique_lock<std::mutex> lock(_mutex);
+        const auto quietMS = std::chrono::duration_cast<std::chrono::milliseconds>(
+                                 std::chrono::steady_clock::now() - _lastInputTime).count();
+        if (!_running || _scheduled || !_idleWork || quietMS < IDLE_WORK_DELAY_MS)
+        {
+            return false;
+        }
+
+        _scheduled = true;
+        return true;
     }
 
-    void handle(TileQueue& queue, const std::string& firstLine, char* buffer, int n)
+    /// Does one step of idle work, so that new input preempts it.
+    void handleIdle()
     {
+        bool idleWork = false;
+        try
+        {
+            idleWork = _session->handleIdle();
+        }
+        catch (const std::exception& exc)
+        {
+            Log::error(std::string("Exception: ") + exc.what());
+        }
+
+        std::unique_lock<std::mutex> lock(_mutex);
+        _idleWork = idleWork;
+    }
+
+private:
+    /// Queues the input, returns true when the connection needs scheduling.
+    bool put(const std::string& firstLine, char* buffer, int n)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
         if (firstLine.find("paste") != 0)
         {
             // Everything else is expected to be a single line.
             assert(firstLine.size() == static_cast<std::string::size_type>(n));
-            queue.put(firstLine);
+            _queue.put(firstLine);
         }
         else
-            queue.put(std::string(buffer, n));
+            _queue.put(std::string(buffer, n));
+
+        return schedule();
+    }
+
+    bool finishReading()
+    {
+        _reading = false;
+
+        std::unique_lock<std::mutex> lock(_mutex);
+        _queue.clear();
+        _queue.put("eof");
+        return schedule();
+    }
+
+    /// Marks the connection scheduled, true when it wasn't.
+    bool schedule()
+    {
+        if (_scheduled)
+        {
+            return false;
+        }
+
+        _scheduled = true;
+        return true;
+    }
+
+    void finish()
+    {
+        _session->disconnect();
+        _running = false;
+        _reading = false;
+    }
+
+private:
+    std::shared_ptr<ChildProcessSession> _session;
+    std::shared_ptr<WebSocket> _ws;
+    TileQueue _queue;
+    /// Guards the queue and the scheduling state, so that input
+    /// never arrives unnoticed as a worker is done with the connection.
+    std::mutex _mutex;
+    std::atomic<bool> _reading;
+    std::atomic<bool> _running;
+    bool _scheduled;
+    bool _idleWork;
+    std::chrono::steady_clock::time_point _lastInputTime;
+};
+
+/// A LOK callback, for the session whose view it was registered
+/// for, or AllSessions for the document callbacks.
+class CallbackNotification: public Notification
+{
+public:
+    typedef Poco::AutoPtr<CallbackNotification> Ptr;
+
+    CallbackNotification(const long intSessionId, const int nType, const std::string& rPayload)
+      : _intSessionId(intSessionId),
+        _nType(nType),
+        _aPayload(rPayload)
+    {
+    }
+
+    static constexpr long AllSessions = LOKitHelper::AllSessions;
+
+    const long _intSessionId;
+    const int _nType;
+    const std::string _aPayload;
+};
+
+/// This thread handles the callbacks from the lokit instance for all
+/// the views of a document, and dispatches them to the sessions.
+class CallbackWorker: public Runnable
+{
+public:
+    typedef std::function<void(long, int, const std::string&)> Dispatcher;
+    /// Does the deferred work that is due, returns
+    /// the ms until more is, 0 when there is none.
+    typedef std::function<long()> Flusher;
+
+    CallbackWorker(NotificationQueue& queue, Dispatcher dispatcher, Flusher flusher):
+        _queue(queue),
+        _dispatcher(dispatcher),
+        _flusher(flusher),
+        _stop(false)
+    {
     }
 
     void run() override
     {
-        static const std::string thread_name = "kit_ws_" + _session->getId();
+        static const std::string thread_name = "kit_callback";
 #ifdef __linux
         if (prctl(PR_SET_NAME, reinterpret_cast<unsigned long>(thread_name.c_str()), 0, 0, 0) != 0)
             Log::error("Cannot set thread name to " + thread_name + ".");
 #endif
         Log::debug("Thread [" + thread_name + "] started.");
 
-        try
+        long flushMS = 0;
+        while (!_stop && !TerminationFlag)
         {
-            TileQueue queue;
-            QueueHandler handler(queue, _session, "kit_queue_" + _session->getId());
-
-            Thread queueHandlerThread;
-            queueHandlerThread.start(handler);
-
-            int flags;
-            int n;
-            do
+            Notification::Ptr aNotification(flushMS > 0 ? _queue.waitDequeueNotification(flushMS)
+                                                        : _queue.waitDequeueNotification());
+            if (!_stop && !TerminationFlag && !aNotification && flushMS > 0)
             {
-                char buffer[1024];
-                n = _ws->receiveFrame(buffer, sizeof(buffer), flags);
-                if (n > 0)
+                flushMS = _flusher();
+            }
+            else if (!_stop && !TerminationFlag && aNotification)
+            {
+                // LOK emits bursts of callbacks, eg. on typing; gather what
+                // follows closely and send only what is still relevant.
+                std::vector<LOKitHelper::PendingCallback> pending;
+                size_t received = 0;
+                Poco::Timestamp windowStart;
+                while (aNotification)
                 {
-                    std::string firstLine = getFirstLine(buffer, n);
-                    if (firstLine == "eof")
-                    {
-                        Log::info("Received EOF. Finishing.");
+                    CallbackNotification::Ptr aCallbackNotification = aNotification.cast<CallbackNotification>();
+                    assert(aCallbackNotification);
+                    LOKitHelper::coalesceCallback(pending, aCallbackNotification->_intSessionId,
+                                                  aCallbackNotification->_nType, aCallbackNotification->_aPayload);
+                    ++received;
+
+                    const long remainingMS = CoalesceWindowMS - windowStart.elapsed() / 1000;
+                    if (_stop || TerminationFlag || remainingMS <= 0)
                         break;
-                    }
 
-                    StringTokenizer tokens(firstLine, " ", StringTokenizer::TOK_IGNORE_EMPTY | StringTokenizer::TOK_TRIM);
+                    aNotification = _queue.waitDequeueNotification(remainingMS);
+                }
+
+                if (received > pending.size())
+                {
+                    Log::trace() << "Coalesced " << received << " callbacks into "
+                                 << pending.size() << "." << Log::end;
+                }
 
-                    if (firstLine == "disconnect")
+                for (const auto& callback : pending)
+                {
+                    try
                     {
-                        Log::info("Client disconnected [" + (tokens.count() == 2 ? tokens[1] : std::string("no reason")) + "].");
-                        break;
+                        _dispatcher(callback._intSessionId, callback._nType, callback._payload);
                     }
-
-                    // Check if it is a "nextmessage:" and in that case read the large
-                    // follow-up message separately, and handle that only.
-                    int size;
-                    if (tokens.count() == 2 && tokens[0] == "nextmessage:" && getTokenInteger(tokens[1], "size", size) && size > 0)
+                    catch (const Exception& exc)
                     {
-                        char largeBuffer[size];
-                        n = _ws->receiveFrame(largeBuffer, size, flags);
-                        if (n > 0 && (flags & WebSocket::FRAME_OP_BITMASK) != WebSocket::FRAME_OP_CLOSE)
-                        {
-                            firstLine = getFirstLine(largeBuffer, n);
-                            handle(queue, firstLine, largeBuffer, n);
-                        }
+                        Log::error() << "Error while handling callback ["
+                                     << LOKitHelper::kitCallbackTypeToString(callback._nType) << "]. "
+                                     << exc.displayText()
+                                     << (exc.nested() ? " (" + exc.nested()->displayText() + ")" : "")
+                                     << Log::end;
+                    }
+                    catch (const std::exception& exc)
+                    {
+                        Log::error("Error while handling callback [" +
+                                   LOKitHelper::kitCallbackTypeToString(callback._nType) + "]. " +
+                                   std::string("Exception: ") + exc.what());
                     }
-                    else
-                        handle(queue, firstLine, buffer, n);
                 }
-            }
-            while (!_stop && n > 0 && (flags & WebSocket::FRAME_OP_BITMASK) != WebSocket::FRAME_OP_CLOSE);
-            Log::debug() << "Finishing " << thread_name << ". stop " << _stop
-                         << ", payload size: " << n
-                         << ", flags: " << std::hex << flags << Log::end;
 
-            queue.clear();
-            queue.put("eof");
-            queueHandlerThread.join();
-
-            _session->disconnect();
-        }
-        catch (const Exception& exc)
-        {
-            Log::error() << "Error: " << exc.displayText()
-                         << (exc.nested() ? " (" + exc.nested()->displayText() + ")" : "")
-                         << Log::end;
-        }
-        catch (const std::exception& exc)
-        {
-            Log::error(std::string("Exception: ") + exc.what());
-        }
-        catch (...)
-        {
-            Log::error("Unexpected Exception.");
+                flushMS = _flusher();
+            }
+            else
+                break;
         }
 
         Log::debug("Thread [" + thread_name + "] finished.");
     }
 
+    void stop()
+    {
+        _stop = true;
+        _queue.wakeUpAll();
+    }
+
+    /// Lets it run again after stop(), with what was queued meanwhile.
+    void reset()
+    {
+        _stop = false;
+    }
+
 private:
-    Thread _thread;
-    std::shared_ptr<ChildProcessSession> _session;
-    std::shared_ptr<WebSocket> _ws;
+    NotificationQueue& _queue;
+    Dispatcher _dispatcher;
+    Flusher _flusher;
     volatile bool _stop;
+
+    /// How long to gather callbacks before sending them on.
+    static constexpr long CoalesceWindowMS = 10;
 };
 
+/// A connection with input to handle, for the workers of a Document.
+class WorkNotification: public Notification
+{
+public:
+    typedef Poco::AutoPtr<WorkNotification> Ptr;
+
+    WorkNotification(const std::shared_ptr<Connection>& connection)
+      : _connection(connection)
+    {
+    }
+
+    const std::shared_ptr<Connection> _connection;
+};
+
+namespace
+{
+    /// Returns the number of threads of this process, 0 if unknown.
+    size_t getThreadCount()
+    {
+        std::ifstream status("/proc/self/status");
+        std::string line;
+        while (std::getline(status, line))
+        {
+            if (line.compare(0, 8, "Threads:") == 0)
+            {
+                return std::strtoul(line.c_str() + 8, nullptr, 10);
+            }
+        }
+
+        return 0;
+    }
+
+    /// Returns the stack size reserved for new threads, 0 if unknown.
+    size_t getThreadStackSize()
+    {
+        struct rlimit limit;
+        if (getrlimit(RLIMIT_STACK, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY)
+        {
+            return limit.rlim_cur;
+        }
+
+        return 0;
+    }
+}
+
 /// A document container.
 /// Owns LOKitDocument instance and connections.
 /// Manages the lifetime of a document.
@@ -227,18 +528,49 @@ public:
         _jailId(jailId),
         _url(url),
         _loKitDocument(nullptr),
-        _clientViews(0)
+        _modified(false),
+        _clientViews(0),
+        _callbackWorker(_callbackQueue,
+                        [this](const long id, const int type, const std::string& payload)
+                        { dispatchCallback(id, type, payload); },
+                        [this]() { return flushDocumentSize(); }),
+        _sizeChangePending(false),
+        _sizeChanges(0),
+        _sizeUpdates(0),
+        _unchangedUpdates(0),
+        _stopWorkers(false),
+        _reader(*this, &Document::readSockets),
+        _worker(*this, &Document::handleWork),
+        _workerCount(0)
     {
         Log::info("Document ctor for url [" + _url + "] on child [" + _jailId +
                   "] LOK_VIEW_CALLBACK=" + std::to_string(_multiView) + ".");
+
+        if (pipe2(_wakeupPipe, O_NONBLOCK | O_CLOEXEC) != 0)
+        {
+            Log::error("Failed to create the wakeup pipe.");
+            _wakeupPipe[0] = _wakeupPipe[1] = -1;
+        }
+
+        startThreads();
     }
 
     ~Document()
     {
+        // Stop the threads before the sessions go,
+        // they take our lock to find them.
+        stopThreads();
+
+        close(_wakeupPipe[0]);
+        close(_wakeupPipe[1]);
+
         std::unique_lock<std::recursive_mutex> lock(_mutex);
 
         Log::info("~Document dtor for url [" + _url + "] on child [" + _jailId +
                   "]. There are " + std::to_string(_clientViews) + " views.");
+        Log::info() << "Document size changed " << _sizeChanges << " times, "
+                    << (_sizeChanges - _sizeUpdates) << " updates debounced, "
+                    << _unchangedUpdates << " unchanged not sent." << Log::end;
 
         // Flag all connections to stop.
         for (auto aIterator : _connections)
@@ -256,10 +588,10 @@ public:
                 if ( ws )
                     ws->shutdownReceive();
             }
-            else
+            else if (aIterator.second->isRunning())
             {
-                // wait until loolwsd close all websockets
-                aIterator.second->join();
+                // nobody reads them anymore
+                aIterator.second->getSession()->disconnect();
             }
         }
 
@@ -316,15 +648,16 @@ public:
                           sessionId + " " + std::to_string(Process::id()));
         session->sendTextFrame(hello);
 
-        auto thread = std::make_shared<Connection>(session, ws);
-        const auto aInserted = _connections.emplace(intSessionId, thread);
+        auto connection = std::make_shared<Connection>(session, ws);
+        const auto aInserted = _connections.emplace(intSessionId, connection);
 
         if ( aInserted.second )
-            thread->start();
+            wakeUpReader();
         else
             Log::error("Connection already exists for child: " + _jailId + ", thread: " + sessionId);
 
         Log::debug("Connections: " + std::to_string(_connections.size()));
+        logThreadUsage();
     }
 
     /// Purges dead connections and returns
@@ -356,6 +689,11 @@ public:
         deadSessions.clear();
 
         std::unique_lock<std::recursive_mutex> lock(_mutex);
+        if (!deadSessions.empty() && !_connections.empty())
+        {
+            logThreadUsage();
+        }
+
         return _connections.size();
     }
 
@@ -366,19 +704,310 @@ public:
         return purgeSessions() > 0;
     }
 
-    /// Returns true if there is no activity and
-    /// the document is saved.
+    /// Returns true if there is no live connection, or no activity
+    /// for DocumentIdleTimeoutSecs, after saving the document if we
+    /// AutoSave. Disconnects the sessions idle for SessionIdleTimeoutSecs.
+    /// Keeps the document while it fails to save, and while it has
+    /// unsaved changes of connected sessions without AutoSave.
     bool canDiscard()
     {
-        //TODO: Implement proper time-out on inactivity.
-        return !hasConnections();
+        const bool connected = hasConnections();
+        if (connected)
+        {
+            const auto inactivityMS = disconnectIdleSessions();
+            if (DocumentIdleTimeoutSecs <= 0 || inactivityMS < DocumentIdleTimeoutSecs * 1000.0)
+            {
+                return false;
+            }
+
+            if (!AutoSave && _modified)
+            {
+                Log::debug("Document [" + _url + "] is idle, but has unsaved changes. Not unloading.");
+                return false;
+            }
+
+            Log::info() << "Document [" << _url << "] idle for " << inactivityMS / 1000
+                        << " seconds. Unloading." << Log::end;
+        }
+
+        if (AutoSave && _modified && std::chrono::steady_clock::now() < _saveRetryTime)
+        {
+            return false;
+        }
+
+        // Nothing else may use the document while we save and unload it.
+        stopThreads();
+
+        // Changed since we checked, or failing to save: carry on.
+        if ((connected && !AutoSave && _modified) || (AutoSave && !save()))
+        {
+            Log::warn("Keeping document [" + _url + "] loaded, it has unsaved changes.");
+            _saveRetryTime = std::chrono::steady_clock::now() + std::chrono::seconds(SaveRetryIntervalSecs);
+            startThreads();
+            return false;
+        }
+
+        return true;
     }
 
 private:
 
-    static void ViewCallback(int , const char* , void* )
+    /// Starts the reader, the workers and the callback thread.
+    void startThreads()
+    {
+        _stopWorkers = false;
+        _callbackWorker.reset();
+
+        _readerThread.start(_reader);
+        for (auto& thread : _workerThreads)
+        {
+            thread.start(_worker);
+        }
+
+        _callbackThread.start(_callbackWorker);
+    }
+
+    /// Stops the reader, the workers and the callback thread, once.
+    void stopThreads()
+    {
+        if (_stopWorkers.exchange(true))
+        {
+            return;
+        }
+
+        wakeUpReader();
+        _workQueue.wakeUpAll();
+        _readerThread.join();
+        for (auto& thread : _workerThreads)
+        {
+            thread.join();
+        }
+
+        _callbackWorker.stop();
+        _callbackThread.join();
+    }
+
+    /// Disconnects the sessions idle for SessionIdleTimeoutSecs, and
+    /// returns for how long the least idle of the others has been.
+    double disconnectIdleSessions()
+    {
+        bool remaining = false;
+        double inactivityMS = std::numeric_limits<double>::max();
+        for (auto& session : getSessions(CallbackNotification::AllSessions))
+        {
+            const double sessionMS = session->getStatistics().getInactivityMS();
+            if (SessionIdleTimeoutSecs > 0 && sessionMS >= SessionIdleTimeoutSecs * 1000.0)
+            {
+                // The reader sees the socket closed, and finishes the connection.
+                Log::info() << "Session [" << session->getId() << "] idle for " << sessionMS / 1000
+                            << " seconds. Disconnecting." << Log::end;
+                session->disconnect("idle");
+            }
+            else
+            {
+                remaining = true;
+                inactivityMS = std::min(inactivityMS, sessionMS);
+            }
+        }
+
+        // Once they are all gone, we go with the last connection.
+        return (remaining ? inactivityMS : 0);
+    }
+
+    /// Saves the document where it was loaded from, if modified.
+    /// Returns false when it failed to.
+    bool save()
     {
-        //TODO: Delegate the callback.
+        if (_loKitDocument == nullptr || !_modified)
+        {
+            return true;
+        }
+
+        // Under the LOK lock of the sessions, from a view of one left, if any.
+        auto lock = ChildProcessSession::getLock();
+        const auto sessions = getSessions(CallbackNotification::AllSessions);
+        if (_multiView && !sessions.empty())
+        {
+            _loKitDocument->pClass->setView(_loKitDocument, sessions.front()->getViewId());
+        }
+
+        Log::info("Saving [" + _url + "] to [" + _jailedUri + "].");
+        if (!_loKitDocument->pClass->saveAs(_loKitDocument, _jailedUri.c_str(), nullptr, nullptr))
+        {
+            Log::error("Failed to save [" + _jailedUri + "]: " + _loKit->pClass->getError(_loKit));
+            return false;
+        }
+
+        _modified = false;
+        return true;
+    }
+
+    /// Logs the threads of the kit, and the stack they reserve per session.
+    void logThreadUsage()
+    {
+        std::unique_lock<std::recursive_mutex> lock(_mutex);
+        const size_t threads = getThreadCount();
+        const size_t sessions = std::max<size_t>(_connections.size(), 1);
+        Log::info() << "Document [" << _url << "] has " << _connections.size()
+                    << " sessions, the kit has " << threads << " threads, "
+                    << (threads * getThreadStackSize() / sessions / 1024)
+                    << " KB of stack reserved per session." << Log::end;
+    }
+
+    void wakeUpReader()
+    {
+        if (_wakeupPipe[1] >= 0 && write(_wakeupPipe[1], "w", 1) < 0 && errno != EAGAIN)
+        {
+            Log::error("Failed to wake up the socket reader.");
+        }
+    }
+
+    /// Reads the sockets of all the connections, on the reader thread,
+    /// and hands those with input to the workers.
+    void readSockets()
+    {
+        static const std::string thread_name = "kit_reader";
+#ifdef __linux
+        if (prctl(PR_SET_NAME, reinterpret_cast<unsigned long>(thread_name.c_str()), 0, 0, 0) != 0)
+            Log::error("Cannot set thread name to " + thread_name + ".");
+#endif
+        Log::debug("Thread [" + thread_name + "] started.");
+
+        while (!_stopWorkers && !TerminationFlag)
+        {
+            // The wakeup pipe first, to notice new connections.
+            std::vector<std::shared_ptr<Connection>> connections;
+            std::vector<pollfd> fds;
+            fds.push_back(pollfd{ _wakeupPipe[0], POLLIN, 0 });
+            {
+                std::unique_lock<std::recursive_mutex> lock(_mutex);
+                for (auto& it : _connections)
+                {
+                    if (it.second->isReading())
+                    {
+                        connections.push_back(it.second);
+                        fds.push_back(pollfd{ it.second->getWebSocket()->impl()->sockfd(), POLLIN, 0 });
+                    }
+                }
+            }
+
+            if (poll(fds.data(), fds.size(), POLL_TIMEOUT_MS) < 0)
+            {
+                if (errno != EINTR)
+                    Log::error("Failed to poll the sockets of [" + _url + "].");
+                continue;
+            }
+
+            if (fds[0].revents & POLLIN)
+            {
+                char buffer[64];
+                while (read(_wakeupPipe[0], buffer, sizeof(buffer)) > 0)
+                {
+                }
+            }
+
+            for (size_t i = 0; i < connections.size(); ++i)
+            {
+                if ((fds[i + 1].revents & (POLLIN | POLLHUP | POLLERR)) &&
+                    connections[i]->readFrame())
+                {
+                    _workQueue.enqueueNotification(new WorkNotification(connections[i]));
+                }
+            }
+        }
+
+        Log::debug("Thread [" + thread_name + "] finished.");
+    }
+
+    /// Handles the input of the connections, one message at a time so that
+    /// they take turns, and their idle work when quiet, on a worker thread.
+    void handleWork()
+    {
+        const std::string thread_name = "kit_worker_" + std::to_string(++_workerCount);
+#ifdef __linux
+        if (prctl(PR_SET_NAME, reinterpret_cast<unsigned long>(thread_name.c_str()), 0, 0, 0) != 0)
+            Log::error("Cannot set thread name to " + thread_name + ".");
+#endif
+        Log::debug("Thread [" + thread_name + "] started.");
+
+        bool idleWork = false;
+        while (!_stopWorkers && !TerminationFlag)
+        {
+            Notification::Ptr aNotification(idleWork ? _workQueue.dequeueNotification()
+                                                     : _workQueue.waitDequeueNotification(IDLE_WORK_DELAY_MS));
+            if (_stopWorkers || TerminationFlag)
+            {
+                break;
+            }
+
+            if (aNotification)
+            {
+                WorkNotification::Ptr aWorkNotification = aNotification.cast<WorkNotification>();
+                assert(aWorkNotification);
+                const bool more = aWorkNotification->_connection->handleNext();
+                flushDeferredCallbacks();
+                if (more)
+                {
+                    // Still ours, take the next turn after the others.
+                    _workQueue.enqueueNotification(new WorkNotification(aWorkNotification->_connection));
+                }
+            }
+            else
+            {
+                idleWork = handleIdle();
+            }
+        }
+
+        Log::debug("Thread [" + thread_name + "] finished.");
+    }
+
+    /// Does a step of the idle work of a connection,
+    /// returns false when none had any to do.
+    bool handleIdle()
+    {
+        std::shared_ptr<Connection> connection;
+        {
+            std::unique_lock<std::recursive_mutex> lock(_mutex);
+            for (auto& it : _connections)
+            {
+                if (it.second->claimIdle())
+                {
+                    connection = it.second;
+                    break;
+                }
+            }
+        }
+
+        if (!connection)
+        {
+            return false;
+        }
+
+        connection->handleIdle();
+        flushDeferredCallbacks();
+
+        // Give it back, with any input that came meanwhile.
+        _workQueue.enqueueNotification(new WorkNotification(connection));
+        return true;
+    }
+
+    /// What a view callback is registered with.
+    struct ViewCallbackData
+    {
+        Document* _document;
+        unsigned _intSessionId;
+        int _viewId;
+    };
+
+    static void ViewCallback(int nType, const char* pPayload, void* pData)
+    {
+        ViewCallbackData* data = reinterpret_cast<ViewCallbackData*>(pData);
+        if (data && data->_document)
+        {
+            data->_document->queueCallback(data->_intSessionId,
+                                           ChildProcessSession::getPrefetchingView() == data->_viewId,
+                                           nType, pPayload ? pPayload : "(nil)");
+        }
     }
 
     static void DocumentCallback(int nType, const char* pPayload, void* pData)
@@ -386,20 +1015,176 @@ private:
         Document* self = reinterpret_cast<Document*>(pData);
         if (self)
         {
-            std::unique_lock<std::recursive_mutex> lock(self->_mutex);
+            // There is a single view, so the one prefetching, if any.
+            self->queueCallback(CallbackNotification::AllSessions, ChildProcessSession::isPrefetching(),
+                                nType, pPayload ? pPayload : "(nil)");
+        }
+    }
+
+    /// Queues a callback for the callback thread, so that LOK, which calls
+    /// us holding its own lock, is not blocked on the sessions.
+    /// While a view renders ahead, the callbacks are held back until it has
+    /// switched back to its part, see flushDeferredCallbacks(), and those
+    /// the part switching itself causes in that view are dropped.
+    void queueCallback(const long intSessionId, const bool prefetchingView,
+                       const int nType, const std::string& rPayload)
+    {
+        // Tracked as LOK tells, for save(), which may come
+        // after the callback thread is stopped.
+        static const std::string modifiedStatus = ".uno:ModifiedStatus=";
+        if (nType == LOK_CALLBACK_STATE_CHANGED && rPayload.compare(0, modifiedStatus.size(), modifiedStatus) == 0)
+        {
+            _modified = (rPayload.substr(modifiedStatus.size()) == "true");
+        }
+
+        std::unique_lock<std::mutex> lock(_deferredMutex);
+        if (ChildProcessSession::isPrefetching() || !_deferredCallbacks.empty())
+        {
+            if (!(prefetchingView && ChildProcessSession::isPrefetching() && isPartSwitchCallback(nType, rPayload)))
+            {
+                _deferredCallbacks.emplace_back(new CallbackNotification(intSessionId, nType, rPayload));
+            }
+
+            return;
+        }
+
+        _callbackQueue.enqueueNotification(new CallbackNotification(intSessionId, nType, rPayload));
+    }
+
+    /// Hands the callbacks held back while rendering ahead to the
+    /// callback thread, in order, once the render is done.
+    void flushDeferredCallbacks()
+    {
+        std::unique_lock<std::mutex> lock(_deferredMutex);
+        if (ChildProcessSession::isPrefetching() || _deferredCallbacks.empty())
+        {
+            return;
+        }
+
+        Log::trace() << "Sending " << _deferredCallbacks.size()
+                     << " callbacks held back while prefetching." << Log::end;
+        for (auto& notification : _deferredCallbacks)
+        {
+            _callbackQueue.enqueueNotification(notification);
+        }
+
+        _deferredCallbacks.clear();
+    }
+
+    /// True for what switching the part of a view, and back, emits:
+    /// the part change and the repaint of the whole part. An edit
+    /// invalidates its area, which we keep.
+    static bool isPartSwitchCallback(const int nType, const std::string& rPayload)
+    {
+        if (nType == LOK_CALLBACK_SET_PART)
+        {
+            return true;
+        }
+
+        long x1, y1, x2, y2;
+        return (nType == LOK_CALLBACK_INVALIDATE_TILES &&
+                !LOKitHelper::getInvalidatedArea(rPayload, x1, y1, x2, y2));
+    }
+
+    /// Returns the running sessions, or the one with the given id.
+    std::vector<std::shared_ptr<ChildProcessSession>> getSessions(const long intSessionId)
+    {
+        std::vector<std::shared_ptr<ChildProcessSession>> sessions;
+        std::unique_lock<std::recursive_mutex> lock(_mutex);
 
-            for (auto& it: self->_connections)
+        for (auto& it: _connections)
+        {
+            if ((intSessionId == CallbackNotification::AllSessions || it.first == intSessionId) &&
+                it.second->isRunning())
             {
-                if (it.second->isRunning())
+                auto session = it.second->getSession();
+                if (session)
                 {
-                    auto session = it.second->getSession();
-                    if (session)
-                    {
-                        session->loKitCallback(nType, pPayload);
-                    }
+                    sessions.push_back(session);
+                }
+            }
+        }
+
+        return sessions;
+    }
+
+    /// Hands a callback to its session, or to all of them,
+    /// on the callback thread.
+    void dispatchCallback(const long intSessionId, const int nType, const std::string& rPayload)
+    {
+        if (nType == LOK_CALLBACK_DOCUMENT_SIZE_CHANGED)
+        {
+            // Getting the status and page rectangles walks the whole
+            // layout, do it once for all views, see flushDocumentSize().
+            ++_sizeChanges;
+            _sizeChangePending = true;
+            return;
+        }
+
+        // Not holding our lock, the sessions may need it
+        // when handling a command that triggered the callback.
+        for (auto& session : getSessions(intSessionId))
+        {
+            session->loKitCallback(nType, rPayload);
+        }
+    }
+
+    /// Sends the status and page rectangles after the document size
+    /// changed, at most every SizeChangeDebounceMS, on the callback thread.
+    long flushDocumentSize()
+    {
+        if (!_sizeChangePending)
+        {
+            return 0;
+        }
+
+        const long elapsedMS = _lastSizeUpdate.elapsed() / 1000;
+        if (elapsedMS < SizeChangeDebounceMS)
+        {
+            return SizeChangeDebounceMS - elapsedMS;
+        }
+
+        _sizeChangePending = false;
+        _lastSizeUpdate.update();
+        ++_sizeUpdates;
+
+        try
+        {
+            const auto sessions = getSessions(CallbackNotification::AllSessions);
+            if (sessions.empty() || _loKitDocument == nullptr)
+            {
+                return 0;
+            }
+
+            // The status has the current part, which is per view.
+            std::map<int, std::pair<std::string, std::string>> viewUpdates;
+            auto lock = sessions.front()->getLock();
+            for (auto& session : sessions)
+            {
+                auto& update = viewUpdates[session->getViewId()];
+                if (update.first.empty())
+                {
+                    if (_multiView)
+                        _loKitDocument->pClass->setView(_loKitDocument, session->getViewId());
+
+                    update.first = "status: " + LOKitHelper::documentStatus(_loKitDocument);
+                    char* pRectangles = _loKitDocument->pClass->getPartPageRectangles(_loKitDocument);
+                    update.second = "partpagerectangles: " + std::string(pRectangles ? pRectangles : "");
+                    std::free(pRectangles);
                 }
+
+                _unchangedUpdates += session->sendDocumentSize(update.first, update.second);
             }
         }
+        catch (const std::exception& exc)
+        {
+            Log::error("Error while updating the document size: " + std::string(exc.what()));
+        }
+
+        Log::debug() << "Document size changed " << _sizeChanges << " times, "
+                     << (_sizeChanges - _sizeUpdates) << " updates debounced, "
+                     << _unchangedUpdates << " unchanged not sent." << Log::end;
+        return 0;
     }
 
     /// Load a document (or view) and register callbacks.
@@ -424,14 +1209,24 @@ private:
             if ( LIBREOFFICEKIT_HAS(_loKit, registerCallback))
                 _loKit->pClass->registerCallback(_loKit, DocumentCallback, this);
 
+            _jailedUri = uri;
+
             // documentLoad will trigger callback, which needs to take the lock.
             lock.unlock();
+            const auto startTime = std::chrono::steady_clock::now();
             if ((_loKitDocument = _loKit->pClass->documentLoad(_loKit, uri.c_str())) == nullptr)
             {
                 Log::error("Failed to load: " + uri + ", error: " + _loKit->pClass->getError(_loKit));
                 return nullptr;
             }
 
+            // The first one is what the warm up is for, compare with LOOL_NO_WARMUP.
+            Log::info() << "Loaded [" << uri << "] in "
+                        << std::chrono::duration_cast<std::chrono::milliseconds>(
+                               std::chrono::steady_clock::now() - startTime).count()
+                        << " ms, " << (++DocumentsLoaded == 1 ? "first" : "not first") << " document, "
+                        << (std::getenv("LOOL_NO_WARMUP") ? "not warmed up." : "warmed up.") << Log::end;
+
             // Retake the lock.
             lock.lock();
         }
@@ -441,7 +1236,16 @@ private:
             Log::info("Loading view to document from URI: [" + uri + "] for session [" + sessionId + "].");
             const auto viewId = _loKitDocument->pClass->createView(_loKitDocument);
 
-            _loKitDocument->pClass->registerCallback(_loKitDocument, ViewCallback, reinterpret_cast<void*>(intSessionId));
+            // Kept until we go, LOK may still hold it after the view is destroyed.
+            auto& data = _viewCallbackData[intSessionId];
+            if (!data)
+            {
+                data.reset(new ViewCallbackData{ this, intSessionId, viewId });
+            }
+
+            data->_viewId = viewId;
+
+            _loKitDocument->pClass->registerCallback(_loKitDocument, ViewCallback, data.get());
 
             Log::info() << "Document [" << _url << "] view ["
                         << viewId << "] loaded, leaving "
@@ -491,25 +1295,168 @@ private:
     const std::string _url;
 
     LibreOfficeKitDocument *_loKitDocument;
+    /// Where the document was loaded from, in the jail.
+    std::string _jailedUri;
+    /// Whether it has changes to save, as LOK tells.
+    std::atomic<bool> _modified;
 
     std::recursive_mutex _mutex;
     std::map<unsigned, std::shared_ptr<Connection>> _connections;
+    std::map<unsigned, std::unique_ptr<ViewCallbackData>> _viewCallbackData;
     std::atomic<unsigned> _clientViews;
+
+    /// One thread dispatches the callbacks of all the views.
+    NotificationQueue _callbackQueue;
+    /// Those held back while a view renders ahead, see queueCallback().
+    std::mutex _deferredMutex;
+    std::vector<Notification::Ptr> _deferredCallbacks;
+    CallbackWorker _callbackWorker;
+    Thread _callbackThread;
+
+    /// Document size tracking, only touched on the callback thread.
+    bool _sizeChangePending;
+    Poco::Timestamp _lastSizeUpdate;
+    size_t _sizeChanges;
+    size_t _sizeUpdates;
+    size_t _unchangedUpdates;
+
+    static constexpr long SizeChangeDebounceMS = 250;
+
+    /// When to try saving again, after failing to save before unloading.
+    std::chrono::steady_clock::time_point _saveRetryTime;
+    static constexpr int SaveRetryIntervalSecs = 30;
+
+    /// The threads handling the connections, for all the views: one reads
+    /// the sockets, the workers handle the input. The views share the
+    /// LOK mutex, so more workers would mostly wait.
+    std::atomic<bool> _stopWorkers;
+    int _wakeupPipe[2];
+    NotificationQueue _workQueue;
+    Poco::RunnableAdapter<Document> _reader;
+    Poco::RunnableAdapter<Document> _worker;
+    std::atomic<unsigned> _workerCount;
+    Thread _readerThread;
+    Thread _workerThreads[2];
 };
 
-void lokit_main(const std::string &loSubPath, const std::string& jailId, const std::string& pipe)
+/// Loads and renders a small document of each kind, then discards them,
+/// so that the first document we get doesn't pay for the initialization
+/// of the filters, fonts and configuration. We are pre-spawned, so it is
+/// off the path of the load. LOOL_NO_WARMUP skips it, to compare.
+static void warmUp(LibreOfficeKit* loKit)
+{
+    if (std::getenv("LOOL_NO_WARMUP"))
+        return;
+
+    static const std::string header =
+        "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+        "<office:document"
+        " xmlns:office=\"urn:oasis:names:tc:opendocument:xmlns:office:1.0\""
+        " xmlns:text=\"urn:oasis:names:tc:opendocument:xmlns:text:1.0\""
+        " xmlns:table=\"urn:oasis:names:tc:opendocument:xmlns:table:1.0\""
+        " xmlns:draw=\"urn:oasis:names:tc:opendocument:xmlns:drawing:1.0\""
+        " office:version=\"1.2\" office:mimetype=\"application/vnd.oasis.opendocument.";
+
+    // Flat ODF, so that they need not be shipped.
+    static const std::vector<std::pair<std::string, std::string>> documents =
+    {
+        { "fodt", "text\"><office:body><office:text>"
+                  "<text:p>Warm up</text:p>"
+                  "</office:text></office:body></office:document>" },
+        { "fods", "spreadsheet\"><office:body><office:spreadsheet>"
+                  "<table:table table:name=\"Sheet1\"><table:table-row><table:table-cell>"
+                  "<text:p>Warm up</text:p>"
+                  "</table:table-cell></table:table-row></table:table>"
+                  "</office:spreadsheet></office:body></office:document>" },
+        { "fodp", "presentation\"><office:body><office:presentation>"
+                  "<draw:page draw:name=\"Slide1\"><draw:frame><draw:text-box>"
+                  "<text:p>Warm up</text:p>"
+                  "</draw:text-box></draw:frame></draw:page>"
+                  "</office:presentation></office:body></office:document>" }
+    };
+
+    const auto startTime = std::chrono::steady_clock::now();
+    const std::string pid = std::to_string(Process::id());
+    for (const auto& document : documents)
+    {
+        const std::string path = "/tmp/warmup-" + pid + "." + document.first;
+        {
+            std::ofstream file(path);
+            file << header << document.second;
+            if (!file)
+            {
+                Log::warn("Failed to write [" + path + "] to warm up with.");
+                continue;
+            }
+        }
+
+        LibreOfficeKitDocument* loKitDocument = loKit->pClass->documentLoad(loKit, ("file://" + path).c_str());
+        if (loKitDocument != nullptr)
+        {
+            // Render a tile, for the fonts and the drawing.
+            loKitDocument->pClass->initializeForRendering(loKitDocument, nullptr);
+            std::vector<unsigned char> pixmap(4 * 256 * 256);
+            loKitDocument->pClass->paintTile(loKitDocument, pixmap.data(), 256, 256, 0, 0, 3840, 3840);
+            loKitDocument->pClass->destroy(loKitDocument);
+        }
+        else
+        {
+            Log::warn("Failed to load [" + path + "] to warm up with.");
+        }
+
+        std::remove(path.c_str());
+    }
+
+    Log::info() << "Warmed up in "
+                << std::chrono::duration_cast<std::chrono::milliseconds>(
+                       std::chrono::steady_clock::now() - startTime).count()
+                << " ms." << Log::end;
+}
+
+/// Sums our proportional and unique (private) set sizes in kB from
+/// the smaps under the given /proc, the way loolmap does.
+static bool getMemoryUsage(const int procDir, size_t& pssKB, size_t& ussKB)
+{
+    const int fd = (procDir >= 0 ? openat(procDir, "self/smaps", O_RDONLY) : -1);
+    FILE* file = (fd >= 0 ? fdopen(fd, "r") : nullptr);
+    if (file == nullptr)
+    {
+        if (fd >= 0)
+            close(fd);
+        return false;
+    }
+
+    pssKB = 0;
+    ussKB = 0;
+
+    char buffer[4096];
+    char key[21];
+    unsigned long long value;
+    while (fgets(buffer, sizeof(buffer), file))
+    {
+        if (buffer[0] >= 'A' && buffer[0] <= 'Z' &&
+            sscanf(buffer, "%20[^:]: %llu", key, &value) == 2)
+        {
+            if (strcmp(key, "Pss") == 0)
+                pssKB += value;
+            else if (strcmp(key, "Private_Clean") == 0 || strcmp(key, "Private_Dirty") == 0)
+                ussKB += value;
+        }
+    }
+
+    fclose(file);
+    return true;
+}
+
+/// procDir is /proc, opened before the chroot, or -1 when we have none,
+/// in which case we don't report our memory.
+void lokit_main(const std::string &loSubPath, const std::string& jailId, const int procDir)
 {
 #ifdef LOOLKIT_NO_MAIN
     // Reinitialize logging when forked.
     Log::initialize("kit");
 #endif
 
-    struct pollfd aPoll;
-    ssize_t nBytes = -1;
-    char  aBuffer[READ_BUFFER_SIZE];
-    char* pStart = nullptr;
-    char* pEnd = nullptr;
-
     assert(!jailId.empty());
     assert(!loSubPath.empty());
 
@@ -521,6 +1468,10 @@ void lokit_main(const std::string &loSubPath, const std::string& jailId, const s
         Log::error("Cannot set process name to " + process_name + ".");
     Util::setTerminationSignals();
     Util::setFatalSignals();
+
+    // The broker reads its signals from a signalfd, with them blocked,
+    // and we inherit its mask.
+    Util::unblockSignals();
 #endif
     Log::debug("Process [" + process_name + "] started.");
 
@@ -534,18 +1485,12 @@ void lokit_main(const std::string &loSubPath, const std::string& jailId, const s
 
     try
     {
-        int writerBroker;
-        int readerBroker;
-
-        if ( (readerBroker = open(pipe.c_str(), O_RDONLY) ) < 0 )
-        {
-            Log::error("Error: failed to open pipe [" + pipe + "] read only.");
-            exit(Application::EXIT_SOFTWARE);
-        }
-
-        if ( (writerBroker = open(LOKIT_BROKER.c_str(), O_WRONLY) ) < 0 )
+        // Say who we are first thing, the broker waits for it.
+        const std::string pid = std::to_string(Process::id());
+        const int brokerSocket = Util::connectSocket(BROKER_SOCKET_PREFIX + jailId);
+        if (brokerSocket < 0 || !Util::sendMessage(brokerSocket, pid + " hello"))
         {
-            Log::error("Error: failed to open pipe [" + LOKIT_BROKER + "] write only.");
+            Log::error("Error: failed to connect to the broker.");
             exit(Application::EXIT_SOFTWARE);
         }
 
@@ -556,109 +1501,130 @@ void lokit_main(const std::string &loSubPath, const std::string& jailId, const s
             exit(Application::EXIT_SOFTWARE);
         }
 
-        Log::info("loolkit [" + std::to_string(Process::id()) + "] is ready.");
+        warmUp(loKit);
+
+        // Only now are we worth giving a document to.
+        if (!Util::sendMessage(brokerSocket, pid + " ready"))
+        {
+            Log::error("Error: failed to tell the broker we are ready.");
+            exit(Application::EXIT_SOFTWARE);
+        }
 
-        std::string aResponse;
-        std::string aMessage;
+        Log::info("loolkit [" + pid + "] is ready.");
+        if (procDir < 0)
+            Log::warn("No /proc, not reporting the memory used.");
 
-        while (!TerminationFlag)
+        // The broker recycles us when we grow too large.
+        auto lastMemoryReport = std::chrono::steady_clock::now();
+        const auto reportMemory = [&]()
         {
-            if ( pStart == pEnd )
+            lastMemoryReport = std::chrono::steady_clock::now();
+
+            size_t pssKB = 0;
+            size_t ussKB = 0;
+            if (getMemoryUsage(procDir, pssKB, ussKB))
             {
-                aPoll.fd = readerBroker;
-                aPoll.events = POLLIN;
-                aPoll.revents = 0;
+                const std::string aReport = pid + " memory " + std::to_string(pssKB) + " " + std::to_string(ussKB);
+                Log::trace("KitToBroker: " + aReport);
+                Util::sendMessage(brokerSocket, aReport);
+            }
+        };
 
-                if (poll(&aPoll, 1, POLL_TIMEOUT_MS) < 0)
-                {
-                    Log::error("Failed to poll pipe [" + pipe + "].");
-                    continue;
-                }
-                else
-                if (aPoll.revents & (POLLIN | POLLPRI))
-                {
-                    nBytes = Util::readFIFO(readerBroker, aBuffer, sizeof(aBuffer));
-                    if (nBytes < 0)
-                    {
-                        pStart = pEnd = nullptr;
-                        Log::error("Error reading message from pipe [" + pipe + "].");
-                        continue;
-                    }
-                    pStart = aBuffer;
-                    pEnd   = aBuffer + nBytes;
-                }
-                else
-                if (aPoll.revents & (POLLERR | POLLHUP))
-                {
-                    Log::error("Broken pipe [" + pipe + "] with broker.");
-                    break;
-                }
+        // The broker starts us empty, and learns what we host from
+        // the reports of the changes rather than by asking.
+        std::string reportedUrl = "empty";
+        const auto reportUrl = [&]()
+        {
+            for (auto it = _documents.cbegin(); it != _documents.cend(); )
+            {
+                it = (it->second->canDiscard() ? _documents.erase(it) : ++it);
             }
 
-            if ( pStart != pEnd )
+            // We really only support single URL hosting.
+            const std::string url = (_documents.empty() ? "empty" : _documents.cbegin()->first);
+            if (url != reportedUrl)
             {
-                char aChar = *pStart++;
-                while (pStart != pEnd && aChar != '\r' && aChar != '\n')
-                {
-                    aMessage += aChar;
-                    aChar = *pStart++;
-                }
+                // So that the broker knows whether to reuse us.
+                if (url == "empty")
+                    reportMemory();
+
+                const std::string aReport = pid + " url " + url;
+                Log::trace("KitToBroker: " + aReport);
+                if (Util::sendMessage(brokerSocket, aReport))
+                    reportedUrl = url;
+            }
+        };
 
-                if ( aChar == '\r' && *pStart == '\n')
-                {
-                    pStart++;
-                    StringTokenizer tokens(aMessage, " ", StringTokenizer::TOK_IGNORE_EMPTY | StringTokenizer::TOK_TRIM);
-                    aResponse = std::to_string(Process::id()) + " ";
+        Util::MessageReader reader(brokerSocket);
+        std::vector<std::string> messages;
 
-                    Log::trace("Recv: " + aMessage);
-                    if (tokens[0] == "query" && tokens.count() > 1)
-                    {
-                        if (tokens[1] == "url")
-                        {
-                            for (auto it = _documents.cbegin(); it != _documents.cend(); )
-                            {
-                                it = (it->second->canDiscard() ? _documents.erase(it) : ++it);
-                            }
-
-                            if (_documents.empty())
-                            {
-                                aResponse += "empty \r\n";
-                            }
-                            else
-                            {
-                                // We really only support single URL hosting.
-                                aResponse += _documents.cbegin()->first + "\r\n";
-                            }
-                        }
-                    }
-                    else if (tokens[0] == "thread")
-                    {
-                        const std::string& sessionId = tokens[1];
-                        const unsigned intSessionId = Util::decodeId(sessionId);
-                        const std::string& url = tokens[2];
+        struct pollfd aPoll;
+        aPoll.fd = brokerSocket;
+        aPoll.events = POLLIN;
+
+        while (!TerminationFlag)
+        {
+            reportUrl();
 
-                        Log::debug("Thread request for session [" + sessionId + "], url: [" + url + "].");
-                        auto it = _documents.lower_bound(url);
-                        if (it == _documents.end())
-                            it = _documents.emplace_hint(it, url, std::make_shared<Document>(loKit, jailId, url));
+            if (std::chrono::steady_clock::now() - lastMemoryReport >= std::chrono::seconds(MEMORY_REPORT_INTERVAL))
+                reportMemory();
 
-                        it->second->createSession(sessionId, intSessionId);
-                        aResponse += "ok \r\n";
-                    }
-                    else
-                    {
-                        aResponse = "bad \r\n";
-                    }
+            aPoll.revents = 0;
+            if (poll(&aPoll, 1, POLL_TIMEOUT_MS) < 0)
+            {
+                Log::error("Failed to poll socket with broker.");
+                continue;
+            }
+
+            if (aPoll.revents == 0)
+                continue;
+
+            messages.clear();
+            if (!reader.read(messages))
+            {
+                Log::error("Broken socket with broker.");
+                break;
+            }
+
+            // Whole messages, as many as came, each answered with its request id.
+            for (const auto& aMessage : messages)
+            {
+                StringTokenizer tokens(aMessage, " ", StringTokenizer::TOK_IGNORE_EMPTY | StringTokenizer::TOK_TRIM);
+                std::string aResponse = pid + " ";
 
-                    Log::trace("KitToBroker: " + aResponse);
-                    Util::writeFIFO(writerBroker, aResponse);
-                    aMessage.clear();
+                Log::trace("Recv: " + aMessage);
+                if (tokens.count() == 4 && tokens[0] == "thread")
+                {
+                    const auto startTime = std::chrono::steady_clock::now();
+                    const std::string& sessionId = tokens[1];
+                    const unsigned intSessionId = Util::decodeId(sessionId);
+                    const std::string& url = tokens[2];
+                    const std::string& requestId = tokens[3];
+
+                    Log::debug("Thread request [" + requestId + "] for session [" + sessionId + "], url: [" + url + "].");
+                    auto it = _documents.lower_bound(url);
+                    if (it == _documents.end())
+                        it = _documents.emplace_hint(it, url, std::make_shared<Document>(loKit, jailId, url));
+
+                    it->second->createSession(sessionId, intSessionId);
+
+                    // The broker matches the response to the request by
+                    // the id, and logs how long each stage took.
+                    const auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                                        std::chrono::steady_clock::now() - startTime).count();
+                    aResponse += "ok " + requestId + " " + std::to_string(ms);
+                }
+                else
+                {
+                    aResponse += "bad " + (tokens.count() > 3 ? tokens[3] : std::string("0"));
                 }
+
+                Log::trace("KitToBroker: " + aResponse);
+                Util::sendMessage(brokerSocket, aResponse);
             }
         }
 
-        close(writerBroker);
-        close(readerBroker);
+        close(brokerSocket);
     }
     catch (const Exception& exc)
     {
@@ -701,7 +1667,6 @@ int main(int argc, char** argv)
 
     std::string loSubPath;
     std::string jailId;
-    std::string pipe;
 
     for (int i = 1; i < argc; ++i)
     {
@@ -719,17 +1684,27 @@ int main(int argc, char** argv)
             if (*eq)
                 jailId = std::string(++eq);
         }
-        else if (strstr(cmd, "--pipe=") == cmd)
+        else if (strstr(cmd, "--clientport=") == cmd)
         {
             eq = strchrnul(cmd, '=');
             if (*eq)
-                pipe = std::string(++eq);
+                ClientPortNumber = std::stoll(std::string(++eq));
         }
-        else if (strstr(cmd, "--clientport=") == cmd)
+        else if (strstr(cmd, "--sessionidletimeout=") == cmd)
         {
             eq = strchrnul(cmd, '=');
             if (*eq)
-                ClientPortNumber = std::stoll(std::string(++eq));
+                SessionIdleTimeoutSecs = std::stoi(std::string(++eq));
+        }
+        else if (strstr(cmd, "--docidletimeout=") == cmd)
+        {
+            eq = strchrnul(cmd, '=');
+            if (*eq)
+                DocumentIdleTimeoutSecs = std::stoi(std::string(++eq));
+        }
+        else if (strstr(cmd, "--autosave") == cmd)
+        {
+            AutoSave = true;
         }
     }
 
@@ -745,12 +1720,6 @@ int main(int argc, char** argv)
         exit(Application::EXIT_SOFTWARE);
     }
 
-    if ( pipe.empty() )
-    {
-        Log::error("Error: --pipe is empty");
-        exit(Application::EXIT_SOFTWARE);
-    }
-
     try
     {
         Poco::Environment::get("LD_BIND_NOW");
@@ -769,7 +1738,7 @@ int main(int argc, char** argv)
         Log::warn("Note: LOK_VIEW_CALLBACK is not set.");
     }
 
-    lokit_main(loSubPath, jailId, pipe);
+    lokit_main(loSubPath, jailId, -1);
 
     return Application::EXIT_OK;
 }
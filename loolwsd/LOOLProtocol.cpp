@@ -79,6 +79,33 @@ namespace LOOLProtocol
         return true;
     }
 
+    bool getTokenUInt64(const std::string& token, const std::string& name, Poco::UInt64& value)
+    {
+        size_t nextIdx;
+        try
+        {
+            if (token.size() < name.size() + 2 ||
+                token.substr(0, name.size()) != name ||
+                token[name.size()] != '=' ||
+                token[name.size() + 1] == '-' ||
+                (value = std::stoull(token.substr(name.size() + 1), &nextIdx), false) ||
+                nextIdx != token.size() - name.size() - 1)
+            {
+                throw std::invalid_argument("bah");
+            }
+        }
+        catch (std::invalid_argument&)
+        {
+            return false;
+        }
+        catch (std::out_of_range&)
+        {
+            return false;
+        }
+
+        return true;
+    }
+
     bool getTokenString(const std::string& token, const std::string& name, std::string& value)
     {
         try
@@ -13,6 +13,8 @@
 #include <map>
 #include <string>
 
+#include <Poco/Types.h>
+
 #define LOK_USE_UNSTABLE_API
 #include <LibreOfficeKit/LibreOfficeKitEnums.h>
 
@@ -81,6 +83,7 @@ namespace LOOLProtocol
     bool stringToInteger(const std::string& input, int& value);
 	
     bool getTokenInteger(const std::string& token, const std::string& name, int& value);
+    bool getTokenUInt64(const std::string& token, const std::string& name, Poco::UInt64& value);
     bool getTokenString(const std::string& token, const std::string& name, std::string& value);
     bool getTokenKeyword(const std::string& token, const std::string& name, const std::map<std::string, int>& map, int& value);
 
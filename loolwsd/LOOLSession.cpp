@@ -87,6 +87,7 @@ LOOLSession::LOOLSession(const std::string& id, const Kind kind,
     _kindString(kind == Kind::ToClient ? "ToClient" :
                 kind == Kind::ToMaster ? "ToMaster" : "ToPrisoner"),
     _ws(ws),
+    _workload("interactive"),
     _bShutdown(false),
     _disconnected(false)
 {
@@ -171,6 +172,11 @@ void LOOLSession::parseDocOptions(const StringTokenizer& tokens, int& part, std:
             timestamp = tokens[i].substr(strlen("timestamp="));
             ++offset;
         }
+        else if (tokens[i].find("workload=") == 0)
+        {
+            _workload = tokens[i].substr(strlen("workload="));
+            ++offset;
+        }
     }
 
     if (tokens.count() > offset)
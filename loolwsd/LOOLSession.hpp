@@ -106,6 +106,10 @@ protected:
     /// Document options: a JSON string, containing options (rendering, also possibly load in the future).
     std::string _docOptions;
 
+    /// The workload class of the client, which the broker schedules the
+    /// child by: interactive, viewonly or conversion.
+    std::string _workload;
+
     // Flag to stop dispatch chid messages when websocket is shutting down
     bool _bShutdown;
 
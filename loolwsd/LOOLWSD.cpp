@@ -48,14 +48,18 @@ DEALINGS IN THE SOFTWARE.
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/prctl.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
 #endif
 
 #include <ftw.h>
 #include <utime.h>
 
+#include <algorithm>
 #include <cassert>
 #include <cstdlib>
 #include <cstring>
+#include <functional>
 #include <iostream>
 #include <sstream>
 #include <mutex>
@@ -109,6 +113,7 @@ DEALINGS IN THE SOFTWARE.
 #include "ChildProcessSession.hpp"
 #include "LOOLWSD.hpp"
 #include "QueueHandler.hpp"
+#include "TileCache.hpp"
 #include "Util.hpp"
 
 using namespace LOOLProtocol;
@@ -352,7 +357,8 @@ private:
                     const std::string filePrefix("file://");
                     std::string encodedFrom;
                     URI::encode(filePrefix + fromPath, std::string(), encodedFrom);
-                    const std::string load = "load url=" + encodedFrom;
+                    // Behind the clients editing, on a busy server.
+                    const std::string load = "load url=" + encodedFrom + " workload=conversion";
                     session->handleInput(load.data(), load.size());
 
                     // Convert it to the requested format.
@@ -718,20 +724,29 @@ private:
 };
 
 std::atomic<unsigned> LOOLWSD::NextSessionId;
-int LOOLWSD::BrokerWritePipe = -1;
+int LOOLWSD::NumBrokers = 1;
+std::vector<std::shared_ptr<Broker>> LOOLWSD::Brokers;
+std::map<size_t, int> LOOLWSD::BrokerRing;
+std::mutex LOOLWSD::BrokersMutex;
 std::string LOOLWSD::Cache = LOOLWSD_CACHEDIR;
 std::string LOOLWSD::SysTemplate;
 std::string LOOLWSD::LoTemplate;
 std::string LOOLWSD::ChildRoot;
-std::string LOOLWSD::JailId;
 std::string LOOLWSD::LoSubPath = "lo";
 
 int LOOLWSD::NumPreSpawnedChildren = 10;
+int LOOLWSD::MaxPreSpawnedChildren = 0;
+int LOOLWSD::ChildMemoryLimitMB = 0;
+int LOOLWSD::SessionIdleTimeoutSecs = 0;
+int LOOLWSD::DocumentIdleTimeoutSecs = 0;
+bool LOOLWSD::AutoSave = false;
+std::string LOOLWSD::WsdCpus;
+std::string LOOLWSD::Cgroup;
+bool LOOLWSD::PinKits = false;
 bool LOOLWSD::DoTest = false;
 const std::string LOOLWSD::CHILD_URI = "/loolws/child/";
 const std::string LOOLWSD::PIDLOG = "/tmp/loolwsd.pid";
 const std::string LOOLWSD::LOKIT_PIDLOG = "/tmp/lokit.pid";
-const std::string LOOLWSD::FIFO_FILE = "/tmp/loolwsdfifo";
 
 LOOLWSD::LOOLWSD()
 {
@@ -794,11 +809,54 @@ void LOOLWSD::defineOptions(OptionSet& optionSet)
                         .repeatable(false)
                         .argument("relative path"));
 
-    optionSet.addOption(Option("numprespawns", "", "Number of child processes to keep started in advance and waiting for new clients.")
+    optionSet.addOption(Option("numprespawns", "", "Minimum number of child processes to keep started in advance and waiting for new clients.")
                         .required(false)
                         .repeatable(false)
                         .argument("number"));
 
+    optionSet.addOption(Option("maxprespawns", "", "Maximum number of child processes to keep started in advance when the demand is high (default four times numprespawns).")
+                        .required(false)
+                        .repeatable(false)
+                        .argument("number"));
+
+    optionSet.addOption(Option("numbrokers", "", "Number of broker processes, each with its own jail and child processes, the documents are shared out to (default 1).")
+                        .required(false)
+                        .repeatable(false)
+                        .argument("number"));
+
+    optionSet.addOption(Option("childmemlimit", "", "Proportional set size, in MB, above which a child process is not given new documents, and is recycled once its document is closed (default 0, no limit).")
+                        .required(false)
+                        .repeatable(false)
+                        .argument("megabytes"));
+
+    optionSet.addOption(Option("sessionidletimeout", "", "Seconds without input from a client after which its session is disconnected (default 0, never).")
+                        .required(false)
+                        .repeatable(false)
+                        .argument("seconds"));
+
+    optionSet.addOption(Option("docidletimeout", "", "Seconds without input from any client after which a document is unloaded, and its child process reused (default 0, never).")
+                        .required(false)
+                        .repeatable(false)
+                        .argument("seconds"));
+
+    optionSet.addOption(Option("autosave", "", "Save the modified documents when unloading them, on timeout or after the last client is gone.")
+                        .required(false)
+                        .repeatable(false));
+
+    optionSet.addOption(Option("wsdcpus", "", "CPUs to run loolwsd on, like 0-1 or 0,4, which the child processes keep off (default none, all share every CPU).")
+                        .required(false)
+                        .repeatable(false)
+                        .argument("list"));
+
+    optionSet.addOption(Option("pinkits", "", "Pin each child process to a NUMA node, spreading the documents over them.")
+                        .required(false)
+                        .repeatable(false));
+
+    optionSet.addOption(Option("cgroup", "", "An empty cgroup (v2) delegated to the user, under which the child processes are given a CPU weight by workload class: interactive, viewonly and conversion.")
+                        .required(false)
+                        .repeatable(false)
+                        .argument("path"));
+
     optionSet.addOption(Option("test", "", "Interactive testing.")
                         .required(false)
                         .repeatable(false));
@@ -839,6 +897,24 @@ void LOOLWSD::handleOption(const std::string& optionName, const std::string& val
         LoSubPath = value;
     else if (optionName == "numprespawns")
         NumPreSpawnedChildren = std::stoi(value);
+    else if (optionName == "maxprespawns")
+        MaxPreSpawnedChildren = std::stoi(value);
+    else if (optionName == "numbrokers")
+        NumBrokers = std::stoi(value);
+    else if (optionName == "childmemlimit")
+        ChildMemoryLimitMB = std::stoi(value);
+    else if (optionName == "sessionidletimeout")
+        SessionIdleTimeoutSecs = std::stoi(value);
+    else if (optionName == "docidletimeout")
+        DocumentIdleTimeoutSecs = std::stoi(value);
+    else if (optionName == "autosave")
+        AutoSave = true;
+    else if (optionName == "wsdcpus")
+        WsdCpus = value;
+    else if (optionName == "pinkits")
+        PinKits = true;
+    else if (optionName == "cgroup")
+        Cgroup = value;
     else if (optionName == "test")
         LOOLWSD::DoTest = true;
 #if ENABLE_DEBUG
@@ -861,6 +937,38 @@ void LOOLWSD::displayVersion()
     std::cout << LOOLWSD_VERSION << std::endl;
 }
 
+Broker::~Broker()
+{
+    close(_socket);
+}
+
+bool Broker::send(const std::string& message)
+{
+    std::unique_lock<std::mutex> lock(_socketMutex);
+    if (!Util::sendMessage(_socket, message))
+    {
+        Log::error("Error: failed to send [" + message + "] to broker [" + std::to_string(_pid) + "].");
+        return false;
+    }
+
+    return true;
+}
+
+std::shared_ptr<Broker> LOOLWSD::getBroker(const std::string& docURL)
+{
+    std::unique_lock<std::mutex> lock(BrokersMutex);
+    if (BrokerRing.empty())
+        return nullptr;
+
+    // The first point of a shard at or after the hash of the URL, so
+    // that adding shards only moves the documents to the new ones.
+    auto it = BrokerRing.lower_bound(std::hash<std::string>()(docURL));
+    if (it == BrokerRing.end())
+        it = BrokerRing.begin();
+
+    return Brokers[it->second];
+}
+
 Poco::Process::PID LOOLWSD::createBroker(const std::string& rJailId)
 {
     Process::Args args;
@@ -870,7 +978,20 @@ Poco::Process::PID LOOLWSD::createBroker(const std::string& rJailId)
     args.push_back("--lotemplate=" + LoTemplate);
     args.push_back("--childroot=" + ChildRoot);
     args.push_back("--jailid=" + rJailId);
-    args.push_back("--numprespawns=" + std::to_string(NumPreSpawnedChildren));
+    // The children are shared out between the brokers.
+    args.push_back("--numprespawns=" + std::to_string(std::max(1, NumPreSpawnedChildren / NumBrokers)));
+    args.push_back("--maxprespawns=" + std::to_string(std::max(1, MaxPreSpawnedChildren / NumBrokers)));
+    args.push_back("--childmemlimit=" + std::to_string(ChildMemoryLimitMB));
+    args.push_back("--sessionidletimeout=" + std::to_string(SessionIdleTimeoutSecs));
+    args.push_back("--docidletimeout=" + std::to_string(DocumentIdleTimeoutSecs));
+    if (AutoSave)
+        args.push_back("--autosave");
+    if (!WsdCpus.empty())
+        args.push_back("--wsdcpus=" + WsdCpus);
+    if (PinKits)
+        args.push_back("--pinkits");
+    if (!Cgroup.empty())
+        args.push_back("--cgroup=" + Cgroup);
     args.push_back("--clientport=" + std::to_string(ClientPortNumber));
 
     const std::string brokerPath = Path(Application::instance().commandPath()).parent().toString() + "loolbroker";
@@ -883,6 +1004,42 @@ Poco::Process::PID LOOLWSD::createBroker(const std::string& rJailId)
     return child.id();
 }
 
+std::shared_ptr<Broker> LOOLWSD::startBroker(const int shard)
+{
+    const std::string jailId = Util::createRandomDir(ChildRoot);
+
+    // The broker connects to us first thing.
+    const int brokerListenSocket = Util::listenSocket(WSD_SOCKET_PREFIX + jailId);
+    if (brokerListenSocket < 0)
+    {
+        Log::error("Error: failed to listen for broker #" + std::to_string(shard) + ".");
+        Util::removeFile(ChildRoot + jailId, true);
+        return nullptr;
+    }
+
+    const Poco::Process::PID pidBroker = createBroker(jailId);
+    if (pidBroker < 0)
+    {
+        Log::error("Failed to spawn broker #" + std::to_string(shard) + ".");
+        close(brokerListenSocket);
+        Util::removeFile(ChildRoot + jailId, true);
+        return nullptr;
+    }
+
+    const int brokerSocket = Util::acceptSocket(brokerListenSocket, CHILD_TIMEOUT_SECS * 1000);
+    close(brokerListenSocket);
+    if (brokerSocket < 0)
+    {
+        Log::error("Error: broker #" + std::to_string(shard) + " did not connect.");
+        Process::requestTermination(pidBroker);
+        return nullptr;
+    }
+
+    Log::info("Broker #" + std::to_string(shard) + " [" + std::to_string(pidBroker) +
+              "] is up in jail [" + jailId + "].");
+    return std::make_shared<Broker>(pidBroker, jailId, brokerSocket);
+}
+
 int LOOLWSD::main(const std::vector<std::string>& /*args*/)
 {
     Log::initialize("wsd");
@@ -899,6 +1056,9 @@ int LOOLWSD::main(const std::vector<std::string>& /*args*/)
     Util::setTerminationSignals();
     Util::setFatalSignals();
 
+    // Before any thread starts, so that none takes the signals of the main loop.
+    const int signalFd = Util::openSignalFd();
+
     if (access(Cache.c_str(), R_OK | W_OK | X_OK) != 0)
     {
         Log::error("Unable to access cache [" + Cache +
@@ -926,6 +1086,39 @@ int LOOLWSD::main(const std::vector<std::string>& /*args*/)
     if (LOOLWSD::DoTest)
         NumPreSpawnedChildren = 1;
 
+    if (MaxPreSpawnedChildren <= 0)
+        MaxPreSpawnedChildren = NumPreSpawnedChildren * 4;
+    else if (MaxPreSpawnedChildren < NumPreSpawnedChildren)
+        throw IncompatibleOptionsException("maxprespawns");
+
+    if (ChildMemoryLimitMB < 0)
+        throw IncompatibleOptionsException("childmemlimit");
+
+    if (SessionIdleTimeoutSecs < 0)
+        throw IncompatibleOptionsException("sessionidletimeout");
+
+    if (DocumentIdleTimeoutSecs < 0)
+        throw IncompatibleOptionsException("docidletimeout");
+
+    if (NumBrokers < 1)
+        throw IncompatibleOptionsException("numbrokers");
+
+#ifdef __linux
+    // Before any thread starts, they all inherit it. The brokers move
+    // themselves and the kits to the other CPUs.
+    if (!WsdCpus.empty())
+    {
+        cpu_set_t cpus;
+        if (!Util::parseCpuList(WsdCpus, cpus))
+            throw IncompatibleOptionsException("wsdcpus");
+
+        if (sched_setaffinity(0, sizeof(cpus), &cpus) != 0)
+            Log::error("Error: failed to run on CPUs [" + WsdCpus + "].");
+        else
+            Log::info("Running on CPUs [" + WsdCpus + "].");
+    }
+#endif
+
     // log pid information
     {
         Poco::FileOutputStream filePID(LOOLWSD::PIDLOG);
@@ -933,18 +1126,17 @@ int LOOLWSD::main(const std::vector<std::string>& /*args*/)
             filePID << Process::id();
     }
 
-    if (!File(FIFO_FILE).exists() && mkfifo(FIFO_FILE.c_str(), 0666) == -1)
+    // Each shard has points spread around the ring, for an even share.
+    constexpr int RingPointsPerShard = 64;
+    for (int shard = 0; shard < NumBrokers; ++shard)
     {
-        Log::error("Error: Failed to create pipe FIFO [" + FIFO_FILE + "].");
-        return Application::EXIT_SOFTWARE;
-    }
+        const auto broker = startBroker(shard);
+        if (!broker)
+            return Application::EXIT_SOFTWARE;
 
-    JailId = Util::createRandomDir(ChildRoot);
-    const Poco::Process::PID pidBroker = createBroker(JailId);
-    if (pidBroker < 0)
-    {
-        Log::error("Failed to spawn loolBroker.");
-        return Application::EXIT_SOFTWARE;
+        Brokers.push_back(broker);
+        for (int point = 0; point < RingPointsPerShard; ++point)
+            BrokerRing[std::hash<std::string>()(std::to_string(shard) + "#" + std::to_string(point))] = shard;
     }
 
 #ifdef __linux
@@ -982,12 +1174,6 @@ int LOOLWSD::main(const std::vector<std::string>& /*args*/)
 
     srv2.start();
 
-    if ( (BrokerWritePipe = open(FIFO_FILE.c_str(), O_WRONLY) ) < 0 )
-    {
-        Log::error("Error: failed to open pipe [" + FIFO_FILE + "] write only.");
-        return Application::EXIT_SOFTWARE;
-    }
-
     TestInput input(*this, svs, srv);
     Thread inputThread;
     if (LOOLWSD::DoTest)
@@ -996,21 +1182,94 @@ int LOOLWSD::main(const std::vector<std::string>& /*args*/)
         waitForTerminationRequest();
     }
 
+    // The main loop sleeps until a broker exits, we are told to terminate,
+    // or it is time to log the statistics or to retry starting a broker.
+    const int timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    const int epollFd = epoll_create1(EPOLL_CLOEXEC);
+    struct itimerspec statisticsTimer = {};
+    statisticsTimer.it_value.tv_sec = statisticsTimer.it_interval.tv_sec = STATISTICS_INTERVAL;
+    if (signalFd < 0 || timerFd < 0 || epollFd < 0 ||
+        timerfd_settime(timerFd, 0, &statisticsTimer, nullptr) < 0)
+    {
+        Log::error("Error: failed to set up the main loop.");
+        return Application::EXIT_SOFTWARE;
+    }
+
+    for (const int fd : { signalFd, timerFd })
+    {
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.fd = fd;
+        if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) < 0)
+        {
+            Log::error("Error: failed to add descriptor to the main loop.");
+            return Application::EXIT_SOFTWARE;
+        }
+    }
+
     int status = 0;
-    unsigned timeoutCounter = 0;
+    bool brokersMissing = false;
+    std::string lastTileStatistics;
+    std::string lastDispatchStatistics;
     while (!TerminationFlag && !LOOLWSD::DoTest)
     {
-        const pid_t pid = waitpid(-1, &status, WUNTRACED | WNOHANG);
-        if (pid > 0)
+        struct epoll_event events[4];
+        const int count = epoll_wait(epollFd, events, 4, brokersMissing ? MAINTENANCE_INTERVAL * 1000 : -1);
+        if (count < 0 && errno != EINTR)
+            Log::error("Error: epoll_wait failed.");
+
+        bool childExited = false;
+        for (int i = 0; i < count; ++i)
+        {
+            if (events[i].data.fd == signalFd)
+            {
+                childExited |= Util::readSignalFd(signalFd);
+            }
+            else if (events[i].data.fd == timerFd)
+            {
+                uint64_t expirations;
+                if (read(timerFd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+                    Log::error("Error: failed to read the timer.");
+
+                const std::string tileStatistics = TileCache::getStatistics();
+                if (tileStatistics != lastTileStatistics)
+                {
+                    Log::debug("Tile cache hit rates: " + tileStatistics);
+                    lastTileStatistics = tileStatistics;
+                }
+
+                const std::string dispatchStatistics = MasterProcessSession::getDispatchStatistics();
+                if (dispatchStatistics != lastDispatchStatistics)
+                {
+                    Log::debug("Child dispatch: " + dispatchStatistics);
+                    lastDispatchStatistics = dispatchStatistics;
+                }
+            }
+        }
+
+        // Signals coalesce, so reap all that changed.
+        pid_t pid = 0;
+        while (childExited && (pid = waitpid(-1, &status, WUNTRACED | WNOHANG)) > 0)
         {
-            if (pidBroker == pid)
+            int shard = -1;
             {
+                std::unique_lock<std::mutex> lock(BrokersMutex);
+                for (size_t i = 0; i < Brokers.size(); ++i)
+                {
+                    if (Brokers[i] && Brokers[i]->getPid() == pid)
+                        shard = i;
+                }
+            }
+
+            if (shard >= 0)
+            {
+                bool gone = false;
                 if (WIFEXITED(status))
                 {
                     Log::info() << "Child process [" << pid << "] exited with code: "
                                 << WEXITSTATUS(status) << "." << Log::end;
 
-                    break;
+                    gone = true;
                 }
                 else
                 if (WIFSIGNALED(status))
@@ -1024,7 +1283,7 @@ int LOOLWSD::main(const std::vector<std::string>& /*args*/)
                                  << " with " << Util::signalName(WTERMSIG(status))
                                  << " signal. " << Log::end;
 
-                    break;
+                    gone = true;
                 }
                 else if (WIFSTOPPED(status))
                 {
@@ -1042,22 +1301,52 @@ int LOOLWSD::main(const std::vector<std::string>& /*args*/)
                     Log::warn() << "Unknown status returned by waitpid: "
                                 << std::hex << status << "." << Log::end;
                 }
+
+                if (gone)
+                {
+                    // Only the documents of its shard are affected, until
+                    // it is restarted, in a new jail.
+                    Log::error("Broker #" + std::to_string(shard) + " is gone. Restarting it.");
+                    std::unique_lock<std::mutex> lock(BrokersMutex);
+                    Brokers[shard].reset();
+                }
             }
             else
             {
                 Log::error("None of our known child processes died. PID: " + std::to_string(pid));
             }
         }
-        else if (pid < 0)
+
+        if (pid < 0 && errno != ECHILD)
             Log::error("Error: waitpid failed.");
 
-        if (timeoutCounter++ == INTERVAL_PROBES)
+        // Restart the brokers that are gone, or failed to restart before.
+        brokersMissing = false;
+        for (int shard = 0; shard < NumBrokers; ++shard)
         {
-            timeoutCounter = 0;
-            sleep(MAINTENANCE_INTERVAL*2);
+            bool missing;
+            {
+                std::unique_lock<std::mutex> lock(BrokersMutex);
+                missing = !Brokers[shard];
+            }
+
+            if (missing)
+            {
+                const auto broker = startBroker(shard);
+                std::unique_lock<std::mutex> lock(BrokersMutex);
+                Brokers[shard] = broker;
+                brokersMissing |= !broker;
+            }
         }
     }
 
+    close(epollFd);
+    close(timerFd);
+    close(signalFd);
+
+    Log::info("Tile cache hit rates: " + TileCache::getStatistics());
+    Log::info("Child dispatch: " + MasterProcessSession::getDispatchStatistics());
+
     if (LOOLWSD::DoTest)
         inputThread.join();
 
@@ -1069,14 +1358,24 @@ int LOOLWSD::main(const std::vector<std::string>& /*args*/)
     threadPool.joinAll();
 
     // Terminate child processes
-    Util::writeFIFO(LOOLWSD::BrokerWritePipe, "eof\r\n");
-    Log::info("Requesting child process " + std::to_string(pidBroker) + " to terminate");
-    Process::requestTermination(pidBroker);
+    for (const auto& broker : Brokers)
+    {
+        if (!broker)
+            continue;
 
-    // wait broker process finish
-    waitpid(-1, &status, WUNTRACED);
+        broker->send("eof");
+        Log::info("Requesting child process " + std::to_string(broker->getPid()) + " to terminate");
+        Process::requestTermination(broker->getPid());
+    }
+
+    // wait broker processes finish
+    for (const auto& broker : Brokers)
+    {
+        if (broker)
+            waitpid(broker->getPid(), &status, WUNTRACED);
+    }
 
-    close(BrokerWritePipe);
+    Brokers.clear();
 
     Log::info("Cleaning up childroot directory [" + ChildRoot + "].");
     std::vector<std::string> jails;
@@ -13,8 +13,11 @@
 #include "config.h"
 
 #include <string>
+#include <map>
+#include <memory>
 #include <mutex>
 #include <atomic>
+#include <vector>
 
 #include <Poco/Util/OptionSet.h>
 #include <Poco/Random.h>
@@ -49,9 +52,10 @@ public:
         // In that case, we can use a pool and index by publicPath.
         std::unique_lock<std::mutex> lock(DocumentURIMutex);
 
-        // Find the document if already open.
-        auto it = UriToDocumentURIMap.lower_bound(publicFilePath);
-        if (it != UriToDocumentURIMap.end() && it->first == publicFilePath)
+        // Find the document if already open, in the jail of its broker.
+        const auto key = jailRoot + publicFilePath;
+        auto it = UriToDocumentURIMap.lower_bound(key);
+        if (it != UriToDocumentURIMap.end() && it->first == key)
         {
             Log::info("DocumentURI [" + it->first + "] found.");
             return it->second;
@@ -113,7 +117,7 @@ public:
         auto document = std::shared_ptr<DocumentURI>(new DocumentURI(uriPublic, uriJailed, childId));
 
         Log::info("DocumentURI [" + publicFilePath + "] created.");
-        it = UriToDocumentURIMap.emplace_hint(it, publicFilePath, document);
+        it = UriToDocumentURIMap.emplace_hint(it, key, document);
         return it->second;
     }
 
@@ -143,6 +147,35 @@ private:
     const std::string _childId;
 };
 
+/// A broker, with its own jail, pool of children, and socket to us.
+class Broker
+{
+public:
+    Broker(const Poco::Process::PID pid, const std::string& jailId, const int socket) :
+        _pid(pid),
+        _jailId(jailId),
+        _socket(socket)
+    {
+    }
+
+    Broker(const Broker&) = delete;
+    Broker& operator=(const Broker&) = delete;
+
+    ~Broker();
+
+    Poco::Process::PID getPid() const { return _pid; }
+    const std::string& getJailId() const { return _jailId; }
+
+    /// Sends a message to the broker, from any thread.
+    bool send(const std::string& message);
+
+private:
+    const Poco::Process::PID _pid;
+    const std::string _jailId;
+    const int _socket;
+    std::mutex _socketMutex;
+};
+
 class LOOLWSD: public Poco::Util::ServerApplication
 {
 public:
@@ -153,18 +186,24 @@ public:
     // statics
     static std::atomic<unsigned> NextSessionId;
     static int NumPreSpawnedChildren;
-    static int BrokerWritePipe;
+    static int MaxPreSpawnedChildren;
+    static int ChildMemoryLimitMB;
+    static int SessionIdleTimeoutSecs;
+    static int DocumentIdleTimeoutSecs;
+    static bool AutoSave;
+    static std::string WsdCpus;
+    static bool PinKits;
+    static std::string Cgroup;
+    static int NumBrokers;
     static bool DoTest;
     static std::string Cache;
     static std::string SysTemplate;
     static std::string LoTemplate;
     static std::string ChildRoot;
-    static std::string JailId;
     static std::string LoSubPath;
 
     static const std::string CHILD_URI;
     static const std::string PIDLOG;
-    static const std::string FIFO_FILE;
     static const std::string LOKIT_PIDLOG;
 
     static
@@ -173,6 +212,10 @@ public:
         return Util::encodeId(++NextSessionId, 4);
     }
 
+    /// Returns the broker of the shard of a document, by consistent
+    /// hashing of its URL, or nullptr while it is being restarted.
+    static std::shared_ptr<Broker> getBroker(const std::string& docURL);
+
 protected:
     void initialize(Poco::Util::Application& self) override;
     void uninitialize() override;
@@ -184,6 +227,14 @@ private:
     void displayHelp();
     void displayVersion();
     Poco::Process::PID createBroker(const std::string& jailId);
+
+    /// Launches the broker of a shard, in a new jail, and waits for it to connect.
+    std::shared_ptr<Broker> startBroker(const int shard);
+
+    /// The brokers, by shard, and the points of the shards on the hash ring.
+    static std::vector<std::shared_ptr<Broker>> Brokers;
+    static std::map<size_t, int> BrokerRing;
+    static std::mutex BrokersMutex;
 };
 
 #endif
@@ -13,7 +13,10 @@
 #include <cstring>
 #include <fstream>
 #include <iostream>
+#include <map>
 #include <random>
+#include <set>
+#include <sstream>
 
 #include <Poco/Condition.h>
 #include <Poco/Mutex.h>
@@ -112,7 +115,7 @@ public:
                         Log::debug() << "Client got " << n << " bytes: "
                                      << getAbbreviatedMessage(largeBuffer, n) << Log::end;
 #endif
-                        response = getFirstLine(buffer, n);
+                        response = getFirstLine(largeBuffer, n);
                     }
                     else if (tokens[0] == "loolclient")
                     {
@@ -136,6 +139,7 @@ public:
                     else if (response.find("tile:") == 0)
                     {
                         tileCount++;
+                        tileReceived(response);
                     }
                 }
             }
@@ -149,6 +153,25 @@ public:
         Log::debug() << "Got " << tileCount << " tiles" << Log::end;
     }
 
+    /// Notes when a tile was asked for, to measure how long it takes.
+    void tileRequested(const int x, const int y)
+    {
+        Mutex::ScopedLock lock(_tilesMutex);
+        const auto position = std::make_pair(x, y);
+        if (_tilesReceived.find(position) == _tilesReceived.end() &&
+            _tilesRequested.find(position) == _tilesRequested.end())
+        {
+            _tilesRequested.emplace(position, Timestamp());
+        }
+    }
+
+    /// The ms each tile took, from the first request to the first response.
+    std::vector<double> getTileLatencies()
+    {
+        Mutex::ScopedLock lock(_tilesMutex);
+        return _tileLatencies;
+    }
+
     WebSocket& _ws;
     Condition& _cond;
     Mutex& _mutex;
@@ -158,6 +181,34 @@ public:
     int _currentPart;
     int _width;
     int _height;
+
+private:
+    /// Only the first response for a position counts, later ones come from the tile cache.
+    void tileReceived(const std::string& response)
+    {
+        StringTokenizer tokens(response, " ", StringTokenizer::TOK_IGNORE_EMPTY | StringTokenizer::TOK_TRIM);
+        int x = 0;
+        int y = 0;
+        for (size_t i = 1; i < tokens.count(); ++i)
+        {
+            getTokenInteger(tokens[i], "tileposx", x);
+            getTokenInteger(tokens[i], "tileposy", y);
+        }
+
+        Mutex::ScopedLock lock(_tilesMutex);
+        const auto it = _tilesRequested.find(std::make_pair(x, y));
+        if (it != _tilesRequested.end())
+        {
+            _tileLatencies.push_back(it->second.elapsed() / 1000.0);
+            _tilesReceived.insert(it->first);
+            _tilesRequested.erase(it);
+        }
+    }
+
+    Mutex _tilesMutex;
+    std::map<std::pair<int, int>, Timestamp> _tilesRequested;
+    std::set<std::pair<int, int>> _tilesReceived;
+    std::vector<double> _tileLatencies;
 };
 
 class Client: public Runnable
@@ -192,7 +243,7 @@ public:
 private:
     bool clientDurationExceeded()
     {
-        return _clientStartTimestamp.isElapsed(_app.getDuration() * Timespan::HOURS);
+        return _clientStartTimestamp.isElapsed(static_cast<Timespan::TimeDiff>(_app.getDuration() * Timespan::HOURS));
     }
 
     void testDocument(const std::string& document)
@@ -246,6 +297,7 @@ private:
             int x = 0;
             while (!documentStartTimestamp.isElapsed((20 + extra) * Timespan::SECONDS) && !clientDurationExceeded())
             {
+                output.tileRequested(x * DOCTILESIZE, y * DOCTILESIZE);
                 sendTextFrame(ws,
                               "tile part=0 width=256 height=256 "
                               "tileposx=" + std::to_string(x * DOCTILESIZE) + " "
@@ -268,6 +320,7 @@ private:
 
         ws.shutdown();
         thread.join();
+        _app.addTileLatencies(output.getTileLatencies());
     }
 
     void sendTextFrame(WebSocket& ws, const std::string& s)
@@ -299,7 +352,7 @@ unsigned LoadTest::getNumDocsPerClient() const
     return _numDocsPerClient;
 }
 
-unsigned LoadTest::getDuration() const
+double LoadTest::getDuration() const
 {
     return _duration;
 }
@@ -337,7 +390,7 @@ void LoadTest::defineOptions(OptionSet& optionSet)
                         .repeatable(false)
                         .argument("number"));
 
-    optionSet.addOption(Option("duration", "", "duration in hours")
+    optionSet.addOption(Option("duration", "", "duration in hours, like 0.1")
                         .required(false)
                         .repeatable(false)
                         .argument("hours"));
@@ -364,7 +417,7 @@ void LoadTest::handleOption(const std::string& optionName, const std::string& va
     else if (optionName == "numdocs")
         _numDocsPerClient = std::stoi(value);
     else if (optionName == "duration")
-        _duration = std::stoi(value);
+        _duration = std::stod(value);
     else if (optionName == "url")
         _url = value;
 }
@@ -393,9 +446,37 @@ int LoadTest::main(const std::vector<std::string>& /*args*/)
         clients[i]->join();
     }
 
+    std::cout << getTileLatencyStatistics() << std::endl;
+
     return Application::EXIT_OK;
 }
 
+void LoadTest::addTileLatencies(const std::vector<double>& latencies)
+{
+    std::unique_lock<std::mutex> lock(_tileLatenciesMutex);
+    _tileLatencies.insert(_tileLatencies.end(), latencies.begin(), latencies.end());
+}
+
+std::string LoadTest::getTileLatencyStatistics()
+{
+    std::unique_lock<std::mutex> lock(_tileLatenciesMutex);
+    if (_tileLatencies.empty())
+        return "Tile latency: no tiles.";
+
+    std::sort(_tileLatencies.begin(), _tileLatencies.end());
+    double total = 0;
+    for (const auto latency : _tileLatencies)
+        total += latency;
+
+    const auto percentile = [this](const size_t percent)
+                            { return _tileLatencies[(_tileLatencies.size() - 1) * percent / 100]; };
+    std::ostringstream oss;
+    oss << "Tile latency: " << _tileLatencies.size() << " tiles, avg: " << total / _tileLatencies.size()
+        << " ms, median: " << percentile(50) << " ms, 90th: " << percentile(90)
+        << " ms, 99th: " << percentile(99) << " ms, max: " << _tileLatencies.back() << " ms.";
+    return oss.str();
+}
+
 std::vector<std::string> LoadTest::readDocList(const std::string& filename)
 {
     std::vector<std::string> result;
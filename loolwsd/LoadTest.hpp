@@ -10,6 +10,10 @@
 #ifndef INCLUDED_LOADTEST_HPP
 #define INCLUDED_LOADTEST_HPP
 
+#include <mutex>
+#include <string>
+#include <vector>
+
 #include <Poco/Util/Application.h>
 #include <Poco/Util/OptionSet.h>
 
@@ -20,10 +24,13 @@ public:
     ~LoadTest();
 
     unsigned getNumDocsPerClient() const;
-    unsigned getDuration() const;
+    double getDuration() const;
     std::string getURL() const;
     std::vector<std::string> getDocList() const;
 
+    /// Adds the latencies a client measured of the tiles it asked for.
+    void addTileLatencies(const std::vector<double>& latencies);
+
 protected:
     void defineOptions(Poco::Util::OptionSet& options) override;
     void handleOption(const std::string& name, const std::string& value) override;
@@ -33,11 +40,17 @@ protected:
 private:
     std::vector<std::string> readDocList(const std::string& filename);
 
+    /// The count, average and percentiles of the tile latencies.
+    std::string getTileLatencyStatistics();
+
     unsigned _numClients;
     unsigned _numDocsPerClient;
-    unsigned _duration;
+    double _duration;
     std::string _url;
     std::vector<std::string> _docList;
+
+    std::mutex _tileLatenciesMutex;
+    std::vector<double> _tileLatencies;
 };
 
 #endif
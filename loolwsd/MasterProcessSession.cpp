@@ -7,6 +7,10 @@
  * file, You can obtain one at http://mozilla.org/MPL/2.0/.
  */
 
+#include <algorithm>
+#include <climits>
+#include <cstdlib>
+
 #include <Poco/FileStream.h>
 #include <Poco/JSON/Object.h>
 #include <Poco/JSON/Parser.h>
@@ -31,9 +35,47 @@ using Poco::Process;
 using Poco::StringTokenizer;
 using Poco::UInt64;
 
-std::map<std::string, std::shared_ptr<MasterProcessSession>> MasterProcessSession::AvailableChildSessions;
-std::mutex MasterProcessSession::AvailableChildSessionMutex;
-std::condition_variable MasterProcessSession::AvailableChildSessionCV;
+namespace
+{
+    /// Header of a tile: or tilenotmodified: message, with the version
+    /// replacing the one from the request, if any.
+    std::string getTileHeader(const std::string& prefix, const StringTokenizer& tokens, UInt64 version)
+    {
+        std::string header = prefix;
+        for (size_t i = 1; i < tokens.count(); ++i)
+        {
+            if (tokens[i].compare(0, 4, "ver=") != 0)
+                header += " " + tokens[i];
+        }
+
+        return header + " ver=" + std::to_string(version);
+    }
+
+    /// The version the client claims to have, 0 if none.
+    UInt64 getTileVersion(const StringTokenizer& tokens)
+    {
+        UInt64 version = 0;
+        for (size_t i = 8; i < tokens.count(); ++i)
+        {
+            if (getTokenUInt64(tokens[i], "ver", version))
+                break;
+        }
+
+        return version;
+    }
+
+    /// Largest slide image, in pixels, we render for the slideshow.
+    constexpr int MaxSlideSize = 4096;
+}
+
+std::map<std::string, std::promise<std::shared_ptr<MasterProcessSession>>> MasterProcessSession::ChildSessionPromises;
+std::mutex MasterProcessSession::ChildSessionMutex;
+std::mutex MasterProcessSession::DispatchStatisticsMutex;
+size_t MasterProcessSession::DispatchCount = 0;
+size_t MasterProcessSession::DispatchTimeouts = 0;
+double MasterProcessSession::DispatchTotalMS = 0;
+double MasterProcessSession::DispatchMaxMS = 0;
+std::atomic<unsigned> MasterProcessSession::LastRequestId(0);
 
 MasterProcessSession::MasterProcessSession(const std::string& id,
                                            const Kind kind,
@@ -41,7 +83,12 @@ MasterProcessSession::MasterProcessSession(const std::string& id,
     LOOLSession(id, kind, ws),
     _pidChild(0),
     _curPart(0),
-    _loadPart(-1)
+    _loadPart(-1),
+    _viewportPart(-1),
+    _viewportPixelWidth(0),
+    _viewportPixelHeight(0),
+    _viewportTileWidth(0),
+    _viewportTileHeight(0)
 {
     Log::info("MasterProcessSession ctor [" + getName() + "].");
 }
@@ -174,11 +221,66 @@ bool MasterProcessSession::_handleInput(const char *buffer, int length)
                     assert(false);
 
                 assert(firstLine.size() < static_cast<std::string::size_type>(length));
-                peer->_tileCache->saveTile(part, width, height, tilePosX, tilePosY, tileWidth, tileHeight, buffer + firstLine.size() + 1, length - firstLine.size() - 1);
+                const char* data = buffer + firstLine.size() + 1;
+                const size_t size = length - firstLine.size() - 1;
+                const UInt64 version = peer->_tileCache->saveTile(part, width, height, tilePosX, tilePosY, tileWidth, tileHeight, data, size);
+
+                // Prefetched by the kit, only for the cache.
+                if (std::find(tokens.begin(), tokens.end(), "background=true") != tokens.end())
+                    return true;
+
+                // A single tile request echoes the version the client has,
+                // for subscribed tiles we know it ourselves.
+                const UInt64 requestedVersion = getTileVersion(tokens);
+                const UInt64 viewportVersion = peer->updateTileVersion(part, width, height, tilePosX, tilePosY, tileWidth, tileHeight, version);
+                if (version == requestedVersion || version == viewportVersion)
+                {
+                    peer->sendTextFrame(getTileHeader("tilenotmodified:", tokens, version));
+                    return true;
+                }
+
+                const std::string header = getTileHeader("tile:", tokens, version) + "\n";
+                std::vector<char> output;
+                output.reserve(header.size() + size);
+                output.insert(output.end(), header.begin(), header.end());
+                output.insert(output.end(), data, data + size);
+                peer->sendBinaryFrame(output.data(), output.size());
+                return true;
+            }
+            else if (tokens[0] == "loadbundle:")
+            {
+                // Handle the messages in the bundle one by one, to cache
+                // and forward each like when the client asks for them.
+                std::string sizes;
+                if (tokens.count() < 2 || !getTokenString(tokens[1], "sizes", sizes) ||
+                    firstLine.size() >= static_cast<std::string::size_type>(length))
+                {
+                    Log::error(getName() + ": invalid loadbundle: " + firstLine);
+                    return true;
+                }
+
+                const char* message = buffer + firstLine.size() + 1;
+                const char* end = buffer + length;
+                StringTokenizer sizeTokens(sizes, ",", StringTokenizer::TOK_IGNORE_EMPTY | StringTokenizer::TOK_TRIM);
+                for (const auto& sizeToken : sizeTokens)
+                {
+                    const long size = std::strtol(sizeToken.c_str(), nullptr, 10);
+                    if (size <= 0 || size > end - message)
+                    {
+                        Log::error(getName() + ": invalid size in loadbundle: " + firstLine);
+                        break;
+                    }
+
+                    _handleInput(message, size);
+                    message += size;
+                }
+
+                return true;
             }
             else if (tokens[0] == "status:")
             {
                 peer->_tileCache->saveTextFile(std::string(buffer, length), "status.txt");
+                peer->logLoadTime();
             }
             else if (tokens[0] == "commandvalues:")
             {
@@ -216,6 +318,22 @@ bool MasterProcessSession::_handleInput(const char *buffer, int length)
 
                 assert(firstLine.size() == static_cast<std::string::size_type>(length));
                 peer->_tileCache->invalidateTiles(firstLine);
+
+                // Re-render the subscribed tiles before the client hears about it.
+                int part, x, y, width, height;
+                if (tokens.count() == 2 && tokens[1] == "EMPTY")
+                {
+                    peer->refreshViewport(-1, 0, 0, INT_MAX, INT_MAX);
+                }
+                else if (tokens.count() == 6 &&
+                         getTokenInteger(tokens[1], "part", part) &&
+                         getTokenInteger(tokens[2], "x", x) &&
+                         getTokenInteger(tokens[3], "y", y) &&
+                         getTokenInteger(tokens[4], "width", width) &&
+                         getTokenInteger(tokens[5], "height", height))
+                {
+                    peer->refreshViewport(part, x, y, width, height);
+                }
             }
             else if (tokens[0] == "renderfont:")
             {
@@ -255,16 +373,25 @@ bool MasterProcessSession::_handleInput(const char *buffer, int length)
         setId(tokens[2]);
         const Process::PID pidChild = std::stoull(tokens[3]);
 
-        std::unique_lock<std::mutex> lock(AvailableChildSessionMutex);
-        AvailableChildSessions.emplace(getId(), shared_from_this());
-
-        Log::info() << getName() << " mapped " << this << " childId=" << childId << ", id=" << getId()
-                    << " into _availableChildSessions, size=" << AvailableChildSessions.size() << Log::end;
-
         _childId = childId;
         _pidChild = pidChild;
-        lock.unlock();
-        AvailableChildSessionCV.notify_one();
+
+        // Handed directly to the client session waiting for it.
+        std::unique_lock<std::mutex> lock(ChildSessionMutex);
+        const auto it = ChildSessionPromises.find(getId());
+        if (it == ChildSessionPromises.end())
+        {
+            // Its client gave up, or it is for a request already served.
+            Log::warn() << getName() << " childId=" << childId << " connected, but nobody waits for it." << Log::end;
+            sendTextFrame("error: cmd=child kind=unexpected");
+            return false;
+        }
+
+        it->second.set_value(shared_from_this());
+        ChildSessionPromises.erase(it);
+
+        Log::info() << getName() << " handed " << this << " childId=" << childId << ", id=" << getId()
+                    << " to its client, " << ChildSessionPromises.size() << " still waiting." << Log::end;
     }
     else if (_kind == Kind::ToPrisoner)
     {
@@ -305,11 +432,13 @@ bool MasterProcessSession::_handleInput(const char *buffer, int length)
              tokens[0] != "selecttext" &&
              tokens[0] != "setclientpart" &&
              tokens[0] != "setpage" &&
+             tokens[0] != "slideshow" &&
              tokens[0] != "status" &&
              tokens[0] != "tile" &&
              tokens[0] != "tilecombine" &&
              tokens[0] != "unload" &&
-             tokens[0] != "uno")
+             tokens[0] != "uno" &&
+             tokens[0] != "viewport")
     {
         sendTextFrame("error: cmd=" + tokens[0] + " kind=unknown");
         return false;
@@ -321,6 +450,12 @@ bool MasterProcessSession::_handleInput(const char *buffer, int length)
     }
     else if (tokens[0] == "canceltiles")
     {
+        // Whatever was in flight is lost, start the next viewport afresh.
+        {
+            std::unique_lock<std::mutex> lock(_viewportMutex);
+            _viewportTiles.clear();
+        }
+
         if (!_peer.expired())
             forwardToPeer(buffer, length);
     }
@@ -352,6 +487,14 @@ bool MasterProcessSession::_handleInput(const char *buffer, int length)
     {
         sendCombinedTiles(buffer, length, tokens);
     }
+    else if (tokens[0] == "viewport")
+    {
+        return setViewport(tokens);
+    }
+    else if (tokens[0] == "slideshow")
+    {
+        return sendSlides(tokens);
+    }
     else
     {
         // All other commands are such that they always require a
@@ -422,14 +565,19 @@ bool MasterProcessSession::loadDocument(const char* /*buffer*/, int /*length*/,
     std::string timestamp;
     parseDocOptions(tokens, _loadPart, timestamp);
 
+    if (_workload != "interactive" && _workload != "viewonly" && _workload != "conversion")
+    {
+        sendTextFrame("error: cmd=load kind=syntax");
+        return false;
+    }
+
     try
     {
         Poco::URI aUri(_docURL);
 
         // request new URL session
-        const std::string aMessage = "request " + getId() + " " + _docURL + "\r\n";
-        Log::trace("MasterToBroker: " + aMessage);
-        Util::writeFIFO(LOOLWSD::BrokerWritePipe, aMessage);
+        _loadRequestTime = std::chrono::steady_clock::now();
+        requestChild();
     }
     catch (const Poco::SyntaxException&)
     {
@@ -439,6 +587,22 @@ bool MasterProcessSession::loadDocument(const char* /*buffer*/, int /*length*/,
 
     _tileCache.reset(new TileCache(_docURL, timestamp));
 
+    // Push what the document already told earlier clients on load, so
+    // that this one needn't ask. The child sends it again when loaded.
+    const std::string status = _tileCache->getTextFile("status.txt");
+    if (!status.empty())
+    {
+        sendTextFrame(status);
+        for (const auto& fileName : { "partpagerectangles.txt",
+                                      "cmdValues.uno:CharFontName.txt",
+                                      "cmdValues.uno:StyleApply.txt" })
+        {
+            const std::string message = _tileCache->getTextFile(fileName);
+            if (!message.empty())
+                sendTextFrame(message);
+        }
+    }
+
     // Finally, wait for the Child to connect to Master,
     // link the document in jail and dispatch load to child.
     dispatchChild();
@@ -571,16 +735,49 @@ void MasterProcessSession::sendTile(const char *buffer, int length, StringTokeni
         return;
     }
 
-    std::string response = "tile: " + Poco::cat(std::string(" "), tokens.begin() + 1, tokens.end()) + "\n";
+    // Share the cache with clients at (almost) the same zoom and position.
+    // Previews and slides, with an id, are whole parts of any size.
+    std::string request(buffer, length);
+    bool hasId = false;
+    for (size_t i = 8; i < tokens.count(); ++i)
+        hasId |= (tokens[i].find("id=") == 0);
 
-    std::vector<char> output;
-    output.reserve(4 * width * height);
-    output.resize(response.size());
-    std::memcpy(output.data(), response.data(), response.size());
+    if (!hasId && TileCache::normalizeTile(tilePosX, tilePosY, tileWidth, tileHeight))
+    {
+        request = "tile part=" + std::to_string(part) +
+                  " width=" + std::to_string(width) +
+                  " height=" + std::to_string(height) +
+                  " tileposx=" + std::to_string(tilePosX) +
+                  " tileposy=" + std::to_string(tilePosY) +
+                  " tilewidth=" + std::to_string(tileWidth) +
+                  " tileheight=" + std::to_string(tileHeight);
+        for (size_t i = 8; i < tokens.count(); ++i)
+            request += " " + tokens[i];
+    }
+    StringTokenizer requestTokens(request, " ", StringTokenizer::TOK_IGNORE_EMPTY | StringTokenizer::TOK_TRIM);
+
+    // Don't even open the file when the client has it already.
+    const UInt64 version = _tileCache->lookupTileVersion(part, width, height, tilePosX, tilePosY, tileWidth, tileHeight);
+    TileCache::countLookup(width, tileWidth, version != 0);
+    if (version != 0 && version == getTileVersion(requestTokens))
+    {
+        sendTextFrame(getTileHeader("tilenotmodified:", requestTokens, version));
+        return;
+    }
+
+    std::unique_ptr<std::fstream> cachedTile;
+    if (version != 0)
+        cachedTile = _tileCache->lookupTile(part, width, height, tilePosX, tilePosY, tileWidth, tileHeight);
 
-    std::unique_ptr<std::fstream> cachedTile = _tileCache->lookupTile(part, width, height, tilePosX, tilePosY, tileWidth, tileHeight);
     if (cachedTile && cachedTile->is_open())
     {
+        std::string response = getTileHeader("tile:", requestTokens, version) + "\n";
+
+        std::vector<char> output;
+        output.reserve(4 * width * height);
+        output.resize(response.size());
+        std::memcpy(output.data(), response.data(), response.size());
+
         cachedTile->seekg(0, std::ios_base::end);
         size_t pos = output.size();
         std::streamsize size = cachedTile->tellg();
@@ -596,7 +793,7 @@ void MasterProcessSession::sendTile(const char *buffer, int length, StringTokeni
 
     if (_peer.expired())
         dispatchChild();
-    forwardToPeer(buffer, length);
+    forwardToPeer(request.c_str(), request.size());
 }
 
 
@@ -626,12 +823,10 @@ void MasterProcessSession::sendCombinedTiles(const char* /*buffer*/, int /*lengt
         return;
     }
 
-    Util::Rectangle renderArea;
-
     StringTokenizer positionXtokens(tilePositionsX, ",", StringTokenizer::TOK_IGNORE_EMPTY | StringTokenizer::TOK_TRIM);
     StringTokenizer positionYtokens(tilePositionsY, ",", StringTokenizer::TOK_IGNORE_EMPTY | StringTokenizer::TOK_TRIM);
 
-    size_t numberOfPositions = positionYtokens.count();
+    const size_t numberOfPositions = positionXtokens.count();
 
     // check that number of positions for X and Y is the same
     if (numberOfPositions != positionYtokens.count())
@@ -640,8 +835,8 @@ void MasterProcessSession::sendCombinedTiles(const char* /*buffer*/, int /*lengt
         return;
     }
 
-    std::string forwardTileX;
-    std::string forwardTileY;
+    std::vector<std::pair<int, int>> positions;
+    positions.reserve(numberOfPositions);
 
     for (size_t i = 0; i < numberOfPositions; i++)
     {
@@ -658,17 +853,51 @@ void MasterProcessSession::sendCombinedTiles(const char* /*buffer*/, int /*lengt
             return;
         }
 
-        std::unique_ptr<std::fstream> cachedTile = _tileCache->lookupTile(part, pixelWidth, pixelHeight, x, y, tileWidth, tileHeight);
+        TileCache::normalizeTile(x, y, tileWidth, tileHeight);
+        positions.emplace_back(x, y);
+    }
+
+    requestTiles(part, pixelWidth, pixelHeight, positions, tileWidth, tileHeight, true);
+}
+
+void MasterProcessSession::requestTiles(int part, int pixelWidth, int pixelHeight,
+                                        const std::vector<std::pair<int, int>>& positions,
+                                        int tileWidth, int tileHeight, const bool fromClient)
+{
+    std::string forwardTileX;
+    std::string forwardTileY;
+
+    for (const auto& position : positions)
+    {
+        const int x = position.first;
+        const int y = position.second;
+
+        const UInt64 version = _tileCache->lookupTileVersion(part, pixelWidth, pixelHeight, x, y, tileWidth, tileHeight);
+        if (fromClient)
+            TileCache::countLookup(pixelWidth, tileWidth, version != 0);
+
+        std::unique_ptr<std::fstream> cachedTile;
+        if (version != 0)
+            cachedTile = _tileCache->lookupTile(part, pixelWidth, pixelHeight, x, y, tileWidth, tileHeight);
 
         if (cachedTile && cachedTile->is_open())
         {
-            std::string response = "tile: part=" + std::to_string(part) +
+            const std::string fields = "part=" + std::to_string(part) +
                                " width=" + std::to_string(pixelWidth) +
                                " height=" + std::to_string(pixelHeight) +
                                " tileposx=" + std::to_string(x) +
                                " tileposy=" + std::to_string(y) +
                                " tilewidth=" + std::to_string(tileWidth) +
-                               " tileheight=" + std::to_string(tileHeight) + "\n";
+                               " tileheight=" + std::to_string(tileHeight) +
+                               " ver=" + std::to_string(version);
+
+            if (updateTileVersion(part, pixelWidth, pixelHeight, x, y, tileWidth, tileHeight, version) == version)
+            {
+                sendTextFrame("tilenotmodified: " + fields);
+                continue;
+            }
+
+            std::string response = "tile: " + fields + "\n";
 
             std::vector<char> output;
             output.reserve(4 * pixelWidth * pixelHeight);
@@ -713,56 +942,369 @@ void MasterProcessSession::sendCombinedTiles(const char* /*buffer*/, int /*lengt
     forwardToPeer(forward.c_str(), forward.size());
 }
 
-void MasterProcessSession::dispatchChild()
+bool MasterProcessSession::setViewport(StringTokenizer& tokens)
 {
-    short nRequest = 3;
-    bool  bFound = false;
+    int part, pixelWidth, pixelHeight, tileWidth, tileHeight, x, y, viewWidth, viewHeight;
 
-    if (_bShutdown)
-        return;
+    if (tokens.count() < 10 || tokens.count() > 11 ||
+        !getTokenInteger(tokens[1], "part", part) ||
+        !getTokenInteger(tokens[2], "width", pixelWidth) ||
+        !getTokenInteger(tokens[3], "height", pixelHeight) ||
+        !getTokenInteger(tokens[4], "tilewidth", tileWidth) ||
+        !getTokenInteger(tokens[5], "tileheight", tileHeight) ||
+        !getTokenInteger(tokens[6], "x", x) ||
+        !getTokenInteger(tokens[7], "y", y) ||
+        !getTokenInteger(tokens[8], "viewwidth", viewWidth) ||
+        !getTokenInteger(tokens[9], "viewheight", viewHeight))
+    {
+        sendTextFrame("error: cmd=viewport kind=syntax");
+        return false;
+    }
 
-    // Wait until the child has connected with Master.
-    std::shared_ptr<MasterProcessSession> childSession;
-    std::unique_lock<std::mutex> lock(AvailableChildSessionMutex);
+    if (part < 0 || pixelWidth <= 0 || pixelHeight <= 0 ||
+        tileWidth <= 0 || tileHeight <= 0 ||
+        x < 0 || y < 0 || viewWidth <= 0 || viewHeight <= 0)
+    {
+        sendTextFrame("error: cmd=viewport kind=invalid");
+        return false;
+    }
 
-    Log::debug() << "Waiting for a child session permission for thread [" << getId() << "]." << Log::end;
-    while (nRequest-- && !bFound)
+    // Snap to the canonical zoom, the cache only knows about aligned tiles,
+    // and the grid starts from the tile the view origin falls into.
+    TileCache::normalizeZoom(tileWidth, tileHeight);
+    const int firstX = x - x % tileWidth;
+    const int firstY = y - y % tileHeight;
+    const long columns = (static_cast<long>(x) + viewWidth - firstX + tileWidth - 1) / tileWidth;
+    const long rows = (static_cast<long>(y) + viewHeight - firstY + tileHeight - 1) / tileHeight;
+    if (columns * rows > MAX_VIEWPORT_TILES)
     {
-        AvailableChildSessionCV.wait_for(
-            lock,
-            std::chrono::milliseconds(2000),
-            [&bFound, this]
+        sendTextFrame("error: cmd=viewport kind=invalid");
+        return false;
+    }
+
+    // The versions the client has of the tiles in the grid, row by row.
+    std::vector<UInt64> versions;
+    if (tokens.count() == 11)
+    {
+        std::string versionList;
+        if (!getTokenString(tokens[10], "ver", versionList))
+        {
+            sendTextFrame("error: cmd=viewport kind=syntax");
+            return false;
+        }
+
+        StringTokenizer versionTokens(versionList, ",", StringTokenizer::TOK_IGNORE_EMPTY | StringTokenizer::TOK_TRIM);
+        if (static_cast<long>(versionTokens.count()) != columns * rows)
+        {
+            sendTextFrame("error: cmd=viewport kind=invalid");
+            return false;
+        }
+
+        for (const auto& versionToken : versionTokens)
+        {
+            UInt64 version;
+            if (!getTokenUInt64("ver=" + versionToken, "ver", version))
             {
-                return (bFound = AvailableChildSessions.find(getId()) != AvailableChildSessions.end());
-            });
+                sendTextFrame("error: cmd=viewport kind=syntax");
+                return false;
+            }
+            versions.push_back(version);
+        }
+    }
+
+    std::vector<std::pair<int, int>> missing;
+    {
+        std::unique_lock<std::mutex> lock(_viewportMutex);
+
+        if (part != _viewportPart ||
+            pixelWidth != _viewportPixelWidth || pixelHeight != _viewportPixelHeight ||
+            tileWidth != _viewportTileWidth || tileHeight != _viewportTileHeight)
+        {
+            // Different part or zoom level, nothing we sent is of use.
+            _viewportTiles.clear();
+            _viewportPart = part;
+            _viewportPixelWidth = pixelWidth;
+            _viewportPixelHeight = pixelHeight;
+            _viewportTileWidth = tileWidth;
+            _viewportTileHeight = tileHeight;
+        }
+
+        std::map<std::pair<int, int>, UInt64> tiles;
+        for (long row = 0; row < rows; ++row)
+        {
+            for (long column = 0; column < columns; ++column)
+            {
+                const auto position = std::make_pair(firstX + static_cast<int>(column) * tileWidth,
+                                                      firstY + static_cast<int>(row) * tileHeight);
+                const auto it = _viewportTiles.find(position);
+                if (it != _viewportTiles.end())
+                {
+                    tiles.insert(*it);
+                    continue;
+                }
+
+                // Revalidate what the client has, eg. after reconnecting.
+                const UInt64 version = (versions.empty() ? 0 : versions[row * columns + column]);
+                tiles.emplace(position, version);
+                const UInt64 cached = _tileCache->lookupTileVersion(part, pixelWidth, pixelHeight,
+                                                                    position.first, position.second,
+                                                                    tileWidth, tileHeight);
+                TileCache::countLookup(pixelWidth, tileWidth, cached != 0);
+                if (version == 0 || version != cached)
+                {
+                    missing.push_back(position);
+                }
+            }
+        }
+
+        // Tiles that scrolled out are forgotten: the client may drop them.
+        _viewportTiles.swap(tiles);
+    }
+
+    Log::trace() << getName() << ": viewport of " << columns << "x" << rows
+                 << " tiles, " << missing.size() << " to send." << Log::end;
+
+    // The kit prefetches the adjacent parts at this zoom and size.
+    const std::string forward = "viewport part=" + std::to_string(part) +
+                                " width=" + std::to_string(pixelWidth) +
+                                " height=" + std::to_string(pixelHeight) +
+                                " tilewidth=" + std::to_string(tileWidth) +
+                                " tileheight=" + std::to_string(tileHeight) +
+                                " x=" + std::to_string(x) +
+                                " y=" + std::to_string(y) +
+                                " viewwidth=" + std::to_string(viewWidth) +
+                                " viewheight=" + std::to_string(viewHeight);
+    forwardToPeer(forward.c_str(), forward.size());
+
+    if (!missing.empty())
+        requestTiles(part, pixelWidth, pixelHeight, missing, tileWidth, tileHeight, false);
+
+    return true;
+}
+
+bool MasterProcessSession::sendSlides(StringTokenizer& tokens)
+{
+    int part, width, height;
+
+    if (tokens.count() < 4 ||
+        !getTokenInteger(tokens[1], "part", part) ||
+        !getTokenInteger(tokens[2], "width", width) ||
+        !getTokenInteger(tokens[3], "height", height))
+    {
+        sendTextFrame("error: cmd=slideshow kind=syntax");
+        return false;
+    }
+
+    // The slide size and count, from the last status of the document.
+    int parts = 0;
+    int slideWidth = 0;
+    int slideHeight = 0;
+    StringTokenizer statusTokens(_tileCache->getTextFile("status.txt"), " \n",
+                                 StringTokenizer::TOK_IGNORE_EMPTY | StringTokenizer::TOK_TRIM);
+    for (const auto& token : statusTokens)
+    {
+        if (!getTokenInteger(token, "parts", parts) &&
+            !getTokenInteger(token, "width", slideWidth))
+        {
+            getTokenInteger(token, "height", slideHeight);
+        }
+    }
+
+    if (part < 0 || part >= parts ||
+        width <= 0 || width > MaxSlideSize ||
+        height <= 0 || height > MaxSlideSize ||
+        slideWidth <= 0 || slideHeight <= 0)
+    {
+        sendTextFrame("error: cmd=slideshow kind=invalid");
+        return false;
+    }
+
+    // Fit the slide into the screen, keeping its ratio.
+    if (static_cast<long>(width) * slideHeight > static_cast<long>(height) * slideWidth)
+        width = std::max(1L, static_cast<long>(slideWidth) * height / slideHeight);
+    else
+        height = std::max(1L, static_cast<long>(slideHeight) * width / slideWidth);
+
+    // Whole slides are cached as single tiles, so invalidations drop them as usual.
+    for (const int slide : { part, part + 1, part - 1 })
+    {
+        if (slide < 0 || slide >= parts)
+            continue;
+
+        const std::string request = "tile part=" + std::to_string(slide) +
+                                    " width=" + std::to_string(width) +
+                                    " height=" + std::to_string(height) +
+                                    " tileposx=0 tileposy=0" +
+                                    " tilewidth=" + std::to_string(slideWidth) +
+                                    " tileheight=" + std::to_string(slideHeight) +
+                                    " id=slideshow";
+        if (slide == part)
+        {
+            StringTokenizer requestTokens(request, " ", StringTokenizer::TOK_IGNORE_EMPTY | StringTokenizer::TOK_TRIM);
+            sendTile(request.c_str(), request.size(), requestTokens);
+        }
+        else if (_tileCache->lookupTileVersion(slide, width, height, 0, 0, slideWidth, slideHeight) == 0)
+        {
+            // Rendered ahead, the child's reply only goes to the cache.
+            const std::string background = request + " background=true";
+            if (_peer.expired())
+                dispatchChild();
+            forwardToPeer(background.c_str(), background.size());
+        }
+    }
+
+    return true;
+}
 
-        if (!bFound)
+UInt64 MasterProcessSession::updateTileVersion(int part, int pixelWidth, int pixelHeight,
+                                               int x, int y, int tileWidth, int tileHeight,
+                                               UInt64 version)
+{
+    std::unique_lock<std::mutex> lock(_viewportMutex);
+
+    if (part != _viewportPart ||
+        pixelWidth != _viewportPixelWidth || pixelHeight != _viewportPixelHeight ||
+        tileWidth != _viewportTileWidth || tileHeight != _viewportTileHeight)
+    {
+        return 0;
+    }
+
+    const auto it = _viewportTiles.find(std::make_pair(x, y));
+    if (it == _viewportTiles.end())
+        return 0;
+
+    const UInt64 previous = it->second;
+    it->second = version;
+    return previous;
+}
+
+void MasterProcessSession::refreshViewport(int part, int x, int y, int width, int height)
+{
+    const Util::Rectangle invalidated(x, y, width, height);
+
+    std::vector<std::pair<int, int>> stale;
+    int pixelWidth, pixelHeight, tileWidth, tileHeight;
+    {
+        std::unique_lock<std::mutex> lock(_viewportMutex);
+
+        if (_viewportTiles.empty() || (part >= 0 && part != _viewportPart))
+            return;
+
+        for (const auto& it : _viewportTiles)
         {
-            Log::info() << "Retrying child permission... " << nRequest << Log::end;
-            // request again new URL session
-            const std::string aMessage = "request " + getId() + " " + _docURL + "\r\n";
-            Log::trace("MasterToBroker: " + aMessage);
-            Util::writeFIFO(LOOLWSD::BrokerWritePipe, aMessage);
+            const Util::Rectangle tile(it.first.first, it.first.second, _viewportTileWidth, _viewportTileHeight);
+            if (invalidated.intersects(tile))
+                stale.push_back(it.first);
         }
+
+        part = _viewportPart;
+        pixelWidth = _viewportPixelWidth;
+        pixelHeight = _viewportPixelHeight;
+        tileWidth = _viewportTileWidth;
+        tileHeight = _viewportTileHeight;
     }
 
-    if (bFound)
+    // Re-rendering after invalidations, not lookups by the client.
+    if (!stale.empty())
+        requestTiles(part, pixelWidth, pixelHeight, stale, tileWidth, tileHeight, false);
+}
+
+void MasterProcessSession::requestChild()
+{
     {
-        Log::debug("Waiting child session permission, done!");
-        childSession = AvailableChildSessions[getId()];
-        AvailableChildSessions.erase(getId());
+        std::unique_lock<std::mutex> lock(ChildSessionMutex);
+        if (ChildSessionPromises.find(getId()) == ChildSessionPromises.end())
+            _childSession = ChildSessionPromises[getId()].get_future();
     }
 
-    lock.unlock();
+    // The id tells the requests apart, in the logs of the broker and the kit.
+    const std::string aMessage = "request " + getId() + " " + _docURL + " " +
+                                 std::to_string(++LastRequestId) + " " + _workload;
+    Log::trace("MasterToBroker: " + aMessage);
+
+    const auto broker = LOOLWSD::getBroker(_docURL);
+    if (broker)
+        broker->send(aMessage);
+    else
+        Log::error("No broker for [" + _docURL + "] now.");
+}
 
-    if (nRequest < 0 && !bFound)
+void MasterProcessSession::logLoadTime()
+{
+    if (_loadRequestTime == std::chrono::steady_clock::time_point())
+        return;
+
+    const auto now = std::chrono::steady_clock::now();
+    const auto ms = [](const std::chrono::steady_clock::duration duration)
+                    { return std::chrono::duration_cast<std::chrono::milliseconds>(duration).count(); };
+    Log::info() << getName() << " opened [" << _docURL << "] in " << ms(now - _loadRequestTime)
+                << " ms: " << ms(_childConnectTime - _loadRequestTime) << " ms to get a kit, "
+                << ms(now - _childConnectTime) << " ms to load." << Log::end;
+
+    // Only the first status: is for the load.
+    _loadRequestTime = std::chrono::steady_clock::time_point();
+}
+
+std::string MasterProcessSession::getDispatchStatistics()
+{
+    std::unique_lock<std::mutex> lock(DispatchStatisticsMutex);
+    std::ostringstream oss;
+    oss << DispatchCount << " dispatched, avg: " << (DispatchCount > 0 ? DispatchTotalMS / DispatchCount : 0)
+        << " ms, max: " << DispatchMaxMS << " ms, timed out: " << DispatchTimeouts << ".";
+    return oss.str();
+}
+
+void MasterProcessSession::dispatchChild()
+{
+    if (_bShutdown)
+        return;
+
+    // No request in flight, e.g. when we lost the child.
+    if (!_childSession.valid())
+        requestChild();
+
+    // Wait until the child has connected with Master. The broker
+    // holds the request until it has a kit for it, spawning more
+    // if needed, so one request is enough.
+    const auto startTime = std::chrono::steady_clock::now();
+
+    Log::debug() << "Waiting for a child session for thread [" << getId() << "]." << Log::end;
+    _childSession.wait_for(std::chrono::seconds(CHILD_TIMEOUT_SECS));
+
+    if (_childSession.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+    {
+        // Late children find nobody waiting. It may have made it meanwhile though.
+        std::unique_lock<std::mutex> lock(ChildSessionMutex);
+        ChildSessionPromises.erase(getId());
+    }
+
+    const auto ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - startTime).count();
+    if (_childSession.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
     {
-        Log::error(getName() + ": Failed to connect to child. Shutting down socket.");
+        {
+            std::unique_lock<std::mutex> lock(DispatchStatisticsMutex);
+            ++DispatchTimeouts;
+        }
+
+        _childSession = std::future<std::shared_ptr<MasterProcessSession>>();
+        Log::error() << getName() << ": Failed to connect to child in " << ms << " ms. Shutting down socket." << Log::end;
         Util::shutdownWebSocket(_ws);
         return;
     }
 
-    const auto jailRoot = Poco::Path(LOOLWSD::ChildRoot, LOOLWSD::JailId);
+    _childConnectTime = std::chrono::steady_clock::now();
+    const auto childSession = _childSession.get();
+    {
+        std::unique_lock<std::mutex> lock(DispatchStatisticsMutex);
+        ++DispatchCount;
+        DispatchTotalMS += ms;
+        DispatchMaxMS = std::max(DispatchMaxMS, ms);
+    }
+
+    Log::debug() << "Child session for thread [" << getId() << "] connected after " << ms << " ms." << Log::end;
+
+    // The children of a broker share its jail.
+    const auto jailRoot = Poco::Path(LOOLWSD::ChildRoot, childSession->_childId);
     const auto childId = std::to_string(childSession->_pidChild);
 
     auto document = DocumentURI::create(_docURL, jailRoot.toString(), childId);
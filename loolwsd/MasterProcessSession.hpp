@@ -11,7 +11,14 @@
 #define INCLUDED_MASTERPROCESSSESSION_HPP
 
 
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <map>
+#include <mutex>
+
 #include <Poco/Random.h>
+#include <Poco/Types.h>
 
 #include "LOOLSession.hpp"
 #include "TileCache.hpp"
@@ -41,6 +48,9 @@ public:
      */
     std::string getSaveAs();
 
+    /// How long the client sessions waited for their kit to connect.
+    static std::string getDispatchStatistics();
+
  protected:
     bool invalidateTiles(const char *buffer, int length, Poco::StringTokenizer& tokens);
 
@@ -52,9 +62,40 @@ public:
 
     virtual void sendFontRendering(const char *buffer, int length, Poco::StringTokenizer& tokens) override;
 
+    /// Subscribe to the tiles covering the client's visible area.
+    bool setViewport(Poco::StringTokenizer& tokens);
+
+    /// Send a whole slide for the slideshow, and have the
+    /// adjacent ones rendered into the cache meanwhile.
+    bool sendSlides(Poco::StringTokenizer& tokens);
+
+    /// Re-request the subscribed tiles intersecting an invalidated area.
+    /// A negative part invalidates all parts.
+    void refreshViewport(int part, int x, int y, int width, int height);
+
+    /// Record that the client gets the given version of a subscribed tile.
+    /// Returns the version it had before, 0 if none or not subscribed.
+    Poco::UInt64 updateTileVersion(int part, int pixelWidth, int pixelHeight,
+                                   int x, int y, int tileWidth, int tileHeight,
+                                   Poco::UInt64 version);
+
+    /// Send cached tiles, and forward a tilecombine to the child for the rest.
+    /// Only the lookups fromClient count for the hit rates.
+    void requestTiles(int part, int pixelWidth, int pixelHeight,
+                      const std::vector<std::pair<int, int>>& positions,
+                      int tileWidth, int tileHeight, bool fromClient);
+
+    /// Asks the broker for a kit for the document, with a new request id,
+    /// and gets ready for its session to connect, if not already.
+    void requestChild();
+
     void dispatchChild();
     void forwardToPeer(const char *buffer, int length);
 
+    /// Log how long the stages of opening the document took,
+    /// once the first status: for it came back.
+    void logLoadTime();
+
     // If _kind==ToPrisoner and the child process has started and completed its handshake with the
     // parent process: Points to the WebSocketSession for the child process handling the document in
     // question, if any.
@@ -64,11 +105,20 @@ public:
     // per document being edited (i.e., per child process).
     std::weak_ptr<MasterProcessSession> _peer;
 
-    // Sessions to pre-spawned child processes that have connected but are not yet assigned a
-    // document to work on.
-    static std::map<std::string, std::shared_ptr<MasterProcessSession>> AvailableChildSessions;
-    static std::mutex AvailableChildSessionMutex;
-    static std::condition_variable AvailableChildSessionCV;
+    // The promises of a session to a child process, by the id of the client session that
+    // requested it, fulfilled by that session when it connects.
+    static std::map<std::string, std::promise<std::shared_ptr<MasterProcessSession>>> ChildSessionPromises;
+    static std::mutex ChildSessionMutex;
+
+    /// The waits for the kits, in ms, and the ones that timed out.
+    static std::mutex DispatchStatisticsMutex;
+    static size_t DispatchCount;
+    static size_t DispatchTimeouts;
+    static double DispatchTotalMS;
+    static double DispatchMaxMS;
+
+    /// The last id of the requests to the broker.
+    static std::atomic<unsigned> LastRequestId;
 
     std::unique_ptr<TileCache> _tileCache;
 
@@ -86,8 +136,24 @@ private:
     Poco::Process::PID _pidChild;
     int _curPart;
     int _loadPart;
+    /// When the load was requested, and the kit connected for it.
+    std::chrono::steady_clock::time_point _loadRequestTime;
+    std::chrono::steady_clock::time_point _childConnectTime;
+    /// The session to the child process requested, until it connects.
+    std::future<std::shared_ptr<MasterProcessSession>> _childSession;
     /// Kind::ToClient instances store URLs of completed 'save as' documents.
     MessageQueue _saveAsQueue;
+
+    /// The tile grid of the last 'viewport' message, and the positions
+    /// of the tiles in it that were requested, with the version the client
+    /// has of them (0 when it has none yet).
+    std::mutex _viewportMutex;
+    int _viewportPart;
+    int _viewportPixelWidth;
+    int _viewportPixelHeight;
+    int _viewportTileWidth;
+    int _viewportTileHeight;
+    std::map<std::pair<int, int>, Poco::UInt64> _viewportTiles;
 };
 
 #endif
@@ -10,6 +10,7 @@
 #include "MessageQueue.hpp"
 
 #include <algorithm>
+#include <chrono>
 
 MessageQueue::~MessageQueue()
 {
@@ -31,6 +32,16 @@ std::string MessageQueue::get()
     return get_impl();
 }
 
+bool MessageQueue::get(std::string& value, const unsigned timeoutMs)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    if (!_cv.wait_for(lock, std::chrono::milliseconds(timeoutMs), [this] { return wait_impl(); }))
+        return false;
+
+    value = get_impl();
+    return true;
+}
+
 void MessageQueue::clear()
 {
     std::unique_lock<std::mutex> lock(_mutex);
@@ -75,7 +86,9 @@ void BasicTileQueue::put_impl(const std::string& value)
                     {
                         // must not remove the tiles with 'id=', they are special, used
                         // eg. for previews etc.
-                        return (v.compare(0, 5, "tile ") == 0) && (v.find("id=") == std::string::npos);
+                        // a pending viewport is superseded by the one following the cancel
+                        return ((v.compare(0, 5, "tile ") == 0) && (v.find("id=") == std::string::npos)) ||
+                               (v.compare(0, 9, "viewport ") == 0);
                     }
                     ),
                 _queue.end());
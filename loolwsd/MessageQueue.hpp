@@ -35,6 +35,10 @@ public:
     /// Thread safe obtaining of the message.
     std::string get();
 
+    /// Thread safe obtaining of the message, waiting at most timeoutMs.
+    /// Returns false when no message arrived in time.
+    bool get(std::string& value, unsigned timeoutMs);
+
     /// Thread safe removal of all the pending messages.
     void clear();
 
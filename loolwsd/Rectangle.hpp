@@ -10,6 +10,7 @@
 #ifndef INCLUDED_RECTANGLE_HPP
 #define INCLUDED_RECTANGLE_HPP
 
+#include <algorithm>
 #include <limits>
 
 namespace Util
@@ -73,6 +74,14 @@ struct Rectangle
     {
         return _x1 <= _x2 && _y1 <= _y2;
     }
+
+    /// True when the two rectangles overlap or touch, matching the
+    /// semantics of TileCache::intersectsTile().
+    bool intersects(const Rectangle& rectangle) const
+    {
+        return std::max(_x1, rectangle._x1) <= std::min(_x2, rectangle._x2) &&
+               std::max(_y1, rectangle._y1) <= std::min(_y2, rectangle._y2);
+    }
 };
 
 }
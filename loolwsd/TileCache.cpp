@@ -11,7 +11,9 @@
 
 #include <cassert>
 #include <climits>
+#include <cmath>
 #include <cstdio>
+#include <cstdlib>
 #include <fstream>
 #include <iostream>
 #include <memory>
@@ -44,6 +46,67 @@ using Poco::URI;
 
 using namespace LOOLProtocol;
 
+/// Forget the versions past this many tile areas; it only costs revalidations.
+static constexpr size_t MaxTileVersions = 100000;
+
+/// The zoom levels of loleaflet: a 256 pixel tile covers 3000 twips at
+/// zoom 10, and each level scales that by 1.2. Larger tiles cover
+/// proportionally more, and HiDPI clients render any of them at a
+/// multiple of the pixels for the same twips.
+static constexpr double CanonicalTileTwips = 3000;
+static constexpr double CanonicalTileSize = 256;
+static constexpr int CanonicalTileSizes[] = { 256, 512, 1024 };
+static constexpr double CanonicalZoomFactor = 1.2;
+static constexpr int CanonicalDefaultZoom = 10;
+static constexpr int CanonicalMinZoom = 1;
+static constexpr int CanonicalMaxZoom = 20;
+
+std::map<std::string, TileCache::TileVersion> TileCache::TileVersions;
+std::mutex TileCache::TileVersionsMutex;
+Poco::UInt64 TileCache::LastTileVersion = Timestamp().epochMicroseconds();
+std::map<std::pair<int, int>, std::pair<Poco::UInt64, Poco::UInt64>> TileCache::ZoomStatistics;
+std::mutex TileCache::ZoomStatisticsMutex;
+
+namespace
+{
+    /// Snaps the tile size to the nearest canonical zoom level, when less
+    /// than half a level off, like loleaflet rounds the zoom of a tile it
+    /// receives, and returns the level, or -1 if it is further off. The
+    /// pixel size doesn't matter, it only sets the resolution.
+    int snapZoom(int& twips)
+    {
+        const double maxDistance = std::log(CanonicalZoomFactor) / 2;
+        double bestDistance = maxDistance;
+        int bestTwips = twips;
+        int bestZoom = -1;
+        for (const int tileSize : CanonicalTileSizes)
+        {
+            for (int zoom = CanonicalMinZoom; zoom <= CanonicalMaxZoom; ++zoom)
+            {
+                const int canonical = std::round(CanonicalTileTwips * tileSize / CanonicalTileSize *
+                                                 std::pow(CanonicalZoomFactor, CanonicalDefaultZoom - zoom));
+                const double distance = std::abs(std::log(static_cast<double>(twips) / canonical));
+                if (distance < bestDistance)
+                {
+                    bestDistance = distance;
+                    bestTwips = canonical;
+                    bestZoom = zoom;
+                }
+            }
+        }
+
+        twips = bestTwips;
+        return bestZoom;
+    }
+
+    /// Aligns the position to the nearest tile of the grid, where
+    /// loleaflet places the tile it gets back anyway.
+    void snapPosition(int twips, int& position)
+    {
+        position = std::round(static_cast<double>(position) / twips) * twips;
+    }
+}
+
 TileCache::TileCache(const std::string& docURL, const std::string& timestamp) :
     _docURL(docURL),
     _isEditing(false),
@@ -52,43 +115,58 @@ TileCache::TileCache(const std::string& docURL, const std::string& timestamp) :
     setup(timestamp);
 }
 
-std::unique_ptr<std::fstream> TileCache::lookupTile(int part, int width, int height, int tilePosX, int tilePosY, int tileWidth, int tileHeight)
+std::string TileCache::tilePath(const std::string& cachedName)
 {
-    std::string cachedName = cacheFileName(part, width, height, tilePosX, tilePosY, tileWidth, tileHeight);
-
     if (_hasUnsavedChanges)
     {
         // try the Editing cache first
-        std::string dirName = cacheDirName(true);
-        std::string fileName =  + "/" + cachedName;
-        File dir(dirName);
-
-        if (dir.exists() && dir.isDirectory() && File(fileName).exists())
-        {
-            std::unique_ptr<std::fstream> result(new std::fstream(fileName, std::ios::in));
-            return result;
-        }
+        std::string fileName = cacheDirName(true) + "/" + cachedName;
+        if (File(fileName).exists())
+            return fileName;
     }
 
     // skip tiles scheduled for removal from the Persistent cache (on save)
     if (_toBeRemoved.find(cachedName) != _toBeRemoved.end())
-        return nullptr;
+        return "";
 
     // default to the content of the Persistent cache
-    std::string dirName = cacheDirName(false);
-    File dir(dirName);
+    std::string fileName = cacheDirName(false) + "/" + cachedName;
+    if (File(fileName).exists())
+        return fileName;
 
-    if (!dir.exists() || !dir.isDirectory())
-        return nullptr;
+    return "";
+}
 
-    std::string fileName = dirName + "/" + cachedName;
+std::unique_ptr<std::fstream> TileCache::lookupTile(int part, int width, int height, int tilePosX, int tilePosY, int tileWidth, int tileHeight)
+{
+    const std::string fileName = tilePath(cacheFileName(part, width, height, tilePosX, tilePosY, tileWidth, tileHeight));
+    if (fileName.empty())
+        return nullptr;
 
     std::unique_ptr<std::fstream> result(new std::fstream(fileName, std::ios::in));
-
     return result;
 }
 
-void TileCache::saveTile(int part, int width, int height, int tilePosX, int tilePosY, int tileWidth, int tileHeight, const char *data, size_t size)
+Poco::UInt64 TileCache::lookupTileVersion(int part, int width, int height, int tilePosX, int tilePosY, int tileWidth, int tileHeight)
+{
+    const std::string cachedName = cacheFileName(part, width, height, tilePosX, tilePosY, tileWidth, tileHeight);
+    if (tilePath(cachedName).empty())
+        return 0;
+
+    const std::string key = toplevelCacheDirName() + "/" + cachedName;
+
+    std::unique_lock<std::mutex> lock(TileVersionsMutex);
+    TileVersion& tileVersion = TileVersions[key];
+    if (tileVersion._version == 0)
+    {
+        // Cached by an earlier run, we can't tell what the clients have.
+        tileVersion._version = ++LastTileVersion;
+    }
+
+    return tileVersion._version;
+}
+
+Poco::UInt64 TileCache::saveTile(int part, int width, int height, int tilePosX, int tilePosY, int tileWidth, int tileHeight, const char *data, size_t size)
 {
     if (_isEditing && !_hasUnsavedChanges)
         _hasUnsavedChanges = true;
@@ -97,11 +175,31 @@ void TileCache::saveTile(int part, int width, int height, int tilePosX, int tile
 
     File(dirName).createDirectories();
 
-    std::string fileName = dirName + "/" + cacheFileName(part, width, height, tilePosX, tilePosY, tileWidth, tileHeight);
+    const std::string cachedName = cacheFileName(part, width, height, tilePosX, tilePosY, tileWidth, tileHeight);
+    std::string fileName = dirName + "/" + cachedName;
 
     std::fstream outStream(fileName, std::ios::out);
     outStream.write(data, size);
     outStream.close();
+
+    SHA1Engine digestEngine;
+    digestEngine.update(data, size);
+    const std::string digest = DigestEngine::digestToHex(digestEngine.digest());
+    const std::string key = toplevelCacheDirName() + "/" + cachedName;
+
+    std::unique_lock<std::mutex> lock(TileVersionsMutex);
+    if (TileVersions.size() >= MaxTileVersions)
+        TileVersions.clear();
+
+    // Re-rendering an invalidated area often gives the same image, keep its version then.
+    TileVersion& tileVersion = TileVersions[key];
+    if (tileVersion._version == 0 || tileVersion._digest != digest)
+    {
+        tileVersion._version = ++LastTileVersion;
+        tileVersion._digest = digest;
+    }
+
+    return tileVersion._version;
 }
 
 std::string TileCache::getTextFile(std::string fileName)
@@ -278,6 +376,57 @@ void TileCache::invalidateTiles(const std::string& tiles)
     }
 }
 
+bool TileCache::normalizeZoom(int& tileWidth, int& tileHeight)
+{
+    const int oldTileWidth = tileWidth;
+    const int oldTileHeight = tileHeight;
+    snapZoom(tileWidth);
+    snapZoom(tileHeight);
+    return (tileWidth != oldTileWidth || tileHeight != oldTileHeight);
+}
+
+bool TileCache::normalizeTile(int& tilePosX, int& tilePosY, int& tileWidth, int& tileHeight)
+{
+    const int oldTilePosX = tilePosX;
+    const int oldTilePosY = tilePosY;
+    bool changed = normalizeZoom(tileWidth, tileHeight);
+    snapPosition(tileWidth, tilePosX);
+    snapPosition(tileHeight, tilePosY);
+    return changed || tilePosX != oldTilePosX || tilePosY != oldTilePosY;
+}
+
+void TileCache::countLookup(int width, int tileWidth, bool hit)
+{
+    const int zoom = snapZoom(tileWidth);
+
+    std::unique_lock<std::mutex> lock(ZoomStatisticsMutex);
+    auto& statistics = ZoomStatistics[std::make_pair(zoom, zoom < 0 ? 0 : width)];
+    if (hit)
+        ++statistics.first;
+    ++statistics.second;
+}
+
+std::string TileCache::getStatistics()
+{
+    std::ostringstream oss;
+
+    std::unique_lock<std::mutex> lock(ZoomStatisticsMutex);
+    for (const auto& it : ZoomStatistics)
+    {
+        if (oss.tellp() > 0)
+            oss << ' ';
+
+        if (it.first.first < 0)
+            oss << "other";
+        else
+            oss << "zoom=" << it.first.first << " size=" << it.first.second;
+
+        oss << " hits=" << it.second.first << '/' << it.second.second;
+    }
+
+    return oss.str();
+}
+
 std::string TileCache::toplevelCacheDirName()
 {
     SHA1Engine digestEngine;
@@ -11,13 +11,16 @@
 #define INCLUDED_TILECACHE_HPP
 
 #include <fstream>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <set>
 #include <string>
 
 #include <Poco/File.h>
 #include <Poco/Timestamp.h>
 #include <Poco/Mutex.h>
+#include <Poco/Types.h>
 
 using Poco::FastMutex;
 
@@ -29,6 +32,10 @@ The cache consists of 2 cache directories:
   * editing - that represents the document in the current state (with edits)
 
 The editing cache is cleared on startup, and copied to the persistent on each save.
+
+Each tile area also has a version, which changes only when the area is
+rendered with a different content. Clients that send the version they have
+can then be told that their tile is not modified, even after invalidations.
 */
 class TileCache
 {
@@ -39,7 +46,12 @@ public:
     TileCache(const std::string& docURL, const std::string& timestamp);
 
     std::unique_ptr<std::fstream> lookupTile(int part, int width, int height, int tilePosX, int tilePosY, int tileWidth, int tileHeight);
-    void saveTile(int part, int width, int height, int tilePosX, int tilePosY, int tileWidth, int tileHeight, const char *data, size_t size);
+
+    /// Version of the cached tile, 0 when it is not in the cache.
+    Poco::UInt64 lookupTileVersion(int part, int width, int height, int tilePosX, int tilePosY, int tileWidth, int tileHeight);
+
+    /// Returns the version of the saved content.
+    Poco::UInt64 saveTile(int part, int width, int height, int tilePosX, int tilePosY, int tileWidth, int tileHeight, const char *data, size_t size);
     std::string getTextFile(std::string fileName);
 
     /// Notify the cache that the document was saved - to copy tiles from the Editing cache to Persistent.
@@ -62,6 +74,21 @@ public:
 
     void invalidateTiles(int part, int x, int y, int width, int height);
 
+    /// Snap the tile size to the nearest canonical zoom level, when less
+    /// than half a level off. Returns true if it changed.
+    static bool normalizeZoom(int& tileWidth, int& tileHeight);
+
+    /// Snap the tile size like normalizeZoom, and the position to the
+    /// nearest tile of the grid. Returns true if any of the values changed.
+    static bool normalizeTile(int& tilePosX, int& tilePosY, int& tileWidth, int& tileHeight);
+
+    /// Account for a tile lookup by a client, for the hit rates per zoom level.
+    static void countLookup(int width, int tileWidth, bool hit);
+
+    /// The hit rates per zoom level and tile size in pixels,
+    /// like "zoom=10 size=256 hits=12/16 zoom=10 size=512 hits=3/4 other hits=0/2".
+    static std::string getStatistics();
+
 private:
     /// Toplevel cache dirname.
     std::string toplevelCacheDirName();
@@ -72,6 +99,9 @@ private:
     std::string cacheFileName(int part, int width, int height, int tilePosX, int tilePosY, int tileWidth, int tileHeight);
     bool parseCacheFileName(const std::string& fileName, int& part, int& width, int& height, int& tilePosX, int& tilePosY, int& tileWidth, int& tileHeight);
 
+    /// Path of the valid cached tile, or empty when there is none.
+    std::string tilePath(const std::string& cachedName);
+
     /// Extract location from fileName, and check if it intersects with [x, y, width, height].
     bool intersectsTile(const std::string& fileName, int part, int x, int y, int width, int height);
 
@@ -97,6 +127,24 @@ private:
     std::set<std::string> _toBeRemoved;
 
     Poco::FastMutex _cacheMutex;
+
+    struct TileVersion
+    {
+        Poco::UInt64 _version;
+        std::string _digest;
+    };
+
+    /// Versions of the tile areas, by cache dir and file name. Shared between
+    /// the sessions of a document, so reconnecting clients can revalidate.
+    static std::map<std::string, TileVersion> TileVersions;
+    static std::mutex TileVersionsMutex;
+    /// Seeded with the start time, so versions are not reused after a restart.
+    static Poco::UInt64 LastTileVersion;
+
+    /// Hits and lookups by zoom level and tile width in pixels,
+    /// zoom -1 for non-canonical tile sizes.
+    static std::map<std::pair<int, int>, std::pair<Poco::UInt64, Poco::UInt64>> ZoomStatistics;
+    static std::mutex ZoomStatisticsMutex;
 };
 
 #endif
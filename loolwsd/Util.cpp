@@ -8,10 +8,17 @@
  */
 
 #include <sys/poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #ifdef __linux
 #include <sys/prctl.h>
+#include <sys/signalfd.h>
 #endif
 
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
 #include <cstdlib>
 #include <cstring>
 #include <iomanip>
@@ -352,68 +359,224 @@ namespace Util
         }
     }
 
-    ssize_t writeFIFO(int nPipe, const char* pBuffer, ssize_t nSize)
+    namespace
     {
-        ssize_t nBytes = -1;
-        ssize_t nCount = 0;
+        /// The largest message we expect, to catch corrupt lengths.
+        constexpr uint32_t MaxMessageSize = 1024 * 1024;
 
-        while(true)
+        socklen_t getSocketAddress(const std::string& name, struct sockaddr_un& address)
         {
-            nBytes = write(nPipe, pBuffer + nCount, nSize - nCount);
-            if (nBytes < 0)
+            // Abstract: a leading NUL, no file, and gone with the last socket.
+            std::memset(&address, 0, sizeof(address));
+            address.sun_family = AF_UNIX;
+            const size_t length = std::min(name.size(), sizeof(address.sun_path) - 1);
+            std::memcpy(address.sun_path + 1, name.c_str(), length);
+            return offsetof(struct sockaddr_un, sun_path) + 1 + length;
+        }
+    }
+
+    int listenSocket(const std::string& name)
+    {
+        const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0)
+        {
+            Log::error("Error: failed to create socket [" + name + "].");
+            return -1;
+        }
+
+        struct sockaddr_un address;
+        const socklen_t length = getSocketAddress(name, address);
+        if (bind(fd, reinterpret_cast<struct sockaddr*>(&address), length) < 0 ||
+            listen(fd, SOMAXCONN) < 0)
+        {
+            Log::error("Error: failed to listen on socket [" + name + "].");
+            close(fd);
+            return -1;
+        }
+
+        return fd;
+    }
+
+    int connectSocket(const std::string& name)
+    {
+        const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0)
+        {
+            Log::error("Error: failed to create socket [" + name + "].");
+            return -1;
+        }
+
+        struct sockaddr_un address;
+        const socklen_t length = getSocketAddress(name, address);
+        if (connect(fd, reinterpret_cast<struct sockaddr*>(&address), length) < 0)
+        {
+            Log::error("Error: failed to connect to socket [" + name + "].");
+            close(fd);
+            return -1;
+        }
+
+        return fd;
+    }
+
+    int acceptSocket(const int socket, const int timeoutMs)
+    {
+        struct pollfd aPoll;
+        aPoll.fd = socket;
+        aPoll.events = POLLIN;
+        aPoll.revents = 0;
+
+        int nPoll;
+        do
+        {
+            nPoll = poll(&aPoll, 1, timeoutMs);
+        }
+        while (nPoll < 0 && errno == EINTR);
+
+        if (nPoll <= 0)
+            return -1;
+
+        return accept4(socket, nullptr, nullptr, SOCK_CLOEXEC);
+    }
+
+    bool sendMessage(const int socket, const std::string& message)
+    {
+        uint32_t size = message.size();
+        struct iovec iov[2];
+        iov[0].iov_base = &size;
+        iov[0].iov_len = sizeof(size);
+        iov[1].iov_base = const_cast<char*>(message.data());
+        iov[1].iov_len = message.size();
+
+        struct msghdr msg;
+        std::memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = 2;
+
+        size_t left = iov[0].iov_len + iov[1].iov_len;
+        while (left > 0)
+        {
+            // No SIGPIPE when the peer is gone, we get EPIPE.
+            const ssize_t bytes = sendmsg(socket, &msg, MSG_NOSIGNAL);
+            if (bytes < 0)
             {
                 if (errno == EINTR || errno == EAGAIN)
                     continue;
 
-                nCount = -1;
-                break;
+                return false;
             }
-            else if ( nCount + nBytes < nSize )
+
+            left -= bytes;
+
+            // Skip what was sent, on the rare partial send.
+            size_t sent = bytes;
+            while (msg.msg_iovlen > 0 && sent >= msg.msg_iov->iov_len)
             {
-                nCount += nBytes;
+                sent -= msg.msg_iov->iov_len;
+                ++msg.msg_iov;
+                --msg.msg_iovlen;
             }
-            else
+
+            if (msg.msg_iovlen > 0)
             {
-                nCount = nBytes;
-                break;
+                msg.msg_iov->iov_base = static_cast<char*>(msg.msg_iov->iov_base) + sent;
+                msg.msg_iov->iov_len -= sent;
             }
         }
 
-        return nCount;
+        return true;
     }
 
-    ssize_t readFIFO(int nPipe, char* pBuffer, ssize_t nSize)
+    bool MessageReader::read(std::vector<std::string>& messages)
     {
-        ssize_t nBytes;
+        char buffer[READ_BUFFER_SIZE * 8];
+        ssize_t bytes;
         do
         {
-            nBytes = read(nPipe, pBuffer, nSize);
+            bytes = recv(_socket, buffer, sizeof(buffer), MSG_DONTWAIT);
         }
-        while ( nBytes < 0 && errno == EINTR );
+        while (bytes < 0 && errno == EINTR);
+
+        if (bytes == 0 || (bytes < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+            return false;
 
-        return nBytes;
+        if (bytes > 0)
+            _buffer.append(buffer, bytes);
+
+        uint32_t size;
+        while (_buffer.size() >= sizeof(size))
+        {
+            std::memcpy(&size, _buffer.data(), sizeof(size));
+            if (size > MaxMessageSize)
+            {
+                Log::error("Error: message of " + std::to_string(size) + " bytes on socket.");
+                return false;
+            }
+
+            if (_buffer.size() < sizeof(size) + size)
+                break;
+
+            messages.emplace_back(_buffer, sizeof(size), size);
+            _buffer.erase(0, sizeof(size) + size);
+        }
+
+        return true;
     }
 
-    ssize_t readMessage(int nPipe, char* pBuffer, ssize_t nSize)
+    bool MessageReader::read(std::vector<std::string>& messages, const int timeoutMs)
     {
-        struct pollfd aPoll;
+        const auto count = messages.size();
+        const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+        while (messages.size() == count)
+        {
+            const auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+                                  deadline - std::chrono::steady_clock::now()).count();
+            if (left <= 0)
+                return false;
+
+            struct pollfd aPoll;
+            aPoll.fd = _socket;
+            aPoll.events = POLLIN;
+            aPoll.revents = 0;
+            if ((poll(&aPoll, 1, left) < 0 && errno != EINTR) || !read(messages))
+                return false;
+        }
 
-        aPoll.fd = nPipe;
-        aPoll.events = POLLIN;
-        aPoll.revents = 0;
+        return true;
+    }
 
-        const int nPoll = poll(&aPoll, 1, CHILD_TIMEOUT_SECS * 1000);
-        if ( nPoll < 0 )
-            return -1;
+#ifdef __linux
+    bool parseCpuList(const std::string& list, cpu_set_t& cpus)
+    {
+        CPU_ZERO(&cpus);
+
+        std::istringstream iss(list);
+        std::string range;
+        while (std::getline(iss, range, ','))
+        {
+            char* end = nullptr;
+            const unsigned long first = std::strtoul(range.c_str(), &end, 10);
+            if (end == range.c_str())
+                return false;
+
+            unsigned long last = first;
+            if (*end == '-')
+            {
+                const char* start = end + 1;
+                last = std::strtoul(start, &end, 10);
+                if (end == start)
+                    return false;
+            }
 
-        if ( nPoll == 0 )
-            errno = ETIME;
+            if ((*end != '\0' && *end != '\n') || last < first || last >= CPU_SETSIZE)
+                return false;
 
-        if( (aPoll.revents & POLLIN) != 0 )
-            return readFIFO(nPipe, pBuffer, nSize);
+            for (auto cpu = first; cpu <= last; ++cpu)
+                CPU_SET(cpu, &cpus);
+        }
 
-        return -1;
+        return CPU_COUNT(&cpus) > 0;
     }
+#endif
 
     static
     void handleTerminationSignal(const int aSignal)
@@ -447,6 +610,51 @@ namespace Util
 #endif
     }
 
+#ifdef __linux
+    static
+    void getLoopSignals(sigset_t& signals)
+    {
+        sigemptyset(&signals);
+        sigaddset(&signals, SIGTERM);
+        sigaddset(&signals, SIGINT);
+        sigaddset(&signals, SIGQUIT);
+        sigaddset(&signals, SIGHUP);
+        sigaddset(&signals, SIGCHLD);
+    }
+
+    int openSignalFd()
+    {
+        sigset_t signals;
+        getLoopSignals(signals);
+        if (sigprocmask(SIG_BLOCK, &signals, nullptr) < 0)
+            return -1;
+
+        return signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    }
+
+    bool readSignalFd(const int signalFd)
+    {
+        bool childExited = false;
+        struct signalfd_siginfo info;
+        while (read(signalFd, &info, sizeof(info)) == sizeof(info))
+        {
+            if (info.ssi_signo == SIGCHLD)
+                childExited = true;
+            else
+                handleTerminationSignal(info.ssi_signo);
+        }
+
+        return childExited;
+    }
+
+    void unblockSignals()
+    {
+        sigset_t signals;
+        getLoopSignals(signals);
+        sigprocmask(SIG_UNBLOCK, &signals, nullptr);
+    }
+#endif
+
     static
     void handleFatalSignal(const int aSignal)
     {
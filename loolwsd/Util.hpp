@@ -14,6 +14,11 @@
 #include <sstream>
 #include <functional>
 #include <memory>
+#include <vector>
+
+#ifdef __linux
+#include <sched.h>
+#endif
 
 #include <Poco/File.h>
 #include <Poco/Path.h>
@@ -76,16 +81,46 @@ namespace Util
     /// Call WebSocket::shutdown() ignoring Poco::IOException.
     void shutdownWebSocket(std::shared_ptr<Poco::Net::WebSocket> ws);
 
-    ssize_t writeFIFO(const int nPipe, const char* pBuffer, ssize_t nSize);
-    inline
-    ssize_t writeFIFO(const int nPipe, const std::string& message)
+    /// wsd, the broker and the kits talk over Unix stream sockets in the
+    /// abstract namespace, with messages prefixed by their length.
+
+    /// Listens on the abstract socket of the given name. Returns -1 on error.
+    int listenSocket(const std::string& name);
+    /// Connects to the abstract socket of the given name. Returns -1 on error.
+    int connectSocket(const std::string& name);
+    /// Accepts a connection, waiting at most timeoutMs. Returns -1 on error or timeout.
+    int acceptSocket(const int socket, const int timeoutMs);
+
+    /// Sends a message with its length. Not safe for concurrent senders on
+    /// the same socket. Returns false on error, like when the peer is gone.
+    bool sendMessage(const int socket, const std::string& message);
+
+    /// Reassembles the messages sent with sendMessage.
+    class MessageReader
     {
-        return writeFIFO(nPipe, message.c_str(), message.size());
-    }
+    public:
+        MessageReader(const int socket) :
+            _socket(socket)
+        {
+        }
 
-    ssize_t readFIFO(int nPipe, char* pBuffer, ssize_t nSize);
+        /// Reads what the socket has, with one syscall, and appends the
+        /// complete messages. Returns false on EOF, when the peer is gone, or error.
+        bool read(std::vector<std::string>& messages);
 
-    ssize_t readMessage(int nPipe, char* pBuffer, ssize_t nSize);
+        /// Waits at most timeoutMs for at least one complete message.
+        bool read(std::vector<std::string>& messages, const int timeoutMs);
+
+    private:
+        const int _socket;
+        std::string _buffer;
+    };
+
+#ifdef __linux
+    /// Parses a list of CPUs, like "0-3,8", as in /sys and for taskset.
+    /// Returns false when malformed or empty.
+    bool parseCpuList(const std::string& list, cpu_set_t& cpus);
+#endif
 
     /// Safely remove a file or directory.
     /// Supresses exception when the file is already removed.
@@ -117,6 +152,21 @@ namespace Util
     void setTerminationSignals();
     void setFatalSignals();
 
+#ifdef __linux
+    /// Blocks the termination signals and SIGCHLD, for the main loop to
+    /// read them from the returned signalfd instead, or -1 on failure.
+    /// Call it before any thread starts: they inherit the mask, as do
+    /// the child processes.
+    int openSignalFd();
+
+    /// Reads what is pending on the signalfd and handles the termination
+    /// signals. Returns whether SIGCHLD was among them.
+    bool readSignalFd(int signalFd);
+
+    /// Unblocks the signals again, in the child processes.
+    void unblockSignals();
+#endif
+
     int getChildStatus(const int nCode);
     int getSignalStatus(const int nCode);
 };
@@ -0,0 +1,130 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#include <cppunit/extensions/HelperMacros.h>
+
+#include <LOKitHelper.hpp>
+
+/// Tests how the kit coalesces the callbacks of a burst. Needs no server.
+class CallbackTest : public CPPUNIT_NS::TestFixture
+{
+    CPPUNIT_TEST_SUITE(CallbackTest);
+    CPPUNIT_TEST(testInvalidationUnion);
+    CPPUNIT_TEST(testInvalidationEmpty);
+    CPPUNIT_TEST(testInvalidationSessions);
+    CPPUNIT_TEST(testPartChangeBarrier);
+    CPPUNIT_TEST(testStateChanged);
+    CPPUNIT_TEST_SUITE_END();
+
+    void testInvalidationUnion();
+    void testInvalidationEmpty();
+    void testInvalidationSessions();
+    void testPartChangeBarrier();
+    void testStateChanged();
+
+    static
+    void checkPending(const LOKitHelper::PendingCallback& callback, const long intSessionId,
+                      const int nType, const std::string& payload);
+};
+
+void CallbackTest::checkPending(const LOKitHelper::PendingCallback& callback, const long intSessionId,
+                                const int nType, const std::string& payload)
+{
+    CPPUNIT_ASSERT_EQUAL(intSessionId, callback._intSessionId);
+    CPPUNIT_ASSERT_EQUAL(nType, callback._nType);
+    CPPUNIT_ASSERT_EQUAL(payload, callback._payload);
+}
+
+void CallbackTest::testInvalidationUnion()
+{
+    // Two areas of a view become the rectangle around both.
+    std::vector<LOKitHelper::PendingCallback> pending;
+    LOKitHelper::coalesceCallback(pending, 1, LOK_CALLBACK_INVALIDATE_TILES, "0, 0, 100, 100");
+    LOKitHelper::coalesceCallback(pending, 1, LOK_CALLBACK_TEXT_SELECTION, "");
+    LOKitHelper::coalesceCallback(pending, 1, LOK_CALLBACK_INVALIDATE_TILES, "50, 200, 100, 100");
+
+    // Last, as the newest of them.
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(2), pending.size());
+    checkPending(pending[0], 1, LOK_CALLBACK_TEXT_SELECTION, "");
+    checkPending(pending[1], 1, LOK_CALLBACK_INVALIDATE_TILES, "0, 0, 150, 300");
+}
+
+void CallbackTest::testInvalidationEmpty()
+{
+    // EMPTY invalidates everything, whichever comes first.
+    std::vector<LOKitHelper::PendingCallback> pending;
+    LOKitHelper::coalesceCallback(pending, 1, LOK_CALLBACK_INVALIDATE_TILES, "0, 0, 100, 100");
+    LOKitHelper::coalesceCallback(pending, 1, LOK_CALLBACK_INVALIDATE_TILES, "EMPTY");
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(1), pending.size());
+    checkPending(pending[0], 1, LOK_CALLBACK_INVALIDATE_TILES, "EMPTY");
+
+    LOKitHelper::coalesceCallback(pending, 1, LOK_CALLBACK_INVALIDATE_TILES, "0, 0, 100, 100");
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(1), pending.size());
+    checkPending(pending[0], 1, LOK_CALLBACK_INVALIDATE_TILES, "EMPTY");
+}
+
+void CallbackTest::testInvalidationSessions()
+{
+    // Each view gets its own invalidations.
+    std::vector<LOKitHelper::PendingCallback> pending;
+    LOKitHelper::coalesceCallback(pending, 1, LOK_CALLBACK_INVALIDATE_TILES, "0, 0, 100, 100");
+    LOKitHelper::coalesceCallback(pending, 2, LOK_CALLBACK_INVALIDATE_TILES, "100, 100, 100, 100");
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(2), pending.size());
+    checkPending(pending[0], 1, LOK_CALLBACK_INVALIDATE_TILES, "0, 0, 100, 100");
+    checkPending(pending[1], 2, LOK_CALLBACK_INVALIDATE_TILES, "100, 100, 100, 100");
+}
+
+void CallbackTest::testPartChangeBarrier()
+{
+    // The invalidations before a part switch of the view are of another part.
+    std::vector<LOKitHelper::PendingCallback> pending;
+    LOKitHelper::coalesceCallback(pending, 1, LOK_CALLBACK_INVALIDATE_TILES, "0, 0, 100, 100");
+    LOKitHelper::coalesceCallback(pending, 1, LOK_CALLBACK_SET_PART, "1");
+    LOKitHelper::coalesceCallback(pending, 1, LOK_CALLBACK_INVALIDATE_TILES, "0, 0, 200, 200");
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(3), pending.size());
+    checkPending(pending[0], 1, LOK_CALLBACK_INVALIDATE_TILES, "0, 0, 100, 100");
+    checkPending(pending[1], 1, LOK_CALLBACK_SET_PART, "1");
+    checkPending(pending[2], 1, LOK_CALLBACK_INVALIDATE_TILES, "0, 0, 200, 200");
+
+    // But not those before the part switch of another view.
+    pending.clear();
+    LOKitHelper::coalesceCallback(pending, 1, LOK_CALLBACK_INVALIDATE_TILES, "0, 0, 100, 100");
+    LOKitHelper::coalesceCallback(pending, 2, LOK_CALLBACK_SET_PART, "1");
+    LOKitHelper::coalesceCallback(pending, 1, LOK_CALLBACK_INVALIDATE_TILES, "0, 0, 200, 200");
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(2), pending.size());
+    checkPending(pending[0], 2, LOK_CALLBACK_SET_PART, "1");
+    checkPending(pending[1], 1, LOK_CALLBACK_INVALIDATE_TILES, "0, 0, 200, 200");
+
+    // Parts added or removed concern all the views.
+    pending.clear();
+    LOKitHelper::coalesceCallback(pending, 1, LOK_CALLBACK_INVALIDATE_TILES, "0, 0, 100, 100");
+    LOKitHelper::coalesceCallback(pending, LOKitHelper::AllSessions, LOK_CALLBACK_DOCUMENT_SIZE_CHANGED, "1000, 2000");
+    LOKitHelper::coalesceCallback(pending, 1, LOK_CALLBACK_INVALIDATE_TILES, "0, 0, 200, 200");
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(3), pending.size());
+    checkPending(pending[0], 1, LOK_CALLBACK_INVALIDATE_TILES, "0, 0, 100, 100");
+    checkPending(pending[2], 1, LOK_CALLBACK_INVALIDATE_TILES, "0, 0, 200, 200");
+}
+
+void CallbackTest::testStateChanged()
+{
+    // Only the newest value of each UNO command is sent, in its place.
+    std::vector<LOKitHelper::PendingCallback> pending;
+    LOKitHelper::coalesceCallback(pending, 1, LOK_CALLBACK_STATE_CHANGED, ".uno:Bold=true");
+    LOKitHelper::coalesceCallback(pending, 1, LOK_CALLBACK_STATE_CHANGED, ".uno:Italic=true");
+    LOKitHelper::coalesceCallback(pending, 1, LOK_CALLBACK_STATE_CHANGED, ".uno:Bold=false");
+    LOKitHelper::coalesceCallback(pending, 2, LOK_CALLBACK_STATE_CHANGED, ".uno:Bold=true");
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(3), pending.size());
+    checkPending(pending[0], 1, LOK_CALLBACK_STATE_CHANGED, ".uno:Italic=true");
+    checkPending(pending[1], 1, LOK_CALLBACK_STATE_CHANGED, ".uno:Bold=false");
+    checkPending(pending[2], 2, LOK_CALLBACK_STATE_CHANGED, ".uno:Bold=true");
+}
+
+CPPUNIT_TEST_SUITE_REGISTRATION(CallbackTest);
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
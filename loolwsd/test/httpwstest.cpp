@@ -33,11 +33,15 @@ class HTTPWSTest : public CPPUNIT_NS::TestFixture
     CPPUNIT_TEST(testPaste);
     CPPUNIT_TEST(testLargePaste);
     CPPUNIT_TEST(testRenderingOptions);
+    CPPUNIT_TEST(testViewport);
+    CPPUNIT_TEST(testTileNotModified);
     CPPUNIT_TEST_SUITE_END();
 
     void testPaste();
     void testLargePaste();
     void testRenderingOptions();
+    void testViewport();
+    void testTileNotModified();
 
     static
     void sendTextFrame(Poco::Net::WebSocket& socket, const std::string& string);
@@ -181,6 +185,86 @@ void HTTPWSTest::testRenderingOptions()
     CPPUNIT_ASSERT(height < 20000);
 }
 
+void HTTPWSTest::testViewport()
+{
+    const std::string documentPath = TDOC "/hello.odt";
+    const std::string documentURL = "file://" + Poco::Path(documentPath).makeAbsolute().toString();
+    sendTextFrame(_socket, "load url=" + documentURL);
+
+    // Subscribe to 2x2 tiles, then repeat it: the second time nothing is missing.
+    const std::string viewport = "viewport part=0 width=256 height=256 tilewidth=3840 tileheight=3840 x=0 y=0 viewwidth=7680 viewheight=7680";
+    sendTextFrame(_socket, viewport);
+    sendTextFrame(_socket, viewport);
+
+    // The kit answers in order, so once this is answered, all the tiles
+    // of both viewports are here, whether from the cache or rendered.
+    sendTextFrame(_socket, "gettextselection mimetype=text/plain;charset=utf-8");
+
+    int tiles = 0;
+    bool marker = false;
+    int flags;
+    int n;
+    std::vector<char> buffer(1024 * 1024);
+    do
+    {
+        n = _socket.receiveFrame(buffer.data(), buffer.size(), flags);
+        if (n > 0)
+        {
+            const std::string line = LOOLProtocol::getFirstLine(buffer.data(), n);
+            if (line.find("tile: ") == 0)
+                ++tiles;
+            else if (line.find("textselectioncontent: ") == 0)
+                marker = true;
+        }
+    }
+    while (n > 0 && !marker && (flags & Poco::Net::WebSocket::FRAME_OP_BITMASK) != Poco::Net::WebSocket::FRAME_OP_CLOSE);
+    sendTextFrame(_socket, "disconnect");
+    _socket.shutdown();
+    CPPUNIT_ASSERT(marker);
+    CPPUNIT_ASSERT_EQUAL(4, tiles);
+}
+
+void HTTPWSTest::testTileNotModified()
+{
+    const std::string documentPath = TDOC "/hello.odt";
+    const std::string documentURL = "file://" + Poco::Path(documentPath).makeAbsolute().toString();
+    sendTextFrame(_socket, "load url=" + documentURL);
+
+    const std::string tile = "tile part=0 width=256 height=256 tileposx=0 tileposy=0 tilewidth=3840 tileheight=3840";
+    sendTextFrame(_socket, tile);
+
+    std::string version;
+    std::string notModified;
+    int flags;
+    int n;
+    std::vector<char> buffer(1024 * 1024);
+    do
+    {
+        n = _socket.receiveFrame(buffer.data(), buffer.size(), flags);
+        if (n > 0)
+        {
+            const std::string line = LOOLProtocol::getFirstLine(buffer.data(), n);
+            Poco::StringTokenizer tokens(line, " ", Poco::StringTokenizer::TOK_IGNORE_EMPTY | Poco::StringTokenizer::TOK_TRIM);
+            if (tokens[0] == "tile:" && version.empty())
+            {
+                // Ask again, claiming the version we just got.
+                version = tokens[tokens.count() - 1];
+                sendTextFrame(_socket, tile + " " + version);
+            }
+            else if (tokens[0] == "tilenotmodified:")
+            {
+                notModified = line;
+                break;
+            }
+        }
+    }
+    while (n > 0 && (flags & Poco::Net::WebSocket::FRAME_OP_BITMASK) != Poco::Net::WebSocket::FRAME_OP_CLOSE);
+    sendTextFrame(_socket, "disconnect");
+    _socket.shutdown();
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(0), version.find("ver="));
+    CPPUNIT_ASSERT(notModified.find(version) != std::string::npos);
+}
+
 void HTTPWSTest::sendTextFrame(Poco::Net::WebSocket& socket, const std::string& string)
 {
     socket.sendFrame(string.data(), string.size());
@@ -0,0 +1,152 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstring>
+
+#include <cppunit/extensions/HelperMacros.h>
+
+#include <Util.hpp>
+
+/// Tests how Util::MessageReader reassembles the messages of
+/// Util::sendMessage, as they come in pieces. Needs no server.
+class MessageReaderTest : public CPPUNIT_NS::TestFixture
+{
+    int _sockets[2];
+
+    CPPUNIT_TEST_SUITE(MessageReaderTest);
+    CPPUNIT_TEST(testWholeMessages);
+    CPPUNIT_TEST(testPartialMessages);
+    CPPUNIT_TEST(testEmptyMessage);
+    CPPUNIT_TEST(testEof);
+    CPPUNIT_TEST_SUITE_END();
+
+    void testWholeMessages();
+    void testPartialMessages();
+    void testEmptyMessage();
+    void testEof();
+
+    /// Writes a piece of the frame of a message, as sendMessage would.
+    void writeRaw(const std::string& data);
+
+    static
+    std::string frame(const std::string& message);
+
+public:
+    void setUp()
+    {
+        CPPUNIT_ASSERT_EQUAL(0, socketpair(AF_UNIX, SOCK_STREAM, 0, _sockets));
+    }
+
+    void tearDown()
+    {
+        close(_sockets[0]);
+        if (_sockets[1] >= 0)
+            close(_sockets[1]);
+    }
+};
+
+std::string MessageReaderTest::frame(const std::string& message)
+{
+    const uint32_t size = message.size();
+    std::string result(sizeof(size), '\0');
+    std::memcpy(&result[0], &size, sizeof(size));
+    return result + message;
+}
+
+void MessageReaderTest::writeRaw(const std::string& data)
+{
+    CPPUNIT_ASSERT_EQUAL(static_cast<ssize_t>(data.size()), write(_sockets[1], data.data(), data.size()));
+}
+
+void MessageReaderTest::testWholeMessages()
+{
+    // Several messages in one read.
+    CPPUNIT_ASSERT(Util::sendMessage(_sockets[1], "123 hello"));
+    CPPUNIT_ASSERT(Util::sendMessage(_sockets[1], "123 ready"));
+
+    Util::MessageReader reader(_sockets[0]);
+    std::vector<std::string> messages;
+    CPPUNIT_ASSERT(reader.read(messages));
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(2), messages.size());
+    CPPUNIT_ASSERT_EQUAL(std::string("123 hello"), messages[0]);
+    CPPUNIT_ASSERT_EQUAL(std::string("123 ready"), messages[1]);
+
+    // Nothing more to read is not an error.
+    messages.clear();
+    CPPUNIT_ASSERT(reader.read(messages));
+    CPPUNIT_ASSERT(messages.empty());
+}
+
+void MessageReaderTest::testPartialMessages()
+{
+    const std::string first = frame("thread 1 file:///a.odt 5");
+    const std::string second = frame("thread 2 file:///b.odt 6");
+    Util::MessageReader reader(_sockets[0]);
+    std::vector<std::string> messages;
+
+    // Only part of the length.
+    writeRaw(first.substr(0, 2));
+    CPPUNIT_ASSERT(reader.read(messages));
+    CPPUNIT_ASSERT(messages.empty());
+
+    // The length, and part of the message.
+    writeRaw(first.substr(2, 8));
+    CPPUNIT_ASSERT(reader.read(messages));
+    CPPUNIT_ASSERT(messages.empty());
+
+    // The rest of it, and the start of the next one.
+    writeRaw(first.substr(10) + second.substr(0, 5));
+    CPPUNIT_ASSERT(reader.read(messages));
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(1), messages.size());
+    CPPUNIT_ASSERT_EQUAL(std::string("thread 1 file:///a.odt 5"), messages[0]);
+
+    writeRaw(second.substr(5));
+    CPPUNIT_ASSERT(reader.read(messages));
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(2), messages.size());
+    CPPUNIT_ASSERT_EQUAL(std::string("thread 2 file:///b.odt 6"), messages[1]);
+}
+
+void MessageReaderTest::testEmptyMessage()
+{
+    CPPUNIT_ASSERT(Util::sendMessage(_sockets[1], ""));
+    CPPUNIT_ASSERT(Util::sendMessage(_sockets[1], "eof"));
+
+    Util::MessageReader reader(_sockets[0]);
+    std::vector<std::string> messages;
+    CPPUNIT_ASSERT(reader.read(messages, 1000));
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(2), messages.size());
+    CPPUNIT_ASSERT(messages[0].empty());
+    CPPUNIT_ASSERT_EQUAL(std::string("eof"), messages[1]);
+}
+
+void MessageReaderTest::testEof()
+{
+    // What came before the peer left is still read.
+    CPPUNIT_ASSERT(Util::sendMessage(_sockets[1], "123 url empty"));
+    writeRaw(frame("lost").substr(0, 6));
+    close(_sockets[1]);
+    _sockets[1] = -1;
+
+    Util::MessageReader reader(_sockets[0]);
+    std::vector<std::string> messages;
+    CPPUNIT_ASSERT(reader.read(messages));
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(1), messages.size());
+    CPPUNIT_ASSERT_EQUAL(std::string("123 url empty"), messages[0]);
+
+    CPPUNIT_ASSERT(!reader.read(messages));
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(1), messages.size());
+}
+
+CPPUNIT_TEST_SUITE_REGISTRATION(MessageReaderTest);
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */